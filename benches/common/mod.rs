@@ -0,0 +1,11 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Helpers shared by the benchmarks.
+
+/// Initializes ffmpeg, printing its versions once so results can be compared across them.
+pub fn init() {
+    static PRINT: std::sync::Once = std::sync::Once::new();
+    let ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
+    PRINT.call_once(|| eprintln!("ffmpeg versions:{}", ffmpeg.versions()));
+}
@@ -0,0 +1,69 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Decoding benchmarks: frames per second by decoder thread count.
+
+mod common;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use cstr::cstr;
+use moonfire_ffmpeg::avcodec::{DecoderOptions, OwnedPacket};
+use moonfire_ffmpeg::avformat::InputFormatContext;
+use moonfire_ffmpeg::avutil::{Dictionary, VideoFrame};
+
+/// Decodes the whole clip from memory (so demuxing isn't measured), returning the number of
+/// frames. The decoder is flushed afterward so it can be reused.
+fn decode_all(
+    dec: &moonfire_ffmpeg::avcodec::DecodeContext,
+    pkts: &[OwnedPacket],
+    frame: &mut VideoFrame,
+) -> usize {
+    let mut n = 0;
+    for p in pkts {
+        let mut frames = dec.decode(p, frame).unwrap();
+        while frames.next().unwrap().is_some() {
+            n += 1;
+        }
+    }
+    dec.drain().unwrap();
+    let mut frames = dec.frames(frame);
+    while frames.next().unwrap().is_some() {
+        n += 1;
+    }
+    dec.flush();
+    n
+}
+
+fn decode(c: &mut Criterion) {
+    common::init();
+    let mut dict = Dictionary::new();
+    let mut ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+    ctx.find_stream_info().unwrap();
+    let mut pkts = Vec::new();
+    loop {
+        match ctx.read_frame() {
+            Ok(p) => pkts.push(p.detach().unwrap()),
+            Err(e) if e.is_eof() => break,
+            Err(e) => panic!("{}", e),
+        }
+    }
+    let mut frame = VideoFrame::empty().unwrap();
+    let mut group = c.benchmark_group("decode");
+    group.throughput(Throughput::Elements(pkts.len() as u64));
+    for &threads in &[1, 2, 4] {
+        let opts = DecoderOptions::new().thread_count(threads);
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut Dictionary::new())
+            .unwrap();
+        group.bench_with_input(BenchmarkId::from_parameter(threads), &dec, |b, dec| {
+            b.iter(|| decode_all(dec, &pkts, &mut frame))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, decode);
+criterion_main!(benches);
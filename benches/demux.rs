@@ -0,0 +1,111 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Demuxing benchmarks: startup cost, file vs `SliceIoContext` input, and per-packet
+//! `read_frame` vs batched `read_frames`.
+
+mod common;
+
+use criterion::{criterion_group, criterion_main, BatchSize, Criterion};
+use cstr::cstr;
+use moonfire_ffmpeg::avcodec::PacketBatch;
+use moonfire_ffmpeg::avformat::{InputFormatContext, SliceIoContext};
+use moonfire_ffmpeg::avutil::Dictionary;
+
+static CLIP: &[u8] = include_bytes!("../src/testdata/clip.mp4");
+
+fn open() -> InputFormatContext<'static> {
+    let mut dict = Dictionary::new();
+    InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap()
+}
+
+fn read_all(ctx: &InputFormatContext) -> usize {
+    let mut bytes = 0;
+    loop {
+        match ctx.read_frame() {
+            Ok(p) => bytes += p.data().map(|d| d.len()).unwrap_or(0),
+            Err(e) if e.is_eof() => break,
+            Err(e) => panic!("{}", e),
+        }
+    }
+    bytes
+}
+
+fn open_find_stream_info(c: &mut Criterion) {
+    common::init();
+    c.bench_function("open_find_stream_info", |b| {
+        b.iter(|| {
+            let mut ctx = open();
+            ctx.find_stream_info().unwrap();
+            ctx
+        })
+    });
+}
+
+fn read_frame(c: &mut Criterion) {
+    common::init();
+    c.bench_function("read_frame", |b| {
+        b.iter_batched(open, |ctx| read_all(&ctx), BatchSize::SmallInput)
+    });
+}
+
+/// Opens and reads the whole file, for comparison with `open_read_frame_slice`.
+fn open_read_frame_file(c: &mut Criterion) {
+    common::init();
+    c.bench_function("open_read_frame_file", |b| b.iter(|| read_all(&open())));
+}
+
+/// Like `open_read_frame_file`, but from memory, so that the difference is the cost of file
+/// I/O vs. the `IoContext` callbacks. (The context borrows the `SliceIoContext`, so opening
+/// can't be moved to the setup.)
+fn open_read_frame_slice(c: &mut Criterion) {
+    common::init();
+    c.bench_function("open_read_frame_slice", |b| {
+        b.iter_batched_ref(
+            || SliceIoContext::new(CLIP),
+            |io_ctx| {
+                let mut dict = Dictionary::new();
+                let ctx =
+                    InputFormatContext::with_io_context(cstr!(""), io_ctx, &mut dict).unwrap();
+                read_all(&ctx)
+            },
+            BatchSize::SmallInput,
+        )
+    });
+}
+
+fn read_frames(c: &mut Criterion) {
+    common::init();
+    let mut batch = PacketBatch::new(64).unwrap();
+    c.bench_function("read_frames", |b| {
+        b.iter_batched(
+            open,
+            |mut ctx| {
+                let mut bytes = 0;
+                loop {
+                    match ctx.read_frames(&mut batch, 64) {
+                        Ok(_) => {
+                            for i in batch.infos() {
+                                bytes += i.data().map(|d| d.len()).unwrap_or(0);
+                            }
+                        }
+                        Err(e) if e.is_eof() => break,
+                        Err(e) => panic!("{}", e),
+                    }
+                }
+                bytes
+            },
+            BatchSize::SmallInput,
+        )
+    });
+}
+
+criterion_group!(
+    benches,
+    open_find_stream_info,
+    read_frame,
+    open_read_frame_file,
+    open_read_frame_slice,
+    read_frames
+);
+criterion_main!(benches);
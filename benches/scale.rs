@@ -0,0 +1,75 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Scaling benchmarks: `Scaler::scale` by destination format, size, and band count.
+
+mod common;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use cstr::cstr;
+use moonfire_ffmpeg::avformat::InputFormatContext;
+use moonfire_ffmpeg::avutil::{Dictionary, ImageDimensions, PixelFormat, VideoFrame};
+use moonfire_ffmpeg::swscale::{Scaler, ScalerOptions};
+
+/// Returns the first decoded frame of the test clip.
+fn first_frame() -> VideoFrame {
+    let mut dict = Dictionary::new();
+    let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+    let dec = ctx
+        .streams()
+        .get(0)
+        .codecpar()
+        .new_decoder(&mut Dictionary::new())
+        .unwrap();
+    let mut frame = VideoFrame::empty().unwrap();
+    loop {
+        let pkt = ctx.read_frame().unwrap();
+        if dec.decode_video(&pkt, &mut frame).unwrap() {
+            return frame;
+        }
+    }
+}
+
+fn scale(c: &mut Criterion) {
+    common::init();
+    let src = first_frame();
+    let src_dims = src.dims();
+    let formats = [
+        ("rgb24", PixelFormat::rgb24()),
+        ("bgr24", PixelFormat::bgr24()),
+        ("yuv420p", PixelFormat::yuv420p()),
+    ];
+    let sizes = [
+        ("full", src_dims.width, src_dims.height),
+        ("half", src_dims.width / 2, src_dims.height / 2),
+        ("thumb", 320, 180),
+    ];
+    let mut group = c.benchmark_group("scale");
+    group.throughput(Throughput::Elements(1));
+    for &(fmt_name, pix_fmt) in &formats {
+        for &(size_name, width, height) in &sizes {
+            for &threads in &[1, 4] {
+                let dst_dims = ImageDimensions {
+                    width,
+                    height,
+                    pix_fmt,
+                };
+                let opts = ScalerOptions {
+                    threads,
+                    ..Default::default()
+                };
+                let mut scaler = Scaler::with_options(src_dims, dst_dims, &opts).unwrap();
+                let mut dst = VideoFrame::owned(dst_dims).unwrap();
+                let id = BenchmarkId::new(
+                    format!("{}/{}", fmt_name, size_name),
+                    format!("{}t", scaler.threads()),
+                );
+                group.bench_function(id, |b| b.iter(|| scaler.scale(&src, &mut dst).unwrap()));
+            }
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(benches, scale);
+criterion_main!(benches);
@@ -9,7 +9,7 @@ fn main() {
             .probe("libavutil")
             .unwrap(),
         pkg_config::Config::new()
-            .atleast_version("56.0")
+            .atleast_version("57.37") // for avcodec_send_packet
             .probe("libavcodec")
             .unwrap(),
         pkg_config::Config::new()
@@ -21,6 +21,11 @@ fn main() {
             .atleast_version("4.0")
             .probe("libswscale")
             .unwrap(),
+        #[cfg(feature = "swresample")]
+        pkg_config::Config::new()
+            .atleast_version("2.0")
+            .probe("libswresample")
+            .unwrap(),
     ];
     let mut wrapper = cc::Build::new();
 
@@ -36,6 +41,16 @@ fn main() {
     if cfg!(feature = "swscale") {
         wrapper.define("MOONFIRE_USE_SWSCALE", Some("1"));
     }
+    if cfg!(feature = "swresample") {
+        wrapper.define("MOONFIRE_USE_SWRESAMPLE", Some("1"));
+    }
+
+    // With cross-language LTO, the wrapper's accessors can be inlined into Rust callers. This
+    // requires building the wrapper with a clang whose LLVM version matches rustc's and linking
+    // with `RUSTFLAGS="-Clinker-plugin-lto -Clinker=clang -Clink-arg=-fuse-ld=lld"`.
+    if cfg!(feature = "cross-lang-lto") {
+        wrapper.compiler("clang").flag("-flto=thin");
+    }
 
     wrapper.file("src/wrapper.c").compile("libwrapper.a");
 }
@@ -2,11 +2,19 @@
 // SPDX-License-Identifier: MIT OR Apache-2.0
 
 use crate::avutil::{
-    moonfire_ffmpeg_frame_stuff, AVFrame, Dictionary, Error, ImageDimensions, MediaType,
-    PixelFormat, Rational, VideoFrame,
+    moonfire_ffmpeg_frame_stuff, AVFrame, AudioFrame, Dictionary, Error, ImageDimensions,
+    MediaType, PixelFormat, Rational, Sample, SampleRing, VideoFrame, AV_NOPTS_VALUE,
 };
+use crate::stats::DecodeStats;
+use log::info;
+use parking_lot::Mutex;
 use std::cell::Ref;
+use std::convert::TryFrom;
+use std::ffi::{CStr, CString};
+use std::hash::{Hash, Hasher};
 use std::ptr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
 
 //#[link(name = "avcodec")]
 extern "C" {
@@ -19,6 +27,17 @@ extern "C" {
         got_picture_ptr: *mut libc::c_int,
         pkt: *const AVPacket,
     ) -> libc::c_int;
+    fn avcodec_send_packet(ctx: *mut AVCodecContext, pkt: *const AVPacket) -> libc::c_int;
+    fn avcodec_receive_frame(ctx: *mut AVCodecContext, frame: *mut AVFrame) -> libc::c_int;
+    fn avcodec_flush_buffers(ctx: *mut AVCodecContext);
+    fn av_parser_init(codec_id: libc::c_int) -> *mut AVCodecParserContext;
+    fn av_parser_close(p: *mut AVCodecParserContext);
+    fn av_bsf_free(ctx: *mut *mut AVBSFContext);
+    fn av_bsf_send_packet(ctx: *mut AVBSFContext, pkt: *mut AVPacket) -> libc::c_int;
+    fn av_bsf_receive_packet(ctx: *mut AVBSFContext, pkt: *mut AVPacket) -> libc::c_int;
+    fn av_bsf_flush(ctx: *mut AVBSFContext);
+    fn avcodec_send_frame(ctx: *mut AVCodecContext, frame: *const AVFrame) -> libc::c_int;
+    fn avcodec_receive_packet(ctx: *mut AVCodecContext, pkt: *mut AVPacket) -> libc::c_int;
     fn avcodec_get_name(codec_id: libc::c_int) -> *const libc::c_char;
     fn avcodec_find_decoder(codec_id: libc::c_int) -> *const AVCodec;
     fn avcodec_find_encoder(codec_id: libc::c_int) -> *const AVCodec;
@@ -32,7 +51,15 @@ extern "C" {
         ctx: *mut AVCodecContext,
         par: *const AVCodecParameters,
     ) -> libc::c_int;
-    pub(crate) fn av_init_packet(p: *mut AVPacket);
+    fn avcodec_parameters_alloc() -> *mut AVCodecParameters;
+    fn avcodec_parameters_copy(
+        dst: *mut AVCodecParameters,
+        src: *const AVCodecParameters,
+    ) -> libc::c_int;
+    fn avcodec_parameters_free(par: *mut *mut AVCodecParameters);
+    pub(crate) fn av_packet_alloc() -> *mut AVPacket;
+    pub(crate) fn av_packet_free(p: *mut *mut AVPacket);
+    fn av_packet_ref(dst: *mut AVPacket, src: *const AVPacket) -> libc::c_int;
     fn av_packet_unref(p: *mut AVPacket);
 }
 
@@ -42,31 +69,84 @@ extern "C" {
 
     static moonfire_ffmpeg_av_codec_id_aac: libc::c_int;
     static moonfire_ffmpeg_av_codec_id_h264: libc::c_int;
+    static moonfire_ffmpeg_av_codec_id_mjpeg: libc::c_int;
+
+    static moonfire_ffmpeg_ff_thread_frame: libc::c_int;
+    static moonfire_ffmpeg_ff_thread_slice: libc::c_int;
+
+    static moonfire_ffmpeg_avdiscard_none: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_default: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_nonref: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_bidir: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_nonintra: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_nonkey: libc::c_int;
+    static moonfire_ffmpeg_avdiscard_all: libc::c_int;
 
     fn moonfire_ffmpeg_codecpar_codec_id(ctx: *const AVCodecParameters) -> CodecId;
     fn moonfire_ffmpeg_codecpar_codec_type(ctx: *const AVCodecParameters) -> MediaType;
     fn moonfire_ffmpeg_codecpar_dims(ctx: *const AVCodecParameters) -> ImageDimensions;
     fn moonfire_ffmpeg_codecpar_extradata(ctx: *const AVCodecParameters) -> DataLen;
+    fn moonfire_ffmpeg_codecpar_set_video(
+        par: *mut AVCodecParameters,
+        codec_id: CodecId,
+        dims: *const ImageDimensions,
+        extradata: *const u8,
+        extradata_size: libc::size_t,
+    ) -> libc::c_int;
 
     fn moonfire_ffmpeg_cctx_codec_id(ctx: *const AVCodecContext) -> CodecId;
     fn moonfire_ffmpeg_cctx_codec_type(ctx: *const AVCodecContext) -> MediaType;
     fn moonfire_ffmpeg_cctx_pix_fmt(ctx: *const AVCodecContext) -> PixelFormat;
     fn moonfire_ffmpeg_cctx_height(ctx: *const AVCodecContext) -> libc::c_int;
     fn moonfire_ffmpeg_cctx_width(ctx: *const AVCodecContext) -> libc::c_int;
+    fn moonfire_ffmpeg_cctx_extradata(ctx: *const AVCodecContext) -> DataLen;
     fn moonfire_ffmpeg_cctx_params(ctx: *const AVCodecContext, p: *mut VideoParameters);
     fn moonfire_ffmpeg_cctx_set_params(ctx: *mut AVCodecContext, p: *const VideoParameters);
+    fn moonfire_ffmpeg_cctx_set_threading(ctx: *mut AVCodecContext, t: *const RawThreading);
+    fn moonfire_ffmpeg_cctx_threading(ctx: *const AVCodecContext) -> RawThreading;
+    fn moonfire_ffmpeg_cctx_configured_threading(ctx: *const AVCodecContext) -> RawThreading;
+    fn moonfire_ffmpeg_cctx_set_discard(ctx: *mut AVCodecContext, d: *const RawDiscard);
+    fn moonfire_ffmpeg_cctx_discard(ctx: *const AVCodecContext) -> RawDiscard;
+    fn moonfire_ffmpeg_cctx_set_hwaccel(
+        ctx: *mut AVCodecContext,
+        type_name: *const libc::c_char,
+        device: *const libc::c_char,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_cctx_is_hw(ctx: *const AVCodecContext) -> bool;
+
+    fn moonfire_ffmpeg_parser_parse(
+        p: *mut AVCodecParserContext,
+        c: *mut AVCodecContext,
+        pkt: *mut AVPacket,
+        data: *const u8,
+        size: libc::c_int,
+        pts: i64,
+        dts: i64,
+        info: *mut PacketInfo,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_bsf_new(
+        filters: *const libc::c_char,
+        par: *const AVCodecParameters,
+        time_base: Rational,
+        out: *mut *mut AVBSFContext,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_bsf_send_packet(
+        ctx: *mut AVBSFContext,
+        scratch: *mut AVPacket,
+        pkt: *const AVPacket,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_bsf_par_out(ctx: *const AVBSFContext) -> *const AVCodecParameters;
+    fn moonfire_ffmpeg_bsf_time_base_out(ctx: *const AVBSFContext) -> Rational;
 
-    pub(crate) fn moonfire_ffmpeg_packet_alloc() -> *mut AVPacket;
-    pub(crate) fn moonfire_ffmpeg_packet_free(p: *mut AVPacket);
-    fn moonfire_ffmpeg_packet_is_key(p: *const AVPacket) -> bool;
-    fn moonfire_ffmpeg_packet_pts(p: *const AVPacket) -> i64;
-    fn moonfire_ffmpeg_packet_dts(p: *const AVPacket) -> i64;
-    fn moonfire_ffmpeg_packet_duration(p: *const AVPacket) -> libc::c_int;
+    fn moonfire_ffmpeg_packet_info(pkt: *const AVPacket, info: *mut PacketInfo);
+    fn moonfire_ffmpeg_packet_detach(
+        dst: *mut AVPacket,
+        src: *mut AVPacket,
+        dst_info: *mut PacketInfo,
+    ) -> libc::c_int;
     fn moonfire_ffmpeg_packet_set_pts(p: *mut AVPacket, pts: i64);
     fn moonfire_ffmpeg_packet_set_dts(p: *mut AVPacket, dts: i64);
     fn moonfire_ffmpeg_packet_set_duration(p: *mut AVPacket, dur: libc::c_int);
-    fn moonfire_ffmpeg_packet_data(p: *const AVPacket) -> DataLen;
-    fn moonfire_ffmpeg_packet_stream_index(p: *const AVPacket) -> libc::c_uint;
 }
 
 // No ABI stability assumption here; use heap allocation/deallocation and accessors only.
@@ -83,7 +163,15 @@ pub struct AVCodecParameters {
     _private: [u8; 0],
 }
 #[repr(C)]
-pub(crate) struct AVPacket {
+pub struct AVPacket {
+    _private: [u8; 0],
+}
+#[repr(C)]
+struct AVBSFContext {
+    _private: [u8; 0],
+}
+#[repr(C)]
+struct AVCodecParserContext {
     _private: [u8; 0],
 }
 
@@ -103,6 +191,15 @@ impl AVCodecContext {
     pub fn codec_type(&self) -> MediaType {
         unsafe { moonfire_ffmpeg_cctx_codec_type(self) }
     }
+    pub fn extradata(&self) -> &[u8] {
+        unsafe {
+            let d = moonfire_ffmpeg_cctx_extradata(self);
+            if d.data.is_null() {
+                return &[];
+            }
+            ::std::slice::from_raw_parts(d.data, d.len)
+        }
+    }
     pub fn params(&self) -> VideoParameters {
         let mut p = std::mem::MaybeUninit::uninit();
         unsafe {
@@ -119,60 +216,272 @@ struct DataLen {
     len: libc::size_t,
 }
 
-pub struct Packet<'i>(pub(crate) Ref<'i, *mut AVPacket>);
+/// A packet borrowed from an `InputFormatContext`, valid until the next `read_frame`.
+/// Use `detach` to keep it longer.
+///
+/// Metadata accessors are on `PacketInfo`, which is filled once per read.
+pub struct Packet<'i> {
+    pub(crate) pkt: Ref<'i, *mut AVPacket>,
+    pub(crate) info: PacketInfo,
+}
 
 impl<'i> Packet<'i> {
-    pub fn is_key(&self) -> bool {
-        unsafe { moonfire_ffmpeg_packet_is_key(*self.0) }
-    }
-    pub fn pts(&self) -> Option<i64> {
-        match unsafe { moonfire_ffmpeg_packet_pts(*self.0) } {
-            v if v == unsafe { crate::avutil::moonfire_ffmpeg_av_nopts_value } => None,
-            v => Some(v),
+    pub fn set_pts(&mut self, pts: Option<i64>) {
+        let real_pts = pts.unwrap_or(AV_NOPTS_VALUE);
+        unsafe {
+            moonfire_ffmpeg_packet_set_pts(*self.pkt, real_pts);
         }
+        self.info.pts = real_pts;
     }
-    pub fn set_pts(&mut self, pts: Option<i64>) {
-        let real_pts = match pts {
-            None => unsafe { crate::avutil::moonfire_ffmpeg_av_nopts_value },
-            Some(v) => v,
-        };
+    pub fn set_dts(&mut self, dts: i64) {
         unsafe {
-            moonfire_ffmpeg_packet_set_pts(*self.0, real_pts);
+            moonfire_ffmpeg_packet_set_dts(*self.pkt, dts);
         }
+        self.info.dts = dts;
     }
-    pub fn dts(&self) -> i64 {
-        unsafe { moonfire_ffmpeg_packet_dts(*self.0) }
+    pub fn set_duration(&mut self, dur: i32) {
+        unsafe { moonfire_ffmpeg_packet_set_duration(*self.pkt, dur) }
+        self.info.duration = i64::from(dur);
     }
-    pub fn set_dts(&mut self, dts: i64) {
+
+    /// Takes ownership of the packet's payload without copying it (unless the demuxer returned
+    /// a non-reference-counted packet, in which case it's copied once).
+    pub fn detach(self) -> Result<OwnedPacket, Error> {
+        let mut owned = OwnedPacket::empty()?;
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_packet_detach(owned.pkt.as_ptr(), *self.pkt, &mut owned.info)
+        })?;
+        Ok(owned)
+    }
+}
+
+impl<'i> std::ops::Deref for Packet<'i> {
+    type Target = PacketInfo;
+    fn deref(&self) -> &PacketInfo {
+        &self.info
+    }
+}
+
+impl<'i> Drop for Packet<'i> {
+    fn drop(&mut self) {
         unsafe {
-            moonfire_ffmpeg_packet_set_dts(*self.0, dts);
+            av_packet_unref(*self.pkt);
         }
     }
-    pub fn duration(&self) -> i32 {
-        unsafe { moonfire_ffmpeg_packet_duration(*self.0) }
+}
+
+/// A packet which holds its own reference to the (reference-counted) payload, so it can outlive
+/// the `InputFormatContext` read that produced it and be sent to another thread.
+pub struct OwnedPacket {
+    pkt: ptr::NonNull<AVPacket>,
+    info: PacketInfo,
+}
+
+// The payload is reference-counted with atomic operations, and nothing here mutates it.
+unsafe impl Send for OwnedPacket {}
+unsafe impl Sync for OwnedPacket {}
+
+impl OwnedPacket {
+    /// Creates a packet with no payload.
+    pub fn empty() -> Result<Self, Error> {
+        Ok(OwnedPacket {
+            pkt: ptr::NonNull::new(unsafe { av_packet_alloc() }).ok_or_else(Error::enomem)?,
+            info: PacketInfo::empty(),
+        })
     }
-    pub fn set_duration(&mut self, dur: i32) {
-        unsafe { moonfire_ffmpeg_packet_set_duration(*self.0, dur) }
+
+    /// Returns a new packet referencing the same payload.
+    pub fn try_clone(&self) -> Result<Self, Error> {
+        let mut p = OwnedPacket::empty()?;
+        Error::wrap(unsafe { av_packet_ref(p.pkt.as_ptr(), self.pkt.as_ptr()) })?;
+        unsafe { moonfire_ffmpeg_packet_info(p.pkt.as_ptr(), &mut p.info) };
+        Ok(p)
+    }
+}
+
+impl std::ops::Deref for OwnedPacket {
+    type Target = PacketInfo;
+    fn deref(&self) -> &PacketInfo {
+        &self.info
+    }
+}
+
+impl Drop for OwnedPacket {
+    fn drop(&mut self) {
+        let mut p = self.pkt.as_ptr();
+        unsafe { av_packet_free(&mut p) }
+    }
+}
+
+pub(crate) mod private {
+    pub trait Sealed {
+        fn av_packet(&self) -> *const super::AVPacket;
+    }
+}
+
+/// A packet which can be sent to a decoder or muxer: a `Packet` or `OwnedPacket`.
+pub trait AsPacket: private::Sealed {}
+
+impl<'i> private::Sealed for Packet<'i> {
+    fn av_packet(&self) -> *const AVPacket {
+        *self.pkt
+    }
+}
+impl<'i> AsPacket for Packet<'i> {}
+
+impl private::Sealed for OwnedPacket {
+    fn av_packet(&self) -> *const AVPacket {
+        self.pkt.as_ptr()
+    }
+}
+impl AsPacket for OwnedPacket {}
+
+/// Packet metadata, filled in a single call to the wrapper, so reading it is just a load.
+/// Must match `moonfire_ffmpeg_packet_info`.
+///
+/// It's deliberately neither `Copy` nor `Clone`: `data` borrows the packet's payload, so a
+/// `PacketInfo` must only be reachable through the packet (or batch) which owns it.
+#[repr(C)]
+pub struct PacketInfo {
+    pts: i64,
+    dts: i64,
+    duration: i64,
+    data: *const u8,
+    size: libc::size_t,
+    stream_index: libc::c_int,
+    is_key: bool,
+}
+
+impl PacketInfo {
+    pub(crate) fn empty() -> Self {
+        PacketInfo {
+            pts: AV_NOPTS_VALUE,
+            dts: AV_NOPTS_VALUE,
+            duration: 0,
+            data: ptr::null(),
+            size: 0,
+            stream_index: 0,
+            is_key: false,
+        }
+    }
+
+    pub fn is_key(&self) -> bool {
+        self.is_key
+    }
+    pub fn pts(&self) -> Option<i64> {
+        match self.pts {
+            AV_NOPTS_VALUE => None,
+            v => Some(v),
+        }
+    }
+    pub fn dts(&self) -> i64 {
+        self.dts
+    }
+    pub fn duration(&self) -> i32 {
+        self.duration as i32
     }
     pub fn stream_index(&self) -> usize {
-        unsafe { moonfire_ffmpeg_packet_stream_index(*self.0) as usize }
+        self.stream_index as usize
+    }
+    pub(crate) fn size(&self) -> usize {
+        self.size
     }
     pub fn data(&self) -> Option<&[u8]> {
-        unsafe {
-            let d = moonfire_ffmpeg_packet_data(*self.0);
-            if d.data.is_null() {
-                None
-            } else {
-                Some(::std::slice::from_raw_parts(d.data, d.len))
+        if self.data.is_null() {
+            None
+        } else {
+            Some(unsafe { ::std::slice::from_raw_parts(self.data, self.size) })
+        }
+    }
+}
+
+/// A caller-owned, reusable pool of packets, filled by `InputFormatContext::read_frames`.
+/// The packets' payloads are valid until the next `read_frames` or `clear`; use `detach` to keep
+/// one longer.
+pub struct PacketBatch {
+    pkts: Vec<*mut AVPacket>,
+
+    /// Metadata for the first `infos.len()` entries of `pkts`.
+    infos: Vec<PacketInfo>,
+}
+
+// Like `OwnedPacket`, the packets are only touched through `&mut self`.
+unsafe impl Send for PacketBatch {}
+
+impl PacketBatch {
+    /// Allocates a batch which can hold up to `capacity` packets.
+    pub fn new(capacity: usize) -> Result<Self, Error> {
+        let mut b = PacketBatch {
+            pkts: Vec::with_capacity(capacity),
+            infos: Vec::with_capacity(capacity),
+        };
+        for _ in 0..capacity {
+            let p = unsafe { av_packet_alloc() };
+            if p.is_null() {
+                return Err(Error::enomem()); // drop frees those allocated so far.
             }
+            b.pkts.push(p);
+        }
+        Ok(b)
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.pkts.len()
+    }
+
+    /// Returns the number of packets filled by the last `read_frames`.
+    pub fn len(&self) -> usize {
+        self.infos.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.infos.is_empty()
+    }
+
+    /// Returns the metadata of the filled packets, in the order read.
+    pub fn infos(&self) -> &[PacketInfo] {
+        &self.infos[..]
+    }
+
+    /// Moves the `i`th packet's payload into an `OwnedPacket`, as in `Packet::detach`.
+    /// `infos()[i]` is no longer valid afterward (its data will be empty).
+    pub fn detach(&mut self, i: usize) -> Result<OwnedPacket, Error> {
+        assert!(i < self.infos.len());
+        let mut owned = OwnedPacket::empty()?;
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_packet_detach(owned.pkt.as_ptr(), self.pkts[i], &mut owned.info)
+        })?;
+        self.infos[i].data = ptr::null();
+        self.infos[i].size = 0;
+        Ok(owned)
+    }
+
+    /// Unreferences all filled packets, keeping the allocations for reuse.
+    pub fn clear(&mut self) {
+        for &p in &self.pkts[0..self.infos.len()] {
+            unsafe { av_packet_unref(p) };
         }
+        self.infos.clear();
+    }
+
+    /// Returns pointers to the packets and infos for `moonfire_ffmpeg_fctx_read_frames`.
+    /// The caller must call `set_len` afterward.
+    pub(crate) fn raw_parts(&mut self) -> (*mut *mut AVPacket, *mut PacketInfo) {
+        debug_assert!(self.infos.is_empty());
+        (self.pkts.as_mut_ptr(), self.infos.as_mut_ptr())
+    }
+
+    /// Sets the number of packets filled.
+    pub(crate) unsafe fn set_len(&mut self, n: usize) {
+        debug_assert!(n <= self.pkts.len());
+        self.infos.set_len(n);
     }
 }
 
-impl<'i> Drop for Packet<'i> {
+impl Drop for PacketBatch {
     fn drop(&mut self) {
-        unsafe {
-            av_packet_unref(*self.0);
+        for p in &mut self.pkts {
+            unsafe { av_packet_free(p) };
         }
     }
 }
@@ -200,6 +509,16 @@ pub struct InputCodecParameters<'s>(pub(crate) &'s AVCodecParameters);
 
 impl<'s> InputCodecParameters<'s> {
     pub fn new_decoder(&self, options: &mut Dictionary) -> Result<DecodeContext, Error> {
+        self.new_decoder_with(&DecoderOptions::default(), options)
+    }
+
+    /// Creates a decoder, applying `opts` before `avcodec_open2`. Entries in `dict` (such as
+    /// `threads`) are applied afterward by `avcodec_open2` and so take precedence.
+    pub fn new_decoder_with(
+        &self,
+        opts: &DecoderOptions,
+        dict: &mut Dictionary,
+    ) -> Result<DecodeContext, Error> {
         let decoder = match self.codec_id().find_decoder() {
             Some(d) => d,
             None => {
@@ -208,148 +527,1719 @@ impl<'s> InputCodecParameters<'s> {
         };
         let mut c = decoder.alloc_context()?;
         Error::wrap(unsafe { avcodec_parameters_to_context(c.ctx.as_ptr(), self.0) })?;
-        c.open(options)?;
+        c.open(opts, dict)?;
         Ok(c)
     }
 }
 
-impl<'s> std::ops::Deref for InputCodecParameters<'s> {
-    type Target = AVCodecParameters;
-    fn deref(&self) -> &AVCodecParameters {
-        self.0
+/// The kind of threading a decoder uses.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum ThreadType {
+    /// Decodes slices of one frame in parallel. Adds no latency, but scales only as far as the
+    /// stream has slices per frame. Suits live view.
+    Slice,
+
+    /// Decodes several frames in parallel. Scales with thread count, but adds a frame of latency
+    /// per extra thread. Suits bulk/offline decoding.
+    Frame,
+
+    /// Lets ffmpeg choose (frame threading if the codec supports it, else slice threading).
+    Auto,
+}
+
+impl ThreadType {
+    fn raw(self) -> libc::c_int {
+        let (frame, slice) = unsafe {
+            (
+                moonfire_ffmpeg_ff_thread_frame,
+                moonfire_ffmpeg_ff_thread_slice,
+            )
+        };
+        match self {
+            ThreadType::Slice => slice,
+            ThreadType::Frame => frame,
+            ThreadType::Auto => frame | slice,
+        }
     }
 }
 
-#[derive(Copy, Clone)]
-#[repr(transparent)]
-pub struct CodecId(libc::c_int);
+// matches moonfire_ffmpeg_threading
+#[repr(C)]
+struct RawThreading {
+    count: libc::c_int,
+    type_: libc::c_int,
+}
 
-impl CodecId {
-    pub fn is_aac(self) -> bool {
-        self.0 == unsafe { moonfire_ffmpeg_av_codec_id_aac }
-    }
+/// Which frames a decoder may skip (some or all of) the work for; ffmpeg's `AVDiscard`.
+/// Each level discards everything the previous one does and more.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Discard {
+    /// Discards nothing.
+    None,
 
-    pub fn is_h264(self) -> bool {
-        self.0 == unsafe { moonfire_ffmpeg_av_codec_id_h264 }
-    }
+    /// Discards useless packets such as zero-size packets (ffmpeg's default).
+    Default,
 
-    pub fn find_decoder(self) -> Option<Decoder> {
-        // avcodec_find_decoder returns an AVCodec which lives forever.
-        unsafe { avcodec_find_decoder(self.0).as_ref() }.map(|d| Decoder(d))
+    /// Discards frames that no other frame references.
+    NonRef,
+
+    /// Discards bidirectionally predicted (B) frames.
+    Bidir,
+
+    /// Discards all frames but intra-coded (I) frames.
+    NonIntra,
+
+    /// Discards all frames but keyframes (IDR frames in H.264).
+    NonKey,
+
+    /// Discards all frames.
+    All,
+}
+
+impl Discard {
+    fn raw(self) -> libc::c_int {
+        unsafe {
+            match self {
+                Discard::None => moonfire_ffmpeg_avdiscard_none,
+                Discard::Default => moonfire_ffmpeg_avdiscard_default,
+                Discard::NonRef => moonfire_ffmpeg_avdiscard_nonref,
+                Discard::Bidir => moonfire_ffmpeg_avdiscard_bidir,
+                Discard::NonIntra => moonfire_ffmpeg_avdiscard_nonintra,
+                Discard::NonKey => moonfire_ffmpeg_avdiscard_nonkey,
+                Discard::All => moonfire_ffmpeg_avdiscard_all,
+            }
+        }
     }
 
-    pub fn find_encoder(self) -> Option<Encoder> {
-        // avcodec_find_encoder returns an AVCodec which lives forever.
-        unsafe { avcodec_find_encoder(self.0).as_ref() }.map(|e| Encoder(e))
+    fn from_raw(raw: libc::c_int) -> Self {
+        // AVDiscard values are ordered; round unknown values down to the nearest known level.
+        let levels = [
+            Discard::All,
+            Discard::NonKey,
+            Discard::NonIntra,
+            Discard::Bidir,
+            Discard::NonRef,
+            Discard::Default,
+        ];
+        for &l in &levels {
+            if raw >= l.raw() {
+                return l;
+            }
+        }
+        Discard::None
     }
 }
 
-impl std::fmt::Debug for CodecId {
-    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
-        write!(f, "CodecId({} /* {} */)", self.0, self)
+impl Default for Discard {
+    fn default() -> Self {
+        Discard::Default
     }
 }
 
-impl std::fmt::Display for CodecId {
-    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
-        let s = unsafe { std::ffi::CStr::from_ptr(avcodec_get_name(self.0)) };
-        let s = s.to_str().map_err(|_| std::fmt::Error)?;
-        std::fmt::Display::fmt(s, f)
-    }
+/// What a decoder skips; see `DecodeContext::set_discard`.
+#[derive(Copy, Clone, Debug, Default, PartialEq, Eq)]
+pub struct DiscardPolicy {
+    /// Frames to skip decoding entirely.
+    pub skip_frame: Discard,
+
+    /// Frames to skip the H.264 in-loop deblocking filter for. Faster but lower quality; the
+    /// artifacts propagate to frames which reference the skipped ones.
+    pub skip_loop_filter: Discard,
+
+    /// Frames to skip the inverse transform for (in codecs that support it).
+    pub skip_idct: Discard,
 }
 
-#[derive(Copy, Clone)]
-pub struct Decoder(&'static AVCodec);
+impl DiscardPolicy {
+    /// Decodes only keyframes, as for timeline thumbnails. Other packets can still be sent
+    /// (they'll produce no frames), but it's cheaper still to filter on `Packet::is_key`
+    /// before sending.
+    pub fn keyframes_only() -> Self {
+        DiscardPolicy {
+            skip_frame: Discard::NonKey,
+            ..Default::default()
+        }
+    }
 
-impl Decoder {
-    fn alloc_context(self) -> Result<DecodeContext, Error> {
-        let ctx = ptr::NonNull::new(unsafe { avcodec_alloc_context3(self.0) })
-            .ok_or_else(Error::enomem)?;
-        Ok(DecodeContext { decoder: self, ctx })
+    fn raw(&self) -> RawDiscard {
+        RawDiscard {
+            skip_frame: self.skip_frame.raw(),
+            skip_loop_filter: self.skip_loop_filter.raw(),
+            skip_idct: self.skip_idct.raw(),
+        }
     }
 }
 
-pub struct DecodeContext {
-    decoder: Decoder,
-    ctx: ptr::NonNull<AVCodecContext>,
+// matches moonfire_ffmpeg_discard
+#[repr(C)]
+struct RawDiscard {
+    skip_frame: libc::c_int,
+    skip_loop_filter: libc::c_int,
+    skip_idct: libc::c_int,
 }
 
-impl Drop for DecodeContext {
-    fn drop(&mut self) {
-        let mut ctx = self.ctx.as_ptr();
-        unsafe { avcodec_free_context(&mut ctx) }
+/// A type of hardware decoding device.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum HwDeviceType {
+    /// VA-API (Intel/AMD on Linux).
+    Vaapi,
+
+    /// CUDA, for NVDEC (NVIDIA).
+    Cuda,
+
+    /// Intel Quick Sync Video.
+    Qsv,
+
+    /// Apple VideoToolbox.
+    VideoToolbox,
+}
+
+impl HwDeviceType {
+    fn name(self) -> &'static CStr {
+        let n: &'static [u8] = match self {
+            HwDeviceType::Vaapi => b"vaapi\0",
+            HwDeviceType::Cuda => b"cuda\0",
+            HwDeviceType::Qsv => b"qsv\0",
+            HwDeviceType::VideoToolbox => b"videotoolbox\0",
+        };
+        CStr::from_bytes_with_nul(n).unwrap()
     }
 }
 
-impl DecodeContext {
-    fn open(&mut self, options: &mut Dictionary) -> Result<(), Error> {
-        Error::wrap(unsafe { avcodec_open2(self.ctx.as_mut(), self.decoder.0, options) })?;
-        Ok(())
+/// Options applied to a decoder before it's opened.
+#[derive(Clone, Default)]
+pub struct DecoderOptions {
+    thread_type: Option<ThreadType>,
+    thread_count: Option<usize>,
+    thread_budget: Option<ThreadBudget>,
+    hwaccel: Option<(HwDeviceType, Option<CString>)>,
+    discard: Option<DiscardPolicy>,
+}
+
+impl DecoderOptions {
+    pub fn new() -> Self {
+        Self::default()
     }
 
-    pub fn ctx(&self) -> &AVCodecContext {
-        unsafe { self.ctx.as_ref() }
+    /// Sets the kind of threading; if unset, ffmpeg's default (`Auto`) applies.
+    pub fn thread_type(mut self, t: ThreadType) -> Self {
+        self.thread_type = Some(t);
+        self
     }
 
-    pub fn decode_video(&self, pkt: &Packet, frame: &mut VideoFrame) -> Result<bool, Error> {
-        let mut got_picture: libc::c_int = 0;
-        Error::wrap(unsafe {
-            avcodec_decode_video2(
-                self.ctx.as_ptr(),
-                frame.frame.as_mut(),
-                &mut got_picture,
-                *pkt.0,
-            )
-        })?;
-        if got_picture != 0 {
-            unsafe { moonfire_ffmpeg_frame_stuff(frame.frame.as_ptr(), &mut frame.stuff) };
-            return Ok(true);
-        };
-        Ok(false)
+    /// Sets the desired number of threads, where 0 means one per CPU. If unset, ffmpeg's
+    /// default (1, or whatever the dictionary's `threads` entry says) applies.
+    pub fn thread_count(mut self, n: usize) -> Self {
+        self.thread_count = Some(n);
+        self
+    }
+
+    /// Limits the thread count to what's available in a budget shared with other decoders.
+    /// The threads are returned to the budget when the `DecodeContext` is dropped.
+    pub fn thread_budget(mut self, budget: &ThreadBudget) -> Self {
+        self.thread_budget = Some(budget.clone());
+        self
+    }
+
+    /// Requests hardware decoding on the given device type and device (eg `/dev/dri/renderD128`
+    /// for VA-API, or `None` for the default). Decoded frames will then be in GPU memory; see
+    /// `VideoFrame::is_hw` and `VideoFrame::transfer_to_system`.
+    ///
+    /// If the device can't be opened or doesn't support the codec, the decoder falls back to
+    /// software; check `DecodeContext::is_hw`.
+    pub fn hwaccel(mut self, device_type: HwDeviceType, device: Option<&CStr>) -> Self {
+        self.hwaccel = Some((device_type, device.map(CStr::to_owned)));
+        self
+    }
+
+    /// Sets the initial discard policy; it can be changed later via
+    /// `DecodeContext::set_discard`.
+    pub fn discard(mut self, policy: DiscardPolicy) -> Self {
+        self.discard = Some(policy);
+        self
     }
 }
 
-#[derive(Copy, Clone)]
-pub struct Encoder(&'static AVCodec);
+/// An upper bound on decoder threads, shared by many decoders so that (for example) 64
+/// concurrent decoders don't each start one thread per CPU.
+///
+/// Every decoder gets at least one thread, even if the budget is exhausted.
+#[derive(Clone)]
+pub struct ThreadBudget(Arc<ThreadBudgetInner>);
 
-impl Encoder {
-    /*pub fn alloc_context(self) -> Result<EncodeContext, Error> {
-        let ctx = unsafe { avcodec_alloc_context3(self.0) };
-        if ctx.is_null() {
-            return Err(Error::enomem());
-        }
-        Ok(EncodeContext {
-            encoder: self,
-            ctx,
-        })
-    }*/
+struct ThreadBudgetInner {
+    max: usize,
+    used: AtomicUsize,
 }
 
-pub struct EncodeContext<'a>(&'a mut AVCodecContext);
+impl ThreadBudget {
+    pub fn new(max_threads: usize) -> Self {
+        ThreadBudget(Arc::new(ThreadBudgetInner {
+            max: max_threads,
+            used: AtomicUsize::new(0),
+        }))
+    }
 
-/*impl Drop for EncodeContext {
-    fn drop(&mut self) {
-        unsafe { avcodec_free_context(&mut self.ctx) }
+    pub fn max(&self) -> usize {
+        self.0.max
     }
-}*/
 
-#[derive(Copy, Clone, Debug)]
-#[repr(C)]
-pub struct VideoParameters {
-    width: libc::c_int,
-    height: libc::c_int,
-    sample_aspect_ratio: Rational,
-    pix_fmt: PixelFormat,
-    time_base: Rational,
+    /// Returns the number of threads currently reserved by open decoders.
+    pub fn in_use(&self) -> usize {
+        self.0.used.load(Ordering::Relaxed)
+    }
+
+    /// Reserves up to `wanted` threads (at least 1).
+    fn reserve(&self, wanted: usize) -> ThreadReservation {
+        let mut used = self.0.used.load(Ordering::Relaxed);
+        loop {
+            let n = std::cmp::max(1, std::cmp::min(wanted, self.0.max.saturating_sub(used)));
+            match self.0.used.compare_exchange_weak(
+                used,
+                used + n,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => {
+                    return ThreadReservation {
+                        budget: self.0.clone(),
+                        n,
+                    }
+                }
+                Err(u) => used = u,
+            }
+        }
+    }
 }
 
-impl<'a> EncodeContext<'a> {
-    pub fn set_params(&mut self, p: &VideoParameters) {
-        unsafe { moonfire_ffmpeg_cctx_set_params(self.0, p) };
+struct ThreadReservation {
+    budget: Arc<ThreadBudgetInner>,
+    n: usize,
+}
+
+impl ThreadReservation {
+    /// Adjusts the reservation to exactly `n` threads. Growing doesn't check the budget's
+    /// maximum, as the threads already exist; later reservations see less room.
+    fn resize_to(&mut self, n: usize) {
+        if n < self.n {
+            self.budget.used.fetch_sub(self.n - n, Ordering::Relaxed);
+        } else {
+            self.budget.used.fetch_add(n - self.n, Ordering::Relaxed);
+        }
+        self.n = n;
     }
+}
 
-    pub fn open(&mut self, encoder: Encoder, options: &mut Dictionary) -> Result<(), Error> {
-        Error::wrap(unsafe { avcodec_open2(self.0, encoder.0, options) })?;
-        Ok(())
+impl Drop for ThreadReservation {
+    fn drop(&mut self) {
+        self.budget.used.fetch_sub(self.n, Ordering::Relaxed);
+    }
+}
+
+pub(crate) fn cpus() -> usize {
+    match unsafe { libc::sysconf(libc::_SC_NPROCESSORS_ONLN) } {
+        n if n > 0 => n as usize,
+        _ => 1,
+    }
+}
+
+/// The threading a `DecodeContext` actually uses; see `DecodeContext::threading`.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct Threading {
+    /// The active kind of threading, or `None` if decoding on a single thread.
+    pub thread_type: Option<ThreadType>,
+    pub thread_count: usize,
+}
+
+impl Threading {
+    /// Returns the number of frames of delay this threading adds to decoding, beyond any
+    /// reordering delay inherent to the stream.
+    pub fn added_latency_frames(&self) -> usize {
+        match self.thread_type {
+            Some(ThreadType::Frame) => self.thread_count.saturating_sub(1),
+            _ => 0,
+        }
+    }
+}
+
+/// Codec parameters owned independently of any `InputFormatContext`, as for a template
+/// shared by many decoders.
+pub struct CodecParameters(ptr::NonNull<AVCodecParameters>);
+
+impl CodecParameters {
+    /// Returns a copy of `par`, including its extradata.
+    pub fn copy_from(par: &AVCodecParameters) -> Result<Self, Error> {
+        let p = CodecParameters(
+            ptr::NonNull::new(unsafe { avcodec_parameters_alloc() }).ok_or_else(Error::enomem)?,
+        );
+        Error::wrap(unsafe { avcodec_parameters_copy(p.0.as_ptr(), par) })?;
+        Ok(p)
+    }
+
+    pub fn try_clone(&self) -> Result<Self, Error> {
+        Self::copy_from(self)
+    }
+
+    /// Builds video parameters from stored values, such as a camera's previously seen codec,
+    /// dimensions, and extradata (for H.264, the `avcC` box with the SPS and PPS). A decoder
+    /// created from these via `as_input` needs no `AVStream`, so reconnecting doesn't require
+    /// `find_stream_info`.
+    pub fn new_video(
+        codec_id: CodecId,
+        dims: ImageDimensions,
+        extradata: &[u8],
+    ) -> Result<Self, Error> {
+        let p = CodecParameters(
+            ptr::NonNull::new(unsafe { avcodec_parameters_alloc() }).ok_or_else(Error::enomem)?,
+        );
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_codecpar_set_video(
+                p.0.as_ptr(),
+                codec_id,
+                &dims,
+                extradata.as_ptr(),
+                extradata.len(),
+            )
+        })?;
+        Ok(p)
+    }
+
+    /// Borrows these parameters, to create a decoder.
+    pub fn as_input(&self) -> InputCodecParameters {
+        InputCodecParameters(unsafe { self.0.as_ref() })
+    }
+}
+
+impl std::ops::Deref for CodecParameters {
+    type Target = AVCodecParameters;
+    fn deref(&self) -> &AVCodecParameters {
+        unsafe { self.0.as_ref() }
+    }
+}
+
+impl Drop for CodecParameters {
+    fn drop(&mut self) {
+        let mut p = self.0.as_ptr();
+        unsafe { avcodec_parameters_free(&mut p) }
+    }
+}
+
+// Nothing mutates the parameters after construction.
+unsafe impl Send for CodecParameters {}
+unsafe impl Sync for CodecParameters {}
+
+impl<'s> std::ops::Deref for InputCodecParameters<'s> {
+    type Target = AVCodecParameters;
+    fn deref(&self) -> &AVCodecParameters {
+        self.0
+    }
+}
+
+#[derive(Copy, Clone)]
+#[repr(transparent)]
+pub struct CodecId(libc::c_int);
+
+impl CodecId {
+    pub fn h264() -> Self {
+        CodecId(unsafe { moonfire_ffmpeg_av_codec_id_h264 })
+    }
+
+    pub fn mjpeg() -> Self {
+        CodecId(unsafe { moonfire_ffmpeg_av_codec_id_mjpeg })
+    }
+
+    pub fn is_aac(self) -> bool {
+        self.0 == unsafe { moonfire_ffmpeg_av_codec_id_aac }
+    }
+
+    pub fn is_h264(self) -> bool {
+        self.0 == unsafe { moonfire_ffmpeg_av_codec_id_h264 }
+    }
+
+    pub fn find_decoder(self) -> Option<Decoder> {
+        // avcodec_find_decoder returns an AVCodec which lives forever.
+        unsafe { avcodec_find_decoder(self.0).as_ref() }.map(|d| Decoder(d))
+    }
+
+    pub fn find_encoder(self) -> Option<Encoder> {
+        // avcodec_find_encoder returns an AVCodec which lives forever.
+        unsafe { avcodec_find_encoder(self.0).as_ref() }.map(|e| Encoder(e))
+    }
+}
+
+impl std::fmt::Debug for CodecId {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "CodecId({} /* {} */)", self.0, self)
+    }
+}
+
+impl std::fmt::Display for CodecId {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        let s = unsafe { std::ffi::CStr::from_ptr(avcodec_get_name(self.0)) };
+        let s = s.to_str().map_err(|_| std::fmt::Error)?;
+        std::fmt::Display::fmt(s, f)
+    }
+}
+
+#[derive(Copy, Clone)]
+pub struct Decoder(&'static AVCodec);
+
+impl Decoder {
+    /// Opens a decoder without codec parameters, as for a raw elementary stream from a
+    /// `Parser`. The decoder learns the stream's parameters from in-band data (eg H.264 SPS/PPS
+    /// NAL units).
+    pub fn open(
+        self,
+        opts: &DecoderOptions,
+        dict: &mut Dictionary,
+    ) -> Result<DecodeContext, Error> {
+        let mut c = self.alloc_context()?;
+        c.open(opts, dict)?;
+        Ok(c)
+    }
+
+    fn alloc_context(self) -> Result<DecodeContext, Error> {
+        let ctx = ptr::NonNull::new(unsafe { avcodec_alloc_context3(self.0) })
+            .ok_or_else(Error::enomem)?;
+        Ok(DecodeContext {
+            decoder: self,
+            ctx,
+            _threads: None,
+            stats: None,
+        })
+    }
+}
+
+pub struct DecodeContext {
+    decoder: Decoder,
+    ctx: ptr::NonNull<AVCodecContext>,
+    _threads: Option<ThreadReservation>,
+    stats: Option<Arc<DecodeStats>>,
+}
+
+impl Drop for DecodeContext {
+    fn drop(&mut self) {
+        let mut ctx = self.ctx.as_ptr();
+        unsafe { avcodec_free_context(&mut ctx) }
+    }
+}
+
+impl DecodeContext {
+    fn open(&mut self, opts: &DecoderOptions, dict: &mut Dictionary) -> Result<(), Error> {
+        if opts.thread_type.is_some() || opts.thread_count.is_some() || opts.thread_budget.is_some()
+        {
+            // Start from the context's configured values so that unset options keep ffmpeg's
+            // defaults. (`moonfire_ffmpeg_cctx_threading` reports the active type, which is
+            // none until `avcodec_open2`.)
+            let mut t = unsafe { moonfire_ffmpeg_cctx_configured_threading(self.ctx.as_ptr()) };
+            if let Some(type_) = opts.thread_type {
+                t.type_ = type_.raw();
+            }
+            if let Some(n) = opts.thread_count {
+                t.count = libc::c_int::try_from(n).map_err(|_| Error::invalid_data())?;
+            }
+            if let Some(ref b) = opts.thread_budget {
+                let wanted = match t.count {
+                    n if n <= 0 => cpus(),
+                    n => n as usize,
+                };
+                let r = b.reserve(wanted);
+                t.count = r.n as libc::c_int;
+                self._threads = Some(r);
+            }
+            unsafe { moonfire_ffmpeg_cctx_set_threading(self.ctx.as_ptr(), &t) };
+        }
+        if let Some((device_type, ref device)) = opts.hwaccel {
+            let ret = unsafe {
+                moonfire_ffmpeg_cctx_set_hwaccel(
+                    self.ctx.as_ptr(),
+                    device_type.name().as_ptr(),
+                    device.as_ref().map(|d| d.as_ptr()).unwrap_or(ptr::null()),
+                )
+            };
+            if let Err(e) = Error::wrap(ret) {
+                info!(
+                    "{:?} hardware decoding unavailable ({}); decoding in software",
+                    device_type, e
+                );
+            }
+        }
+        if let Some(ref d) = opts.discard {
+            self.set_discard(d);
+        }
+        Error::wrap(unsafe { avcodec_open2(self.ctx.as_mut(), self.decoder.0, dict) })?;
+        // Charge the budget for the threads actually started, which a `threads` entry in
+        // `dict` may have changed in either direction.
+        let actual = self.threading().thread_count;
+        if let Some(ref mut r) = self._threads {
+            r.resize_to(actual);
+        }
+        Ok(())
+    }
+
+    /// Returns true iff this decoder was set up for hardware decoding. Individual frames may
+    /// still be decoded in software if the hardware rejects the stream; see
+    /// `VideoFrame::is_hw`.
+    pub fn is_hw(&self) -> bool {
+        unsafe { moonfire_ffmpeg_cctx_is_hw(self.ctx.as_ptr()) }
+    }
+
+    /// Returns the threading in use, as decided by `avcodec_open2`.
+    pub fn threading(&self) -> Threading {
+        let t = unsafe { moonfire_ffmpeg_cctx_threading(self.ctx.as_ptr()) };
+        let (frame, slice) = unsafe {
+            (
+                moonfire_ffmpeg_ff_thread_frame,
+                moonfire_ffmpeg_ff_thread_slice,
+            )
+        };
+        let thread_type = if t.type_ & frame != 0 {
+            Some(ThreadType::Frame)
+        } else if t.type_ & slice != 0 {
+            Some(ThreadType::Slice)
+        } else {
+            None
+        };
+        Threading {
+            thread_type,
+            thread_count: std::cmp::max(1, t.count) as usize,
+        }
+    }
+
+    /// Changes which frames are skipped. This takes effect with the next packet sent, so
+    /// (eg) a thumbnailer can switch to `DiscardPolicy::keyframes_only()` between packets.
+    pub fn set_discard(&mut self, policy: &DiscardPolicy) {
+        unsafe { moonfire_ffmpeg_cctx_set_discard(self.ctx.as_ptr(), &policy.raw()) };
+    }
+
+    pub fn discard(&self) -> DiscardPolicy {
+        let d = unsafe { moonfire_ffmpeg_cctx_discard(self.ctx.as_ptr()) };
+        DiscardPolicy {
+            skip_frame: Discard::from_raw(d.skip_frame),
+            skip_loop_filter: Discard::from_raw(d.skip_loop_filter),
+            skip_idct: Discard::from_raw(d.skip_idct),
+        }
+    }
+
+    pub fn ctx(&self) -> &AVCodecContext {
+        unsafe { self.ctx.as_ref() }
+    }
+
+    /// Records packet, frame, error, and latency stats into `stats`, which may be shared with
+    /// other contexts.
+    pub fn set_stats(&mut self, stats: Option<Arc<DecodeStats>>) {
+        self.stats = stats;
+    }
+
+    pub fn stats(&self) -> Option<&Arc<DecodeStats>> {
+        self.stats.as_ref()
+    }
+
+    /// Times `f` and counts the packet or frame it accepted or returned, if stats are enabled.
+    fn record<T>(
+        &self,
+        f: impl FnOnce() -> Result<T, Error>,
+        counter: impl FnOnce(&DecodeStats, &T),
+    ) -> Result<T, Error> {
+        let s = match self.stats {
+            None => return f(),
+            Some(ref s) => s,
+        };
+        let r = crate::stats::time(Some(&s.decode), f);
+        match r {
+            Ok(ref v) => counter(s, v),
+            Err(e) if e.is_eagain() || e.is_eof() => {}
+            Err(_) => {
+                s.errors.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+        r
+    }
+
+    /// Decodes a single packet into at most one frame.
+    ///
+    /// This uses the deprecated `avcodec_decode_video2`, which can't return more than one frame
+    /// per packet or the frames buffered at end of stream. Prefer `decode` or
+    /// `send_packet`/`receive_frame`.
+    pub fn decode_video(&self, pkt: &Packet, frame: &mut VideoFrame) -> Result<bool, Error> {
+        let got_picture = self.record(
+            || {
+                let mut got_picture: libc::c_int = 0;
+                Error::wrap(unsafe {
+                    avcodec_decode_video2(
+                        self.ctx.as_ptr(),
+                        frame.frame.as_mut(),
+                        &mut got_picture,
+                        *pkt.pkt,
+                    )
+                })
+                .map(|_| got_picture != 0)
+            },
+            |s, &got_picture| {
+                s.packets.fetch_add(1, Ordering::Relaxed);
+                let c = if got_picture { &s.frames } else { &s.dropped };
+                c.fetch_add(1, Ordering::Relaxed);
+            },
+        )?;
+        if got_picture {
+            unsafe { moonfire_ffmpeg_frame_stuff(frame.frame.as_ptr(), &mut frame.stuff) };
+            return Ok(true);
+        };
+        Ok(false)
+    }
+
+    /// Sends a packet to the decoder.
+    ///
+    /// Fails with `Error::is_eagain` if frames must be received before more input is accepted.
+    pub fn send_packet<P: AsPacket>(&self, pkt: &P) -> Result<(), Error> {
+        self.record(
+            || Error::wrap(unsafe { avcodec_send_packet(self.ctx.as_ptr(), pkt.av_packet()) }),
+            |s, _| {
+                s.packets.fetch_add(1, Ordering::Relaxed);
+            },
+        )?;
+        Ok(())
+    }
+
+    /// Signals the end of the stream. `receive_frame` will return all buffered frames, then
+    /// fail with `Error::is_eof`. `flush` must be called before sending further packets.
+    pub fn drain(&self) -> Result<(), Error> {
+        Error::wrap(unsafe { avcodec_send_packet(self.ctx.as_ptr(), ptr::null()) })?;
+        Ok(())
+    }
+
+    /// Discards all buffered packets and frames, returning the decoder to its initial state.
+    /// Use after `drain` or after `InputFormatContext::seek`, so that frames from before the
+    /// seek aren't returned, or to reuse the decoder for another segment of a compatible
+    /// stream (see `is_compatible`) rather than creating a new one.
+    pub fn flush(&self) {
+        unsafe { avcodec_flush_buffers(self.ctx.as_ptr()) };
+    }
+
+    /// Returns true iff, after `flush`, this decoder can decode a stream with parameters `par`:
+    /// the same codec, dimensions, and extradata (eg, H.264 SPS/PPS).
+    pub fn is_compatible(&self, par: &AVCodecParameters) -> bool {
+        let ctx = self.ctx();
+        ctx.codec_id().0 == par.codec_id().0
+            && par.codec_type().is_video()
+            && (ctx.width(), ctx.height()) == (par.dims().width, par.dims().height)
+            && ctx.extradata() == par.extradata()
+    }
+
+    /// Receives a decoded frame into `frame`, replacing its previous contents.
+    ///
+    /// Returns `Ok(false)` if more input is needed. Fails with `Error::is_eof` once fully
+    /// drained.
+    pub fn receive_frame(&self, frame: &mut VideoFrame) -> Result<bool, Error> {
+        let raw = frame.frame.as_ptr();
+        match self.record(
+            || Error::wrap(unsafe { avcodec_receive_frame(self.ctx.as_ptr(), raw) }),
+            |s, _| {
+                s.frames.fetch_add(1, Ordering::Relaxed);
+            },
+        ) {
+            Ok(_) => {}
+            Err(e) if e.is_eagain() => return Ok(false),
+            Err(e) => return Err(e),
+        }
+        unsafe { moonfire_ffmpeg_frame_stuff(frame.frame.as_ptr(), &mut frame.stuff) };
+        Ok(true)
+    }
+
+    /// Receives a decoded audio frame, as `receive_frame` does for video. Returns `Ok(false)` if
+    /// the decoder needs another packet, and fails with `Error::is_eof` after `drain` once all
+    /// buffered frames have been returned.
+    pub fn receive_audio_frame(&self, frame: &mut AudioFrame) -> Result<bool, Error> {
+        let raw = frame.frame.as_ptr();
+        match self.record(
+            || Error::wrap(unsafe { avcodec_receive_frame(self.ctx.as_ptr(), raw) }),
+            |s, _| {
+                s.frames.fetch_add(1, Ordering::Relaxed);
+            },
+        ) {
+            Ok(_) => {}
+            Err(e) if e.is_eagain() => return Ok(false),
+            Err(e) => return Err(e),
+        }
+        frame.refresh();
+        Ok(true)
+    }
+
+    /// Sends `pkt` and appends all the samples it makes available to `ring`, via `frame`.
+    /// Returns the number of frames (samples per channel) appended. See
+    /// `AudioFrame::copy_into` for format requirements; use `swresample::Resampler` to
+    /// convert other formats.
+    pub fn decode_audio<P: AsPacket, T: Sample>(
+        &self,
+        pkt: &P,
+        frame: &mut AudioFrame,
+        ring: &mut SampleRing<T>,
+    ) -> Result<usize, Error> {
+        self.send_packet(pkt)?;
+        let mut n = 0;
+        while self.receive_audio_frame(frame)? {
+            frame.copy_into(ring)?;
+            n += frame.nb_samples();
+        }
+        Ok(n)
+    }
+
+    /// Sends `pkt` and returns an iterator over all frames it makes available.
+    pub fn decode<'c, 'f, P: AsPacket>(
+        &'c self,
+        pkt: &P,
+        frame: &'f mut VideoFrame,
+    ) -> Result<Frames<'c, 'f>, Error> {
+        self.send_packet(pkt)?;
+        Ok(self.frames(frame))
+    }
+
+    /// Returns an iterator over the frames currently available, eg after `send_packet` or
+    /// `drain`.
+    pub fn frames<'c, 'f>(&'c self, frame: &'f mut VideoFrame) -> Frames<'c, 'f> {
+        Frames { ctx: self, frame }
+    }
+}
+
+// The codec context is only used by one thread at a time: ffmpeg's frame threads are internal
+// to each call.
+unsafe impl Send for DecodeContext {}
+
+/// The (codec id, extradata hash, width, height) of parameters, for finding a compatible idle
+/// decoder. Matches are confirmed with `DecodeContext::is_compatible`.
+type DecoderKey = (libc::c_int, u64, libc::c_int, libc::c_int);
+
+fn decoder_key(par: &AVCodecParameters) -> DecoderKey {
+    let mut h = std::collections::hash_map::DefaultHasher::new();
+    par.extradata().hash(&mut h);
+    let dims = par.dims();
+    (par.codec_id().0, h.finish(), dims.width, dims.height)
+}
+
+/// A pool of idle, already-opened decoders, to avoid `avcodec_open2` (and thread pool startup)
+/// when decoding many segments of the same camera's stream, as for on-demand thumbnails.
+///
+/// Like `swscale::ScalerCache`, it's `Sync`; each checked-out decoder is used exclusively by
+/// one thread and returned to the pool (flushed, with the pool's discard policy and no stats)
+/// when the `PooledDecoder` is dropped. The least recently returned decoders are evicted beyond
+/// `capacity`. Idle decoders keep any `ThreadBudget` reservation.
+pub struct DecoderPool {
+    capacity: usize,
+    opts: DecoderOptions,
+
+    /// Idle decoders, least recently used first.
+    idle: Mutex<Vec<(DecoderKey, DecodeContext)>>,
+}
+
+impl DecoderPool {
+    /// Creates a pool whose new decoders are opened with `opts`.
+    pub fn new(capacity: usize, opts: DecoderOptions) -> Self {
+        DecoderPool {
+            capacity,
+            opts,
+            idle: Mutex::new(Vec::with_capacity(capacity)),
+        }
+    }
+
+    /// Checks out a decoder for video parameters `par`, creating one if there's no compatible
+    /// idle decoder. `dict` is only used when creating one.
+    pub fn get(
+        &self,
+        par: &AVCodecParameters,
+        dict: &mut Dictionary,
+    ) -> Result<PooledDecoder, Error> {
+        let key = decoder_key(par);
+        let cached = {
+            let mut l = self.idle.lock();
+            let i = l
+                .iter()
+                .rposition(|(k, d)| *k == key && d.is_compatible(par));
+            i.map(|i| l.remove(i).1)
+        };
+        let decoder = match cached {
+            Some(d) => d,
+            None => InputCodecParameters(par).new_decoder_with(&self.opts, dict)?,
+        };
+        Ok(PooledDecoder {
+            pool: self,
+            key,
+            decoder: Some(decoder),
+        })
+    }
+
+    /// Returns the number of idle decoders.
+    pub fn len(&self) -> usize {
+        self.idle.lock().len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Drops all idle decoders.
+    pub fn clear(&self) {
+        let idle = std::mem::replace(&mut *self.idle.lock(), Vec::new());
+        drop(idle); // outside the lock: dropping joins decoder threads.
+    }
+}
+
+/// A decoder checked out of a `DecoderPool`.
+pub struct PooledDecoder<'p> {
+    pool: &'p DecoderPool,
+    key: DecoderKey,
+    decoder: Option<DecodeContext>,
+}
+
+impl<'p> std::ops::Deref for PooledDecoder<'p> {
+    type Target = DecodeContext;
+    fn deref(&self) -> &DecodeContext {
+        self.decoder.as_ref().unwrap()
+    }
+}
+
+impl<'p> std::ops::DerefMut for PooledDecoder<'p> {
+    fn deref_mut(&mut self) -> &mut DecodeContext {
+        self.decoder.as_mut().unwrap()
+    }
+}
+
+impl<'p> Drop for PooledDecoder<'p> {
+    fn drop(&mut self) {
+        let mut decoder = self.decoder.take().unwrap();
+        decoder.flush();
+        decoder.set_discard(&self.pool.opts.discard.unwrap_or_default());
+        decoder.set_stats(None);
+        let evicted = {
+            let mut l = self.pool.idle.lock();
+            l.push((self.key, decoder));
+            if l.len() > self.pool.capacity {
+                Some(l.remove(0))
+            } else {
+                None
+            }
+        };
+        drop(evicted);
+    }
+}
+
+/// A streaming iterator over decoded frames, each of which is written into the same
+/// `VideoFrame`. Returned by `DecodeContext::decode` and `DecodeContext::frames`.
+pub struct Frames<'c, 'f> {
+    ctx: &'c DecodeContext,
+    frame: &'f mut VideoFrame,
+}
+
+impl<'c, 'f> Frames<'c, 'f> {
+    /// Returns the next frame, or `None` when more input is needed or the decoder is drained.
+    pub fn next(&mut self) -> Result<Option<&VideoFrame>, Error> {
+        match self.ctx.receive_frame(self.frame) {
+            Ok(true) => Ok(Some(&*self.frame)),
+            Ok(false) => Ok(None),
+            Err(e) if e.is_eof() => Ok(None),
+            Err(e) => Err(e),
+        }
+    }
+}
+
+/// Splits a raw elementary stream (such as Annex B H.264 from an RTSP client) into packets
+/// which can be sent to a decoder, without a container or `InputFormatContext`.
+pub struct Parser {
+    parser: ptr::NonNull<AVCodecParserContext>,
+
+    /// A context for the parser to store stream parameters in; not opened or used for decoding.
+    ctx: ptr::NonNull<AVCodecContext>,
+
+    /// The current packet, which refers to (rather than owns) the parsed data.
+    pkt: ptr::NonNull<AVPacket>,
+}
+
+/// A packet returned by `Parser::parse`, borrowing from the parser and from the input.
+pub struct ParsedPacket<'p> {
+    pkt: *mut AVPacket,
+    info: PacketInfo,
+    _marker: std::marker::PhantomData<&'p mut Parser>,
+}
+
+impl<'p> ParsedPacket<'p> {
+    /// Copies this packet into a new reference-counted packet which can outlive the parser.
+    pub fn detach(self) -> Result<OwnedPacket, Error> {
+        let mut p = OwnedPacket::empty()?;
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_packet_detach(p.pkt.as_ptr(), self.pkt, &mut p.info)
+        })?;
+        Ok(p)
+    }
+}
+
+impl<'p> private::Sealed for ParsedPacket<'p> {
+    fn av_packet(&self) -> *const AVPacket {
+        self.pkt
+    }
+}
+impl<'p> AsPacket for ParsedPacket<'p> {}
+
+impl<'p> std::ops::Deref for ParsedPacket<'p> {
+    type Target = PacketInfo;
+    fn deref(&self) -> &PacketInfo {
+        &self.info
+    }
+}
+
+impl Parser {
+    pub fn new(codec_id: CodecId) -> Result<Self, Error> {
+        let parser = ptr::NonNull::new(unsafe { av_parser_init(codec_id.0) })
+            .ok_or_else(Error::decoder_not_found)?;
+        let ctx = match ptr::NonNull::new(unsafe { avcodec_alloc_context3(ptr::null()) }) {
+            Some(c) => c,
+            None => {
+                unsafe { av_parser_close(parser.as_ptr()) };
+                return Err(Error::enomem());
+            }
+        };
+        let pkt = match ptr::NonNull::new(unsafe { av_packet_alloc() }) {
+            Some(p) => p,
+            None => {
+                let mut c = ctx.as_ptr();
+                unsafe {
+                    avcodec_free_context(&mut c);
+                    av_parser_close(parser.as_ptr());
+                }
+                return Err(Error::enomem());
+            }
+        };
+        Ok(Parser { parser, ctx, pkt })
+    }
+
+    /// Parses some of `data`, returning the number of bytes consumed and possibly a complete
+    /// packet. Call repeatedly with the rest of `data` until all is consumed, then with the next
+    /// chunk. An empty `data` signals the end of the stream, flushing the final packet.
+    ///
+    /// `pts` and `dts` apply to the start of `data` and are carried through to the packet that
+    /// starts there. The returned packet may refer to `data` itself, avoiding a copy.
+    pub fn parse<'a>(
+        &'a mut self,
+        data: &'a [u8],
+        pts: Option<i64>,
+        dts: Option<i64>,
+    ) -> Result<(usize, Option<ParsedPacket<'a>>), Error> {
+        let mut info = PacketInfo::empty();
+        let size = libc::c_int::try_from(data.len()).map_err(|_| Error::invalid_data())?;
+        let n = Error::wrap(unsafe {
+            moonfire_ffmpeg_parser_parse(
+                self.parser.as_ptr(),
+                self.ctx.as_ptr(),
+                self.pkt.as_ptr(),
+                if data.is_empty() {
+                    ptr::null()
+                } else {
+                    data.as_ptr()
+                },
+                size,
+                pts.unwrap_or(AV_NOPTS_VALUE),
+                dts.unwrap_or(AV_NOPTS_VALUE),
+                &mut info,
+            )
+        })?;
+        let pkt = if info.size == 0 {
+            None
+        } else {
+            Some(ParsedPacket {
+                pkt: self.pkt.as_ptr(),
+                info,
+                _marker: std::marker::PhantomData,
+            })
+        };
+        Ok((n as usize, pkt))
+    }
+}
+
+unsafe impl Send for Parser {}
+
+impl Drop for Parser {
+    fn drop(&mut self) {
+        let mut p = self.pkt.as_ptr();
+        let mut c = self.ctx.as_ptr();
+        unsafe {
+            av_packet_free(&mut p);
+            av_parser_close(self.parser.as_ptr());
+            avcodec_free_context(&mut c);
+        }
+    }
+}
+
+/// A bitstream filter chain, such as `h264_mp4toannexb` to turn mp4-style (AVCC) H.264 into
+/// Annex B for RTSP/WebRTC, or `extract_extradata`.
+///
+/// Packets are passed by reference count, so filters which don't rewrite the payload copy
+/// nothing.
+pub struct BsfContext {
+    ctx: ptr::NonNull<AVBSFContext>,
+
+    /// Scratch packet for `send_packet`; the filter takes each reference it's given.
+    pkt: ptr::NonNull<AVPacket>,
+}
+
+impl BsfContext {
+    /// Creates a filter chain from a comma-separated list of filters with optional options, eg
+    /// `h264_mp4toannexb` or `h264_metadata=aud=insert,dump_extra`. An empty string is a
+    /// pass-through filter.
+    ///
+    /// `par` and `time_base` describe the input; they're typically an `InputStream`'s, or
+    /// another `BsfContext`'s `par_out` and `time_base_out` when chaining separately.
+    pub fn new(
+        filters: &CStr,
+        par: &AVCodecParameters,
+        time_base: Rational,
+    ) -> Result<Self, Error> {
+        let pkt = ptr::NonNull::new(unsafe { av_packet_alloc() }).ok_or_else(Error::enomem)?;
+        let mut ctx = ptr::null_mut();
+        if let Err(e) = Error::wrap(unsafe {
+            moonfire_ffmpeg_bsf_new(filters.as_ptr(), par, time_base, &mut ctx)
+        }) {
+            let mut p = pkt.as_ptr();
+            unsafe { av_packet_free(&mut p) };
+            return Err(e);
+        }
+        Ok(BsfContext {
+            ctx: ptr::NonNull::new(ctx).unwrap(),
+            pkt,
+        })
+    }
+
+    /// Sends a new reference to `pkt` into the filter.
+    pub fn send_packet<P: AsPacket>(&mut self, pkt: &P) -> Result<(), Error> {
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_bsf_send_packet(self.ctx.as_ptr(), self.pkt.as_ptr(), pkt.av_packet())
+        })?;
+        Ok(())
+    }
+
+    /// Signals the end of the stream, so that `receive_packet` returns any buffered packets then
+    /// end of file.
+    pub fn drain(&mut self) -> Result<(), Error> {
+        Error::wrap(unsafe { av_bsf_send_packet(self.ctx.as_ptr(), ptr::null_mut()) })?;
+        Ok(())
+    }
+
+    /// Receives a filtered packet into `pkt`, replacing its previous contents.
+    /// Returns false if the filter needs more input first.
+    pub fn receive_packet(&mut self, pkt: &mut OwnedPacket) -> Result<bool, Error> {
+        unsafe { av_packet_unref(pkt.pkt.as_ptr()) };
+        pkt.info = PacketInfo::empty();
+        match Error::wrap(unsafe { av_bsf_receive_packet(self.ctx.as_ptr(), pkt.pkt.as_ptr()) }) {
+            Ok(_) => {}
+            Err(e) if e.is_eagain() => return Ok(false),
+            Err(e) => return Err(e),
+        }
+        unsafe { moonfire_ffmpeg_packet_info(pkt.pkt.as_ptr(), &mut pkt.info) };
+        Ok(true)
+    }
+
+    /// Discards buffered packets, as when seeking.
+    pub fn flush(&mut self) {
+        unsafe { av_bsf_flush(self.ctx.as_ptr()) };
+    }
+
+    /// Returns the parameters of the filtered stream, eg for a muxer or a further filter.
+    pub fn par_out(&self) -> InputCodecParameters {
+        InputCodecParameters(unsafe { &*moonfire_ffmpeg_bsf_par_out(self.ctx.as_ptr()) })
+    }
+
+    pub fn time_base_out(&self) -> Rational {
+        unsafe { moonfire_ffmpeg_bsf_time_base_out(self.ctx.as_ptr()) }
+    }
+}
+
+unsafe impl Send for BsfContext {}
+
+impl Drop for BsfContext {
+    fn drop(&mut self) {
+        let mut p = self.pkt.as_ptr();
+        let mut ctx = self.ctx.as_ptr();
+        unsafe {
+            av_packet_free(&mut p);
+            av_bsf_free(&mut ctx);
+        }
+    }
+}
+
+#[derive(Copy, Clone)]
+pub struct Encoder(&'static AVCodec);
+
+impl Encoder {
+    pub fn alloc_context(self) -> Result<EncodeContext, Error> {
+        let ctx = ptr::NonNull::new(unsafe { avcodec_alloc_context3(self.0) })
+            .ok_or_else(Error::enomem)?;
+        let pkt = match ptr::NonNull::new(unsafe { av_packet_alloc() }) {
+            Some(p) => p,
+            None => {
+                let mut ctx = ctx.as_ptr();
+                unsafe { avcodec_free_context(&mut ctx) };
+                return Err(Error::enomem());
+            }
+        };
+        Ok(EncodeContext {
+            encoder: self,
+            ctx,
+            pkt,
+        })
+    }
+}
+
+/// An encoder, set up via `set_params` and `open`.
+///
+/// Once open, it can encode any number of frames of the given parameters, so (eg) a
+/// long-lived MJPEG encoder pays the setup cost only once across many snapshots.
+pub struct EncodeContext {
+    encoder: Encoder,
+    ctx: ptr::NonNull<AVCodecContext>,
+
+    /// Scratch packet for `encode_into`.
+    pkt: ptr::NonNull<AVPacket>,
+}
+
+impl Drop for EncodeContext {
+    fn drop(&mut self) {
+        let mut p = self.pkt.as_ptr();
+        let mut ctx = self.ctx.as_ptr();
+        unsafe {
+            av_packet_free(&mut p);
+            avcodec_free_context(&mut ctx);
+        }
+    }
+}
+
+unsafe impl Send for EncodeContext {}
+
+#[derive(Copy, Clone, Debug)]
+#[repr(C)]
+pub struct VideoParameters {
+    width: libc::c_int,
+    height: libc::c_int,
+    sample_aspect_ratio: Rational,
+    pix_fmt: PixelFormat,
+    time_base: Rational,
+}
+
+impl VideoParameters {
+    /// Returns parameters with square pixels.
+    pub fn new(dims: ImageDimensions, time_base: Rational) -> Self {
+        VideoParameters {
+            width: dims.width,
+            height: dims.height,
+            sample_aspect_ratio: Rational { num: 1, den: 1 },
+            pix_fmt: dims.pix_fmt,
+            time_base,
+        }
+    }
+
+    pub fn dims(&self) -> ImageDimensions {
+        ImageDimensions {
+            width: self.width,
+            height: self.height,
+            pix_fmt: self.pix_fmt,
+        }
+    }
+
+    pub fn time_base(&self) -> Rational {
+        self.time_base
+    }
+}
+
+impl EncodeContext {
+    pub fn set_params(&mut self, p: &VideoParameters) {
+        unsafe { moonfire_ffmpeg_cctx_set_params(self.ctx.as_ptr(), p) };
+    }
+
+    pub fn params(&self) -> VideoParameters {
+        self.ctx().params()
+    }
+
+    /// Opens the encoder, consuming recognized options (eg `q:v`-style `qscale` settings or
+    /// x264's `preset`) from `options`.
+    pub fn open(&mut self, options: &mut Dictionary) -> Result<(), Error> {
+        Error::wrap(unsafe { avcodec_open2(self.ctx.as_ptr(), self.encoder.0, options) })?;
+        Ok(())
+    }
+
+    pub fn ctx(&self) -> &AVCodecContext {
+        unsafe { self.ctx.as_ref() }
+    }
+
+    /// Sends a frame, which must match the dimensions and pixel format set via `set_params`.
+    /// The encoder takes a new reference, so `frame` (eg, from a `FramePool`) can be reused
+    /// immediately.
+    pub fn send_frame(&self, frame: &VideoFrame) -> Result<(), Error> {
+        assert_eq!(frame.dims(), self.params().dims());
+        Error::wrap(unsafe { avcodec_send_frame(self.ctx.as_ptr(), frame.frame.as_ptr()) })?;
+        Ok(())
+    }
+
+    /// Signals the end of the stream, so that `receive_packet` returns the buffered packets then
+    /// end of file.
+    pub fn drain(&self) -> Result<(), Error> {
+        Error::wrap(unsafe { avcodec_send_frame(self.ctx.as_ptr(), ptr::null()) })?;
+        Ok(())
+    }
+
+    /// Receives an encoded packet into `pkt`, replacing its previous contents.
+    /// Returns false if the encoder needs more input first.
+    pub fn receive_packet(&self, pkt: &mut OwnedPacket) -> Result<bool, Error> {
+        // avcodec_receive_packet unrefs `pkt` first, so its old info is stale on any outcome.
+        pkt.info = PacketInfo::empty();
+        match Error::wrap(unsafe { avcodec_receive_packet(self.ctx.as_ptr(), pkt.pkt.as_ptr()) }) {
+            Ok(_) => {}
+            Err(e) if e.is_eagain() => return Ok(false),
+            Err(e) => return Err(e),
+        }
+        unsafe { moonfire_ffmpeg_packet_info(pkt.pkt.as_ptr(), &mut pkt.info) };
+        Ok(true)
+    }
+
+    /// Encodes `frame` and appends all packets it makes available to `out`, returning the
+    /// number of bytes appended. For intra-only codecs such as MJPEG, this is one complete
+    /// image per frame.
+    pub fn encode_into(&mut self, frame: &VideoFrame, out: &mut Vec<u8>) -> Result<usize, Error> {
+        self.send_frame(frame)?;
+        let before = out.len();
+        loop {
+            match Error::wrap(unsafe {
+                avcodec_receive_packet(self.ctx.as_ptr(), self.pkt.as_ptr())
+            }) {
+                Ok(_) => {}
+                Err(e) if e.is_eagain() => break,
+                Err(e) => return Err(e),
+            }
+            let mut info = PacketInfo::empty();
+            unsafe {
+                moonfire_ffmpeg_packet_info(self.pkt.as_ptr(), &mut info);
+                out.extend_from_slice(info.data().unwrap_or(&[]));
+                av_packet_unref(self.pkt.as_ptr());
+            }
+        }
+        Ok(out.len() - before)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use crate::avformat::InputFormatContext;
+    use crate::avutil::{Dictionary, VideoFrame};
+    use cstr::cstr;
+
+    /// Decodes all packets of `clip.mp4`, draining at the end, and returns the frames' pts.
+    fn decode_all(dec: &super::DecodeContext, ctx: &InputFormatContext) -> Vec<i64> {
+        let mut frame = VideoFrame::empty().unwrap();
+        let mut pts = Vec::new();
+        loop {
+            let pkt = match ctx.read_frame() {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(p) => p,
+            };
+            let mut frames = dec.decode(&pkt, &mut frame).unwrap();
+            while let Some(f) = frames.next().unwrap() {
+                pts.push(f.pts());
+            }
+        }
+        dec.drain().unwrap();
+        let mut frames = dec.frames(&mut frame);
+        while let Some(f) = frames.next().unwrap() {
+            pts.push(f.pts());
+        }
+        pts
+    }
+
+    #[test]
+    fn thread_budget() {
+        let b = super::ThreadBudget::new(4);
+        let r1 = b.reserve(3);
+        assert_eq!(r1.n, 3);
+        let mut r2 = b.reserve(3);
+        assert_eq!(r2.n, 1);
+        let r3 = b.reserve(3);
+        assert_eq!(r3.n, 1); // at least one, even when exhausted.
+        assert_eq!(b.in_use(), 5);
+        drop(r1);
+        r2.resize_to(0);
+        assert_eq!(b.in_use(), 1);
+        drop(r3);
+        assert_eq!(b.in_use(), 0);
+    }
+
+    #[test]
+    fn threading() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let mut ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        ctx.find_stream_info().unwrap();
+        let budget = super::ThreadBudget::new(3);
+        let opts = super::DecoderOptions::new()
+            .thread_type(super::ThreadType::Frame)
+            .thread_count(8)
+            .thread_budget(&budget);
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut Dictionary::new())
+            .unwrap();
+        let t = dec.threading();
+        assert_eq!(t.thread_type, Some(super::ThreadType::Frame));
+        assert_eq!(t.thread_count, 3);
+        assert_eq!(t.added_latency_frames(), 2);
+        assert_eq!(budget.in_use(), 3);
+        assert_eq!(
+            decode_all(&dec, &ctx),
+            &[0, 29700, 59400, 90000, 119700, 149400]
+        );
+        drop(dec);
+        assert_eq!(budget.in_use(), 0);
+
+        // A count alone keeps ffmpeg's default thread types, so threading is still enabled.
+        let opts = super::DecoderOptions::new().thread_count(2);
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut Dictionary::new())
+            .unwrap();
+        let t = dec.threading();
+        assert_eq!(t.thread_count, 2);
+        assert!(t.thread_type.is_some());
+        drop(dec);
+
+        // A budget alone applies, and is charged for a dictionary override.
+        let opts = super::DecoderOptions::new().thread_budget(&budget);
+        let mut d = Dictionary::new();
+        d.set(cstr!("threads"), cstr!("4")).unwrap();
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut d)
+            .unwrap();
+        assert_eq!(dec.threading().thread_count, 4);
+        assert_eq!(budget.in_use(), 4);
+        drop(dec);
+        assert_eq!(budget.in_use(), 0);
+    }
+
+    /// Hardware decoding should work when available and fall back to software otherwise.
+    #[test]
+    fn hwaccel() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let mut ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        ctx.find_stream_info().unwrap();
+        let opts = super::DecoderOptions::new().hwaccel(super::HwDeviceType::Vaapi, None);
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut Dictionary::new())
+            .unwrap();
+        let mut frame = VideoFrame::empty().unwrap();
+        let mut sw = VideoFrame::empty().unwrap();
+        let mut n = 0;
+        let mut handle = |f: &VideoFrame| {
+            if f.is_hw() {
+                f.transfer_to_system(&mut sw).unwrap();
+                assert!(!sw.is_hw());
+                assert_eq!(sw.pts(), f.pts());
+            }
+            n += 1;
+        };
+        loop {
+            let pkt = match ctx.read_frame() {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(p) => p,
+            };
+            let mut frames = dec.decode(&pkt, &mut frame).unwrap();
+            while let Some(f) = frames.next().unwrap() {
+                handle(f);
+            }
+        }
+        dec.drain().unwrap();
+        let mut frames = dec.frames(&mut frame);
+        while let Some(f) = frames.next().unwrap() {
+            handle(f);
+        }
+        assert_eq!(n, 6);
+    }
+
+    #[test]
+    fn decode() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let mut ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        ctx.find_stream_info().unwrap();
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder(&mut Dictionary::new())
+            .unwrap();
+        assert_eq!(
+            decode_all(&dec, &ctx),
+            &[0, 29700, 59400, 90000, 119700, 149400]
+        );
+    }
+
+    #[test]
+    fn keyframes_only() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let mut ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        ctx.find_stream_info().unwrap();
+        let opts = super::DecoderOptions::new().discard(super::DiscardPolicy::keyframes_only());
+        let mut dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder_with(&opts, &mut Dictionary::new())
+            .unwrap();
+        assert_eq!(dec.discard(), super::DiscardPolicy::keyframes_only());
+        let stats = std::sync::Arc::new(crate::stats::DecodeStats::new());
+        dec.set_stats(Some(stats.clone()));
+        assert_eq!(decode_all(&dec, &ctx), &[0, 90000]);
+        let s = stats.snapshot();
+        assert_eq!((s.packets, s.frames, s.errors), (6, 2, 0));
+
+        let policy = super::DiscardPolicy {
+            skip_loop_filter: super::Discard::All,
+            ..Default::default()
+        };
+        dec.set_discard(&policy);
+        assert_eq!(dec.discard(), policy);
+    }
+
+    #[test]
+    fn decoder_pool() {
+        crate::Ffmpeg::new();
+        let pool = super::DecoderPool::new(1, super::DecoderOptions::new());
+        let mut dict = Dictionary::new();
+        let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let stream = ctx.streams().get(0);
+        let par = stream.codecpar();
+        {
+            let mut dec = pool.get(&par, &mut Dictionary::new()).unwrap();
+            assert!(dec.is_compatible(&par));
+            dec.set_discard(&super::DiscardPolicy::keyframes_only());
+            assert_eq!(decode_all(&dec, &ctx), &[0, 90000]);
+        }
+        assert_eq!(pool.len(), 1);
+
+        // The warm decoder should be reused, as it was before the policy change.
+        let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let dec = pool.get(&par, &mut Dictionary::new()).unwrap();
+        assert!(pool.is_empty());
+        assert_eq!(dec.discard(), super::DiscardPolicy::default());
+        assert_eq!(decode_all(&dec, &ctx).len(), 6);
+
+        // Different extradata is incompatible.
+        let other = super::CodecParameters::new_video(par.codec_id(), par.dims(), b"").unwrap();
+        assert!(!dec.is_compatible(&other));
+        drop(dec);
+        let other_dec = pool.get(&other, &mut Dictionary::new()).unwrap();
+        assert!(other_dec.is_compatible(&other));
+        assert!(!other_dec.is_compatible(&par));
+
+        // ...so a new decoder was created, and the original stays idle for `par`.
+        assert_eq!(pool.len(), 1);
+        let dec = pool.get(&par, &mut Dictionary::new()).unwrap();
+        assert!(pool.is_empty());
+        assert!(dec.is_compatible(&par));
+    }
+
+    /// Decoding should work from stored parameters, without `find_stream_info`.
+    #[test]
+    fn new_video_params() {
+        use crate::avformat::{OpenOptions, ProbeOptions};
+        crate::Ffmpeg::new();
+        let probe = ProbeOptions::new()
+            .format(cstr!("mp4"))
+            .probesize(4096)
+            .analyze_duration(std::time::Duration::from_millis(100));
+        let mut dict = Dictionary::new();
+        let ctx = InputFormatContext::open_with(
+            cstr!("src/testdata/clip.mp4"),
+            &OpenOptions::new().probe(probe),
+            &mut dict,
+        )
+        .unwrap();
+        let (codec_id, dims, extradata) = {
+            let par = ctx.streams().get(0).codecpar();
+            (par.codec_id(), par.dims(), par.extradata().to_owned())
+        };
+        let par = super::CodecParameters::new_video(codec_id, dims, &extradata).unwrap();
+        assert_eq!(par.extradata(), &extradata[..]);
+        assert_eq!(par.dims(), dims);
+        let dec = par.as_input().new_decoder(&mut Dictionary::new()).unwrap();
+        assert_eq!(decode_all(&dec, &ctx).len(), 6);
+    }
+
+    /// A single MJPEG encoder should encode many snapshots.
+    #[test]
+    fn encode_jpeg() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder(&mut Dictionary::new())
+            .unwrap();
+        let mut frame = VideoFrame::empty().unwrap();
+        let mut enc: Option<super::EncodeContext> = None;
+        let mut jpeg = Vec::new();
+        let mut n = 0;
+        loop {
+            let pkt = match ctx.read_frame() {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(p) => p,
+            };
+            let mut frames = dec.decode(&pkt, &mut frame).unwrap();
+            while let Some(f) = frames.next().unwrap() {
+                let enc = enc.get_or_insert_with(|| {
+                    let mut enc = super::CodecId::mjpeg()
+                        .find_encoder()
+                        .unwrap()
+                        .alloc_context()
+                        .unwrap();
+                    enc.set_params(&super::VideoParameters::new(
+                        f.dims(),
+                        crate::avutil::Rational { num: 1, den: 90000 },
+                    ));
+                    let mut opts = Dictionary::new();
+                    opts.set(cstr!("strict"), cstr!("unofficial")).unwrap(); // allow limited-range yuv.
+                    enc.open(&mut opts).unwrap();
+                    enc
+                });
+                jpeg.clear();
+                let len = enc.encode_into(f, &mut jpeg).unwrap();
+                assert_eq!(len, jpeg.len());
+                assert_eq!(&jpeg[..2], b"\xff\xd8");
+                assert_eq!(&jpeg[len - 2..], b"\xff\xd9");
+                n += 1;
+            }
+        }
+        assert!(n > 1);
+
+        let enc = enc.unwrap();
+        enc.drain().unwrap();
+        let mut pkt = super::OwnedPacket::empty().unwrap();
+        assert!(enc.receive_packet(&mut pkt).unwrap_err().is_eof());
+    }
+
+    #[test]
+    fn bsf_annexb() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let stream = ctx.streams().get(0);
+        let mut bsf = super::BsfContext::new(
+            cstr!("h264_mp4toannexb"),
+            &stream.codecpar(),
+            stream.time_base(),
+        )
+        .unwrap();
+        assert!(bsf.par_out().codec_id().is_h264());
+        let mut out = super::OwnedPacket::empty().unwrap();
+        let mut pts = Vec::new();
+        let mut check = |out: &super::OwnedPacket| {
+            let d = out.data().unwrap();
+            assert!(d.starts_with(b"\0\0\0\x01") || d.starts_with(b"\0\0\x01"));
+            pts.push(out.pts().unwrap());
+        };
+        loop {
+            let pkt = match ctx.read_frame() {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(p) => p,
+            };
+            bsf.send_packet(&pkt).unwrap();
+            while bsf.receive_packet(&mut out).unwrap() {
+                check(&out);
+            }
+        }
+        bsf.drain().unwrap();
+        loop {
+            match bsf.receive_packet(&mut out) {
+                Ok(true) => check(&out),
+                Ok(false) => panic!("drained filter should not return EAGAIN"),
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+            }
+        }
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+    }
+
+    /// An Annex B elementary stream should parse into the original packets and decode without
+    /// codec parameters.
+    #[test]
+    fn parse() {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        let ctx = InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let stream = ctx.streams().get(0);
+        let mut bsf = super::BsfContext::new(
+            cstr!("h264_mp4toannexb"),
+            &stream.codecpar(),
+            stream.time_base(),
+        )
+        .unwrap();
+        let mut chunks = Vec::new();
+        let mut out = super::OwnedPacket::empty().unwrap();
+        loop {
+            let pkt = match ctx.read_frame() {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(p) => p,
+            };
+            bsf.send_packet(&pkt).unwrap();
+            while bsf.receive_packet(&mut out).unwrap() {
+                chunks.push((out.pts(), out.data().unwrap().to_vec()));
+            }
+        }
+
+        let dec = super::CodecId::h264()
+            .find_decoder()
+            .unwrap()
+            .open(&super::DecoderOptions::new(), &mut Dictionary::new())
+            .unwrap();
+        let mut parser = super::Parser::new(super::CodecId::h264()).unwrap();
+        let mut frame = VideoFrame::empty().unwrap();
+        let mut parsed_pts = Vec::new();
+        let mut decoded_pts = Vec::new();
+        let empty = (None, Vec::new());
+        for (pts, data) in chunks.iter().chain(std::iter::once(&empty)) {
+            let mut rest = &data[..];
+            loop {
+                let (n, pkt) = parser.parse(rest, *pts, None).unwrap();
+                rest = &rest[n..];
+                let done = pkt.is_none();
+                if let Some(p) = pkt {
+                    parsed_pts.push(p.pts().unwrap());
+                    let mut frames = dec.decode(&p, &mut frame).unwrap();
+                    while let Some(f) = frames.next().unwrap() {
+                        decoded_pts.push(f.pts());
+                    }
+                }
+                if rest.is_empty() && (done || !data.is_empty()) {
+                    break;
+                }
+            }
+        }
+        dec.drain().unwrap();
+        let mut frames = dec.frames(&mut frame);
+        while let Some(f) = frames.next().unwrap() {
+            decoded_pts.push(f.pts());
+        }
+        assert_eq!(parsed_pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+        assert_eq!(decoded_pts, parsed_pts);
     }
 }
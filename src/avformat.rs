@@ -2,15 +2,19 @@
 // SPDX-License-Identifier: MIT OR Apache-2.0
 
 use crate::avcodec::{
-    av_init_packet, moonfire_ffmpeg_packet_alloc, moonfire_ffmpeg_packet_free, AVCodecParameters,
-    AVPacket, InputCodecParameters, Packet,
+    av_packet_alloc, av_packet_free, AVCodecParameters, AVPacket, AsPacket, CodecParameters,
+    InputCodecParameters, Packet, PacketBatch, PacketInfo,
 };
 use crate::avutil::{Dictionary, Error};
-use std::cell::RefCell;
+use crate::stats::InputStats;
+use std::any::Any;
+use std::cell::{Cell, RefCell};
 use std::convert::TryFrom;
-use std::ffi::CStr;
-use std::marker::PhantomData;
+use std::ffi::{CStr, CString};
 use std::ptr;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
 //#[link(name = "avformat")]
 extern "C" {
@@ -46,11 +50,16 @@ extern "C" {
             ) -> i64,
         >,
     ) -> *mut AVIOContext;
-    fn avio_context_free(s: *mut *mut AVIOContext);
 
-    //fn avformat_alloc_output_context2(ctx: *mut *mut AVFormatContext, oformat: *mut AVOutputFormat,
-    //                                  format_name: *const libc::c_char,
-    //                                  filename: *const libc::c_char) -> libc::c_int;
+    fn avformat_alloc_output_context2(
+        ctx: *mut *mut AVFormatContext,
+        oformat: *const AVOutputFormat,
+        format_name: *const libc::c_char,
+        filename: *const libc::c_char,
+    ) -> libc::c_int;
+    fn avformat_free_context(ctx: *mut AVFormatContext);
+    fn avformat_write_header(ctx: *mut AVFormatContext, options: *mut Dictionary) -> libc::c_int;
+    fn av_write_trailer(ctx: *mut AVFormatContext) -> libc::c_int;
     fn avformat_open_input(
         ctx: *mut *mut AVFormatContext,
         url: *const libc::c_char,
@@ -58,13 +67,19 @@ extern "C" {
         options: *mut Dictionary,
     ) -> libc::c_int;
     fn avformat_close_input(ctx: *mut *mut AVFormatContext);
+    fn av_find_input_format(short_name: *const libc::c_char) -> *const AVInputFormat;
     fn avformat_find_stream_info(
         ctx: *mut AVFormatContext,
         options: *mut Dictionary,
     ) -> libc::c_int;
-    //fn avformat_new_stream(s: *mut AVFormatContext, c: *const AVCodec) -> *mut AVStream;
-    //fn avformat_write_header(c: *mut AVFormatContext, opts: *mut *mut AVDictionary) -> libc::c_int;
-    fn av_read_frame(ctx: *mut AVFormatContext, p: *mut AVPacket) -> libc::c_int;
+    fn avformat_seek_file(
+        ctx: *mut AVFormatContext,
+        stream_index: libc::c_int,
+        min_ts: i64,
+        ts: i64,
+        max_ts: i64,
+        flags: libc::c_int,
+    ) -> libc::c_int;
     pub(crate) fn av_register_all();
     pub(crate) fn avformat_network_init() -> libc::c_int;
 }
@@ -75,22 +90,68 @@ extern "C" {
 
     static moonfire_ffmpeg_avseek_force: libc::c_int;
     static moonfire_ffmpeg_avseek_size: libc::c_int;
+    static moonfire_ffmpeg_avseek_flag_any: libc::c_int;
+    static moonfire_ffmpeg_avseek_flag_byte: libc::c_int;
+    static moonfire_ffmpeg_avseek_flag_frame: libc::c_int;
     static moonfire_ffmpeg_seek_set: libc::c_int;
     static moonfire_ffmpeg_seek_cur: libc::c_int;
     static moonfire_ffmpeg_seek_end: libc::c_int;
 
     fn moonfire_ffmpeg_fctx_streams(ctx: *const AVFormatContext) -> StreamsLen;
-    //fn moonfire_ffmpeg_fctx_open_write(ctx: *mut AVFormatContext,
-    //                                   url: *const libc::c_char) -> libc::c_int;
-    //
+    fn moonfire_ffmpeg_fctx_read_frame(
+        ctx: *mut AVFormatContext,
+        pkt: *mut AVPacket,
+        info: *mut PacketInfo,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_fctx_read_frames(
+        ctx: *mut AVFormatContext,
+        pkts: *mut *mut AVPacket,
+        infos: *mut PacketInfo,
+        max: libc::size_t,
+        n: *mut libc::size_t,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_fctx_open_write(
+        ctx: *mut AVFormatContext,
+        url: *const libc::c_char,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_fctx_close_write(ctx: *mut AVFormatContext);
+    fn moonfire_ffmpeg_fctx_flush(ctx: *mut AVFormatContext);
+    fn moonfire_ffmpeg_fctx_new_stream(
+        ctx: *mut AVFormatContext,
+        par: *const AVCodecParameters,
+        time_base: crate::avutil::Rational,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_fctx_write_packet(
+        ctx: *mut AVFormatContext,
+        scratch: *mut AVPacket,
+        pkt: *const AVPacket,
+        stream_index: libc::c_int,
+        time_base: crate::avutil::Rational,
+    ) -> libc::c_int;
 
     fn moonfire_ffmpeg_fctx_set_pb(ctx: *mut AVFormatContext, pb: *mut AVIOContext);
+    fn moonfire_ffmpeg_fctx_set_probe(ctx: *mut AVFormatContext, p: *const RawProbe);
+    fn moonfire_ffmpeg_fctx_set_interrupt_callback(
+        ctx: *mut AVFormatContext,
+        cb: unsafe extern "C" fn(opaque: *mut libc::c_void) -> libc::c_int,
+        opaque: *mut libc::c_void,
+    );
 
     fn moonfire_ffmpeg_ioctx_set_direct(pb: *mut AVIOContext);
+    fn moonfire_ffmpeg_ioctx_free(pb: *mut *mut AVIOContext);
 
     fn moonfire_ffmpeg_stream_codecpar(stream: *const AVStream) -> *const AVCodecParameters;
     fn moonfire_ffmpeg_stream_duration(stream: *const AVStream) -> i64;
     fn moonfire_ffmpeg_stream_time_base(stream: *const AVStream) -> crate::avutil::Rational;
+    fn moonfire_ffmpeg_stream_index_len(stream: *const AVStream) -> libc::c_int;
+    fn moonfire_ffmpeg_stream_index(
+        stream: *const AVStream,
+        n: libc::c_int,
+        pos: *mut i64,
+        timestamp: *mut i64,
+        size: *mut libc::c_int,
+        is_key: *mut bool,
+    );
 }
 
 // No ABI stability assumption here; use heap allocation/deallocation and accessors only.
@@ -107,16 +168,241 @@ struct AVInputFormat {
     _private: [u8; 0],
 }
 #[repr(C)]
+struct AVOutputFormat {
+    _private: [u8; 0],
+}
+#[repr(C)]
 struct AVStream {
     _private: [u8; 0],
 }
 
 pub struct InputFormatContext<'a> {
-    /// When using `InputFormatContext::with_io_context`, `ctx` has a `pb` member which has an
-    /// `opaque` referencing `_io_ctx`.
-    _io_ctx: PhantomData<&'a mut dyn IoContext>,
+    /// When using `InputFormatContext::with_io_context`, `ctx` has a `pb` member which is owned
+    /// by `_io_ctx`. libavformat doesn't free custom `pb`s, so this must outlive `ctx`.
+    _io_ctx: Option<IoContextWrapper<'a>>,
     ctx: *mut AVFormatContext,
     pkt: RefCell<*mut AVPacket>,
+
+    /// The `interrupt_callback`'s opaque; boxed for a stable address.
+    interrupt: Box<Interrupt>,
+
+    stats: Option<Arc<InputStats>>,
+
+    /// An error which ended a partial `read_frames` batch, to be returned by the next call.
+    deferred_error: Option<Error>,
+}
+
+/// A cancellation flag which can be shared with other threads, to interrupt blocking
+/// `InputFormatContext` operations (such as reading from a stalled RTSP camera).
+///
+/// Once cancelled, all operations on contexts using the token fail with `Error::exit()`.
+/// Like timeouts, this is checked by ffmpeg's protocols (file, tcp, rtsp, ...) as they wait for
+/// I/O, not by custom `IoContext`s.
+#[derive(Clone, Debug, Default)]
+pub struct CancelToken(Arc<AtomicBool>);
+
+impl CancelToken {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn cancel(&self) {
+        self.0.store(true, Ordering::Relaxed);
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// Limits on how much input libavformat examines to identify the format (during open) and the
+/// streams (during `find_stream_info`). The defaults can read several megabytes and take
+/// hundreds of milliseconds per input.
+///
+/// When the codec parameters are already known (see `CodecParameters::new_video`), the fastest
+/// option is to give the `format`, skip `find_stream_info` entirely, and decode with the known
+/// parameters.
+#[derive(Clone, Debug, Default)]
+pub struct ProbeOptions {
+    format: Option<CString>,
+    probesize: Option<i64>,
+    analyze_duration: Option<i64>,
+    fps_probe_size: Option<i32>,
+}
+
+impl ProbeOptions {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Uses the named demuxer (eg `mp4`) rather than probing for one.
+    pub fn format(mut self, short_name: &CStr) -> Self {
+        self.format = Some(short_name.to_owned());
+        self
+    }
+
+    /// Limits the bytes read to identify the format and streams (libavformat's `probesize`;
+    /// at least 32).
+    pub fn probesize(mut self, bytes: usize) -> Self {
+        self.probesize = Some(i64::try_from(bytes).unwrap_or(i64::MAX));
+        self
+    }
+
+    /// Limits the duration of input `find_stream_info` examines (`analyzeduration`).
+    pub fn analyze_duration(mut self, d: Duration) -> Self {
+        self.analyze_duration = Some(i64::try_from(d.as_micros()).unwrap_or(i64::MAX));
+        self
+    }
+
+    /// Limits the frames `find_stream_info` examines to estimate frame rates (`fpsprobesize`).
+    pub fn fps_probe_size(mut self, frames: u32) -> Self {
+        self.fps_probe_size = Some(i32::try_from(frames).unwrap_or(i32::MAX));
+        self
+    }
+
+    fn raw(&self) -> RawProbe {
+        RawProbe {
+            probesize: self.probesize.unwrap_or(-1),
+            max_analyze_duration: self.analyze_duration.unwrap_or(-1),
+            fps_probe_size: self.fps_probe_size.unwrap_or(-1),
+        }
+    }
+}
+
+// matches moonfire_ffmpeg_probe
+#[repr(C)]
+struct RawProbe {
+    probesize: i64,
+    max_analyze_duration: i64,
+    fps_probe_size: libc::c_int,
+}
+
+/// Options to `InputFormatContext::open_with`.
+#[derive(Clone, Debug, Default)]
+pub struct OpenOptions {
+    cancel: Option<CancelToken>,
+    timeout: Option<Duration>,
+    probe: ProbeOptions,
+    stats: Option<Arc<InputStats>>,
+}
+
+impl OpenOptions {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Sets a token which can interrupt the open and all later operations on the context.
+    pub fn cancel(mut self, token: &CancelToken) -> Self {
+        self.cancel = Some(token.clone());
+        self
+    }
+
+    /// Limits the time spent opening (including probing, but not `find_stream_info`).
+    pub fn timeout(mut self, timeout: Duration) -> Self {
+        self.timeout = Some(timeout);
+        self
+    }
+
+    /// Uses the named demuxer (eg `mp4`) rather than probing for one. Shorthand for
+    /// setting `ProbeOptions::format`.
+    pub fn format(mut self, short_name: &CStr) -> Self {
+        self.probe.format = Some(short_name.to_owned());
+        self
+    }
+
+    /// Sets the probing limits, replacing any earlier `format`.
+    pub fn probe(mut self, probe: ProbeOptions) -> Self {
+        self.probe = probe;
+        self
+    }
+
+    /// Records packet, I/O, and `read_frame` latency stats into `stats`, which may be shared
+    /// with other contexts.
+    pub fn stats(mut self, stats: &Arc<InputStats>) -> Self {
+        self.stats = Some(stats.clone());
+        self
+    }
+}
+
+/// State for `interrupt_callback`, which ffmpeg polls from within blocking operations.
+struct Interrupt {
+    cancel: Option<CancelToken>,
+
+    /// The deadline of the operation in progress, if any.
+    deadline: Cell<Option<Instant>>,
+
+    /// If the current operation was interrupted because its deadline passed.
+    timed_out: Cell<bool>,
+}
+
+impl Interrupt {
+    /// Runs `f` with the given deadline, mapping an interruption due to the deadline to
+    /// `Error::timed_out()`.
+    fn with_deadline<T>(
+        &self,
+        deadline: Option<Instant>,
+        f: impl FnOnce() -> Result<T, Error>,
+    ) -> Result<T, Error> {
+        self.deadline.set(deadline);
+        self.timed_out.set(false);
+        let r = f();
+        self.deadline.set(None);
+        match r {
+            Err(e) if e.is_exit() && self.timed_out.get() => Err(Error::timed_out()),
+            r => r,
+        }
+    }
+}
+
+/// Implements `AVIOInterruptCB::callback`.
+unsafe extern "C" fn interrupt_callback(opaque: *mut libc::c_void) -> libc::c_int {
+    let i = &*(opaque as *const Interrupt);
+    if let Some(ref c) = i.cancel {
+        if c.is_cancelled() {
+            return 1;
+        }
+    }
+    if let Some(d) = i.deadline.get() {
+        if Instant::now() >= d {
+            i.timed_out.set(true);
+            return 1;
+        }
+    }
+    0
+}
+
+/// Flags to `InputFormatContext::seek`.
+#[derive(Copy, Clone, Debug, Default, PartialEq, Eq)]
+pub struct SeekFlags(libc::c_int);
+
+impl SeekFlags {
+    /// Seeks to a keyframe at or before the timestamp.
+    pub fn empty() -> Self {
+        SeekFlags(0)
+    }
+
+    /// Allows seeking to a non-keyframe. Decoding from there produces garbage until the next
+    /// keyframe.
+    pub fn any() -> Self {
+        SeekFlags(unsafe { moonfire_ffmpeg_avseek_flag_any })
+    }
+
+    /// Interprets the timestamp as a byte offset into the file.
+    pub fn byte() -> Self {
+        SeekFlags(unsafe { moonfire_ffmpeg_avseek_flag_byte })
+    }
+
+    /// Interprets the timestamp as a frame number.
+    pub fn frame() -> Self {
+        SeekFlags(unsafe { moonfire_ffmpeg_avseek_flag_frame })
+    }
+}
+
+impl std::ops::BitOr for SeekFlags {
+    type Output = Self;
+    fn bitor(self, rhs: Self) -> Self {
+        SeekFlags(self.0 | rhs.0)
+    }
 }
 
 /// Mode argument to `IoContext::seek`.
@@ -181,15 +467,45 @@ pub trait IoContext {
     }
 }
 
+/// The default `IoContext::buf_len` of `SliceIoContext` and `MmapIoContext`.
+const DEFAULT_BUF_LEN: usize = 4096;
+
+/// Returns the new position for `IoContext::seek` within a `len`-byte input.
+fn seek_pos(pos: usize, len: usize, offset: i64, whence: Whence) -> Result<u64, Error> {
+    let base = match whence {
+        Whence::Size => return Ok(u64::try_from(len).unwrap()),
+        Whence::Set => 0,
+        Whence::Cur => pos,
+        Whence::End => len,
+    };
+    i64::try_from(base)
+        .ok()
+        .and_then(|b| b.checked_add(offset))
+        .and_then(|p| u64::try_from(p).ok())
+        .filter(|&p| p <= u64::try_from(len).unwrap())
+        .ok_or_else(Error::invalid_data)
+}
+
 /// An `IoContext` implementation for an immutable slice.
 pub struct SliceIoContext<'a> {
     slice: &'a [u8],
     pos: usize,
+    buf_len: usize,
 }
 
 impl<'a> SliceIoContext<'a> {
     pub fn new(slice: &'a [u8]) -> Self {
-        Self { slice, pos: 0 }
+        Self::with_buf_len(slice, DEFAULT_BUF_LEN)
+    }
+
+    /// Uses the given AVIO buffer length. ffmpeg reads at least this much at a time, except
+    /// when reading directly into a large destination such as a packet's buffer.
+    pub fn with_buf_len(slice: &'a [u8], buf_len: usize) -> Self {
+        Self {
+            slice,
+            pos: 0,
+            buf_len,
+        }
     }
 }
 
@@ -207,7 +523,7 @@ impl<'a> IoContext for SliceIoContext<'a> {
         true
     }
     fn buf_len(&self) -> usize {
-        std::cmp::min(self.slice.len(), 4096)
+        std::cmp::max(1, std::cmp::min(self.slice.len(), self.buf_len))
     }
     fn read(&mut self, buf: &mut [u8]) -> Result<usize, Error> {
         let copy_len = std::cmp::min(buf.len(), self.slice.len() - self.pos);
@@ -216,33 +532,354 @@ impl<'a> IoContext for SliceIoContext<'a> {
         Ok(copy_len)
     }
     fn seek(&mut self, offset: i64, whence: Whence, _force: bool) -> Result<u64, Error> {
-        let offset = usize::try_from(offset).map_err(|_| Error::invalid_data())?;
-        let new_pos = match whence {
-            Whence::Size => return Ok(u64::try_from(self.slice.len()).unwrap()),
-            Whence::Set => offset,
-            Whence::Cur => self
-                .pos
-                .checked_add(offset)
-                .ok_or_else(Error::invalid_data)?,
-            Whence::End => self
-                .pos
-                .checked_add(offset)
-                .ok_or_else(Error::invalid_data)?,
+        let is_size = matches!(whence, Whence::Size);
+        let new_pos = seek_pos(self.pos, self.slice.len(), offset, whence)?;
+        if is_size {
+            return Ok(new_pos);
+        }
+        self.pos = usize::try_from(new_pos).unwrap();
+        Ok(new_pos)
+    }
+}
+
+/// An `IoContext` implementation for a file mapped into memory, avoiding a `read` syscall
+/// and kernel-to-user copy per buffer.
+///
+/// It's `direct`, so for large reads (such as most packets), libavformat copies straight from
+/// the page cache into the destination without going through the AVIO buffer.
+pub struct MmapIoContext {
+    slice: SliceIoContext<'static>,
+    ptr: *mut libc::c_void,
+
+    /// If non-zero, `madvise(MADV_WILLNEED)` this many bytes ahead of each read.
+    prefetch: usize,
+
+    /// The end of the range already advised via `MADV_WILLNEED`.
+    advised: usize,
+}
+
+impl MmapIoContext {
+    /// Maps the whole of `file`, which must not be truncated while mapped.
+    pub fn new(file: &std::fs::File) -> Result<Self, Error> {
+        use std::os::unix::io::AsRawFd;
+        let len = file
+            .metadata()
+            .map_err(|e| Error::from_errno(e.raw_os_error().unwrap_or(libc::EIO)))?
+            .len();
+        let len = usize::try_from(len).map_err(|_| Error::enomem())?;
+        let ptr = if len == 0 {
+            ptr::null_mut() // mmap rejects empty mappings.
+        } else {
+            let p = unsafe {
+                libc::mmap(
+                    ptr::null_mut(),
+                    len,
+                    libc::PROT_READ,
+                    libc::MAP_SHARED,
+                    file.as_raw_fd(),
+                    0,
+                )
+            };
+            if p == libc::MAP_FAILED {
+                return Err(Error::from_errno(
+                    std::io::Error::last_os_error()
+                        .raw_os_error()
+                        .unwrap_or(libc::EIO),
+                ));
+            }
+            unsafe { libc::madvise(p, len, libc::MADV_SEQUENTIAL) };
+            p
         };
-        if new_pos > self.slice.len() {
-            return Err(Error::invalid_data());
+        let slice: &'static [u8] = if len == 0 {
+            &[]
+        } else {
+            unsafe { std::slice::from_raw_parts(ptr as *const u8, len) }
+        };
+        Ok(MmapIoContext {
+            slice: SliceIoContext::new(slice),
+            ptr,
+            prefetch: 0,
+            advised: 0,
+        })
+    }
+
+    /// Sets the AVIO buffer length; see `SliceIoContext::with_buf_len`.
+    pub fn buf_len(mut self, buf_len: usize) -> Self {
+        self.slice.buf_len = buf_len;
+        self
+    }
+
+    /// Asks the kernel to read ahead `bytes` beyond each read, for long-running readers that
+    /// would otherwise stall on page faults.
+    pub fn prefetch(mut self, bytes: usize) -> Self {
+        self.prefetch = bytes;
+        self
+    }
+
+    /// Returns the mapped file contents.
+    pub fn data(&self) -> &[u8] {
+        self.slice.slice
+    }
+
+    fn advise(&mut self) {
+        let len = self.slice.slice.len();
+        let pos = self.slice.pos;
+        if self.prefetch == 0 || self.advised >= len || pos + self.prefetch / 2 < self.advised {
+            return;
         }
-        self.pos = new_pos;
-        Ok(u64::try_from(self.pos).unwrap())
+
+        // madvise requires a page-aligned start.
+        let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        let start = std::cmp::max(pos, self.advised) & !(page - 1);
+        let end = std::cmp::min(len, pos + self.prefetch);
+        if end > start {
+            unsafe {
+                libc::madvise(
+                    (self.ptr as *mut u8).add(start) as *mut libc::c_void,
+                    end - start,
+                    libc::MADV_WILLNEED,
+                )
+            };
+        }
+        self.advised = end;
     }
 }
 
+impl IoContext for MmapIoContext {
+    fn readable(&self) -> bool {
+        true
+    }
+    fn seekable(&self) -> bool {
+        true
+    }
+    fn direct(&self) -> bool {
+        true
+    }
+    fn buf_len(&self) -> usize {
+        self.slice.buf_len()
+    }
+    fn read(&mut self, buf: &mut [u8]) -> Result<usize, Error> {
+        self.advise();
+        self.slice.read(buf)
+    }
+    fn seek(&mut self, offset: i64, whence: Whence, force: bool) -> Result<u64, Error> {
+        let r = self.slice.seek(offset, whence, force)?;
+        if self.slice.pos < self.advised {
+            self.advised = self.slice.pos; // re-advise after a backward seek.
+        }
+        Ok(r)
+    }
+}
+
+unsafe impl Send for MmapIoContext {}
+
+impl Drop for MmapIoContext {
+    fn drop(&mut self) {
+        if !self.ptr.is_null() {
+            unsafe { libc::munmap(self.ptr, self.slice.slice.len()) };
+        }
+    }
+}
+
+/// An `IoContext` implementation which presents a chain of segments (such as a fragmented
+/// mp4 init segment followed by media fragments) as one seekable stream, without copying them
+/// into a single buffer.
+///
+/// `S` may be borrowed (`&[u8]`) or shared (`Arc<[u8]>`, `Vec<u8>`).
+pub struct ChainIoContext<S: AsRef<[u8]>> {
+    segments: Vec<S>,
+
+    /// `starts[i]` is the stream offset of `segments[i]`; the final entry is the total length.
+    starts: Vec<usize>,
+
+    pos: usize,
+
+    /// The index of the segment containing `pos` (or `segments.len()` at the end).
+    seg: usize,
+
+    buf_len: usize,
+}
+
+impl<S: AsRef<[u8]>> ChainIoContext<S> {
+    pub fn new(segments: Vec<S>) -> Self {
+        let mut starts = Vec::with_capacity(segments.len() + 1);
+        let mut off = 0;
+        starts.push(0);
+        for s in &segments {
+            off += s.as_ref().len();
+            starts.push(off);
+        }
+        let mut c = ChainIoContext {
+            segments,
+            starts,
+            pos: 0,
+            seg: 0,
+            buf_len: DEFAULT_BUF_LEN,
+        };
+        c.seg = c.find_segment(0);
+        c
+    }
+
+    /// Sets the AVIO buffer length; see `SliceIoContext::with_buf_len`.
+    pub fn buf_len(mut self, buf_len: usize) -> Self {
+        self.buf_len = buf_len;
+        self
+    }
+
+    /// Returns the total length of all segments.
+    pub fn len(&self) -> usize {
+        *self.starts.last().unwrap()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn into_segments(self) -> Vec<S> {
+        self.segments
+    }
+
+    /// Returns the index of the non-empty segment containing `pos`, or `segments.len()` if
+    /// `pos` is at the end.
+    fn find_segment(&self, pos: usize) -> usize {
+        // The last segment starting at or before pos. Empty segments share a start with their
+        // successor, so this skips past them.
+        match self
+            .starts
+            .binary_search_by(|s| s.cmp(&pos).then(std::cmp::Ordering::Less))
+        {
+            Ok(_) => unreachable!(),
+            Err(i) => std::cmp::min(i - 1, self.segments.len()),
+        }
+    }
+}
+
+impl<S: AsRef<[u8]>> IoContext for ChainIoContext<S> {
+    fn readable(&self) -> bool {
+        true
+    }
+    fn seekable(&self) -> bool {
+        true
+    }
+    fn direct(&self) -> bool {
+        true
+    }
+    fn buf_len(&self) -> usize {
+        std::cmp::max(1, std::cmp::min(self.len(), self.buf_len))
+    }
+    fn read(&mut self, buf: &mut [u8]) -> Result<usize, Error> {
+        let mut n = 0;
+        while n < buf.len() && self.seg < self.segments.len() {
+            let seg = self.segments[self.seg].as_ref();
+            let off = self.pos - self.starts[self.seg];
+            let copy_len = std::cmp::min(buf.len() - n, seg.len() - off);
+            buf[n..n + copy_len].copy_from_slice(&seg[off..off + copy_len]);
+            n += copy_len;
+            self.pos += copy_len;
+            if self.pos == self.starts[self.seg + 1] {
+                self.seg = self.find_segment(self.pos);
+            }
+        }
+        Ok(n)
+    }
+    fn seek(&mut self, offset: i64, whence: Whence, _force: bool) -> Result<u64, Error> {
+        let is_size = matches!(whence, Whence::Size);
+        let new_pos = seek_pos(self.pos, self.len(), offset, whence)?;
+        if is_size {
+            return Ok(new_pos);
+        }
+        self.pos = usize::try_from(new_pos).unwrap();
+        self.seg = self.find_segment(self.pos);
+        Ok(new_pos)
+    }
+}
+
+/// A writable, seekable `IoContext` implementation which accumulates output in a `Vec`.
+#[derive(Default)]
+pub struct VecIoContext {
+    buf: Vec<u8>,
+
+    /// The absolute offset of `buf[0]`: the number of bytes already returned by `take`.
+    base: u64,
+
+    /// The position within `buf`.
+    pos: usize,
+}
+
+impl VecIoContext {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn get_ref(&self) -> &[u8] {
+        &self.buf
+    }
+
+    /// Takes the output so far, leaving this empty. Useful for sending each fragment as it's
+    /// completed; see `OutputFormatContext::with_owned_io_context`. Positions reported to the
+    /// muxer stay absolute; seeking back into taken data fails with `Error::invalid_data` (it's
+    /// not needed with `frag_keyframe`).
+    pub fn take(&mut self) -> Vec<u8> {
+        self.base += self.buf.len() as u64;
+        self.pos = 0;
+        std::mem::replace(&mut self.buf, Vec::new())
+    }
+
+    pub fn into_inner(self) -> Vec<u8> {
+        self.buf
+    }
+}
+
+impl IoContext for VecIoContext {
+    fn writable(&self) -> bool {
+        true
+    }
+    fn seekable(&self) -> bool {
+        true
+    }
+    fn buf_len(&self) -> usize {
+        DEFAULT_BUF_LEN
+    }
+    fn write(&mut self, buf: &[u8]) -> Result<usize, Error> {
+        let overlap = std::cmp::min(buf.len(), self.buf.len() - self.pos);
+        self.buf[self.pos..self.pos + overlap].copy_from_slice(&buf[..overlap]);
+        self.buf.extend_from_slice(&buf[overlap..]);
+        self.pos += buf.len();
+        Ok(buf.len())
+    }
+    fn seek(&mut self, offset: i64, whence: Whence, _force: bool) -> Result<u64, Error> {
+        let is_size = matches!(whence, Whence::Size);
+        let base = usize::try_from(self.base).map_err(|_| Error::invalid_data())?;
+        let new_pos = seek_pos(base + self.pos, base + self.buf.len(), offset, whence)?;
+        if is_size {
+            return Ok(new_pos);
+        }
+        if new_pos < self.base {
+            return Err(Error::invalid_data()); // already taken.
+        }
+        self.pos = usize::try_from(new_pos - self.base).unwrap();
+        Ok(new_pos)
+    }
+}
+
+/// The opaque passed to the `avio_alloc_context` callbacks.
+struct IoOpaque<'a> {
+    ctx: &'a mut dyn IoContext,
+    stats: Option<Arc<InputStats>>,
+}
+
 struct IoContextWrapper<'a> {
     // The opaque pointer passed to the callbacks must be thin, so create a box here so we have a
     // stable address to the fat pointer itself.
-    _ctx: Box<&'a mut dyn IoContext>,
+    _ctx: Box<IoOpaque<'a>>,
 
     avio_ctx: ptr::NonNull<AVIOContext>,
+
+    /// Set iff the wrapper owns the `IoContext`, which `_ctx` then references. This is a raw
+    /// pointer (from `Box::into_raw`, freed in `drop`) rather than a `Box`, because moving a
+    /// `Box` would assert unique access while `_ctx` still refers into it. The context must be
+    /// `Send` as the `InputFormatContext` holding it is.
+    owned: Option<ptr::NonNull<dyn IoContext + Send + 'a>>,
 }
 
 /// Implements the `read_packet` argument to `avio_alloc_context`.
@@ -251,10 +888,15 @@ unsafe extern "C" fn ioctx_read_packet(
     buf_data: *mut u8,
     buf_len: libc::c_int,
 ) -> libc::c_int {
-    let ctx: &mut &mut dyn IoContext = &mut *(opaque as *mut &mut dyn IoContext);
+    let o = &mut *(opaque as *mut IoOpaque);
     let buf = std::slice::from_raw_parts_mut(buf_data, usize::try_from(buf_len).unwrap());
-    match ctx.read(buf) {
-        Ok(l) => libc::c_int::try_from(l).unwrap(),
+    match o.ctx.read(buf) {
+        Ok(l) => {
+            if let Some(ref s) = o.stats {
+                s.add_io_read(l);
+            }
+            libc::c_int::try_from(l).unwrap()
+        }
         Err(e) => e.get(),
     }
 }
@@ -265,9 +907,9 @@ unsafe extern "C" fn ioctx_write_packet(
     buf_data: *const u8,
     buf_len: libc::c_int,
 ) -> libc::c_int {
-    let ctx: &mut &mut dyn IoContext = &mut *(opaque as *mut &mut dyn IoContext);
+    let ctx = &mut *(opaque as *mut IoOpaque);
     let buf = std::slice::from_raw_parts(buf_data, usize::try_from(buf_len).unwrap());
-    match ctx.write(buf) {
+    match ctx.ctx.write(buf) {
         Ok(l) => libc::c_int::try_from(l).unwrap(),
         Err(e) => e.get(),
     }
@@ -279,7 +921,7 @@ unsafe extern "C" fn ioctx_seek(
     offset: i64,
     whence: libc::c_int,
 ) -> i64 {
-    let ctx: &mut &mut dyn IoContext = &mut *(opaque as *mut &mut dyn IoContext);
+    let ctx = &mut *(opaque as *mut IoOpaque);
     let avseek_force = moonfire_ffmpeg_avseek_force;
     let force = (whence & avseek_force) != 0;
     let w = whence & !avseek_force;
@@ -294,35 +936,35 @@ unsafe extern "C" fn ioctx_seek(
     } else {
         panic!("invalid whence {}", whence);
     };
-    match ctx.seek(offset, whence, force) {
+    match ctx.ctx.seek(offset, whence, force) {
         Ok(p) => i64::try_from(p).unwrap(),
         Err(e) => i64::from(e.get()),
     }
 }
 
 impl<'a> IoContextWrapper<'a> {
-    fn new(ctx: &'a mut dyn IoContext) -> Result<Self, Error> {
-        let ctx = Box::new(ctx);
-        let buf_len = ctx.buf_len();
+    fn new(ctx: &'a mut dyn IoContext, stats: Option<Arc<InputStats>>) -> Result<Self, Error> {
+        let ctx = Box::new(IoOpaque { ctx, stats });
+        let buf_len = ctx.ctx.buf_len();
         let mut buf = crate::avutil::Alloc::new(buf_len)?;
         let avio_ctx = ptr::NonNull::new(unsafe {
-            let opaque: &&mut dyn IoContext = &ctx;
+            let opaque: &IoOpaque = &ctx;
             avio_alloc_context(
                 buf.as_ptr() as *const u8,
                 i32::try_from(buf_len).unwrap(),
-                if ctx.writable() { 1 } else { 0 },
-                opaque as *const &mut dyn IoContext as *mut core::ffi::c_void,
-                if ctx.readable() {
+                if ctx.ctx.writable() { 1 } else { 0 },
+                opaque as *const IoOpaque as *mut core::ffi::c_void,
+                if ctx.ctx.readable() {
                     Some(ioctx_read_packet)
                 } else {
                     None
                 },
-                if ctx.writable() {
+                if ctx.ctx.writable() {
                     Some(ioctx_write_packet)
                 } else {
                     None
                 },
-                if ctx.seekable() {
+                if ctx.ctx.seekable() {
                     Some(ioctx_seek)
                 } else {
                     None
@@ -331,44 +973,56 @@ impl<'a> IoContextWrapper<'a> {
         })
         .ok_or_else(Error::enomem)?;
         std::mem::forget(buf); // owned by avio_ctx iff alloc is successful.
-        if ctx.direct() {
+        if ctx.ctx.direct() {
             unsafe { moonfire_ffmpeg_ioctx_set_direct(avio_ctx.as_ptr()) };
         }
         Ok(Self {
             avio_ctx,
             _ctx: ctx,
+            owned: None,
         })
     }
 
-    fn release(self) -> *mut AVIOContext {
-        let p = self.avio_ctx.as_ptr();
-        std::mem::forget(self);
-        p
+    fn new_owned(owned: Box<dyn IoContext + Send + 'a>) -> Result<Self, Error> {
+        let owned = unsafe { ptr::NonNull::new_unchecked(Box::into_raw(owned)) };
+
+        // This reference remains valid until `drop` frees `owned`, after the avio_ctx.
+        let r: &'a mut (dyn IoContext + Send + 'a) = unsafe { &mut *owned.as_ptr() };
+        match Self::new(r, None) {
+            Ok(mut w) => {
+                w.owned = Some(owned);
+                Ok(w)
+            }
+            Err(e) => {
+                drop(unsafe { Box::from_raw(owned.as_ptr()) });
+                Err(e)
+            }
+        }
     }
 }
 
 impl<'a> Drop for IoContextWrapper<'a> {
     fn drop(&mut self) {
         let mut p = self.avio_ctx.as_ptr();
-        unsafe { avio_context_free(&mut p) };
+        unsafe { moonfire_ffmpeg_ioctx_free(&mut p) };
+        if let Some(o) = self.owned.take() {
+            drop(unsafe { Box::from_raw(o.as_ptr()) });
+        }
     }
 }
 
 impl<'a> InputFormatContext<'a> {
     pub fn open(source: &CStr, dict: &mut Dictionary) -> Result<Self, Error> {
-        let mut ctx = ptr::null_mut();
-        Error::wrap(unsafe { avformat_open_input(&mut ctx, source.as_ptr(), ptr::null(), dict) })?;
-        let pkt = unsafe { moonfire_ffmpeg_packet_alloc() };
-        if pkt.is_null() {
-            unsafe { avformat_close_input(&mut ctx) };
-            return Err(Error::enomem());
-        }
-        unsafe { av_init_packet(pkt) };
-        Ok(InputFormatContext {
-            ctx,
-            _io_ctx: PhantomData,
-            pkt: RefCell::new(pkt),
-        })
+        Self::open_internal(source, None, &OpenOptions::default(), dict)
+    }
+
+    /// Opens with options such as a timeout or cancellation token.
+    pub fn open_with(
+        source: &CStr,
+        opts: &OpenOptions,
+        dict: &mut Dictionary,
+    ) -> Result<Self, Error> {
+        Self::open_internal(source, None, opts, dict)
     }
 
     pub fn with_io_context(
@@ -376,24 +1030,74 @@ impl<'a> InputFormatContext<'a> {
         io_ctx: &'a mut dyn IoContext,
         dict: &mut Dictionary,
     ) -> Result<Self, Error> {
-        let wrapper = IoContextWrapper::new(io_ctx)?;
+        let wrapper = IoContextWrapper::new(io_ctx, None)?;
+        Self::open_internal(source, Some(wrapper), &OpenOptions::default(), dict)
+    }
+
+    pub fn with_io_context_and_options(
+        source: &CStr,
+        io_ctx: &'a mut dyn IoContext,
+        opts: &OpenOptions,
+        dict: &mut Dictionary,
+    ) -> Result<Self, Error> {
+        let wrapper = IoContextWrapper::new(io_ctx, opts.stats.clone())?;
+        Self::open_internal(source, Some(wrapper), opts, dict)
+    }
+
+    fn open_internal(
+        source: &CStr,
+        wrapper: Option<IoContextWrapper<'a>>,
+        opts: &OpenOptions,
+        dict: &mut Dictionary,
+    ) -> Result<Self, Error> {
+        let fmt = match opts.probe.format {
+            None => ptr::null(),
+            Some(ref f) => {
+                let fmt = unsafe { av_find_input_format(f.as_ptr()) };
+                if fmt.is_null() {
+                    return Err(Error::demuxer_not_found());
+                }
+                fmt
+            }
+        };
+        let interrupt = Box::new(Interrupt {
+            cancel: opts.cancel.clone(),
+            deadline: Cell::new(None),
+            timed_out: Cell::new(false),
+        });
         let mut ctx = unsafe { avformat_alloc_context() };
         if ctx.is_null() {
             return Err(Error::enomem());
         }
-        // Note that `ctx` is freed by `avformat_open_input` on failure, including the avio_ctx.
-        unsafe { moonfire_ffmpeg_fctx_set_pb(ctx, wrapper.release()) };
-        Error::wrap(unsafe { avformat_open_input(&mut ctx, source.as_ptr(), ptr::null(), dict) })?;
-        let pkt = unsafe { moonfire_ffmpeg_packet_alloc() };
+        unsafe {
+            moonfire_ffmpeg_fctx_set_interrupt_callback(
+                ctx,
+                interrupt_callback,
+                &*interrupt as *const Interrupt as *mut libc::c_void,
+            );
+            moonfire_ffmpeg_fctx_set_probe(ctx, &opts.probe.raw());
+        };
+        if let Some(ref w) = wrapper {
+            // Note that `ctx` is freed by `avformat_open_input` on failure, but the custom pb is
+            // not; it's freed when `wrapper` is dropped.
+            unsafe { moonfire_ffmpeg_fctx_set_pb(ctx, w.avio_ctx.as_ptr()) };
+        }
+        let deadline = opts.timeout.map(|t| Instant::now() + t);
+        interrupt.with_deadline(deadline, || {
+            Error::wrap(unsafe { avformat_open_input(&mut ctx, source.as_ptr(), fmt, dict) })
+        })?;
+        let pkt = unsafe { av_packet_alloc() };
         if pkt.is_null() {
             unsafe { avformat_close_input(&mut ctx) };
             return Err(Error::enomem());
         }
-        unsafe { av_init_packet(pkt) };
         Ok(InputFormatContext {
-            _io_ctx: PhantomData,
+            _io_ctx: wrapper,
             ctx,
             pkt: RefCell::new(pkt),
+            interrupt,
+            stats: opts.stats.clone(),
+            deferred_error: None,
         })
     }
 
@@ -406,8 +1110,86 @@ impl<'a> InputFormatContext<'a> {
     // RefCell.
     pub fn read_frame(&self) -> Result<Packet<'_>, Error> {
         let pkt = self.pkt.borrow();
-        Error::wrap(unsafe { av_read_frame(self.ctx, *pkt) })?;
-        Ok(Packet(pkt))
+        let mut info = PacketInfo::empty();
+        let s = self.stats.as_deref();
+        crate::stats::time(s.map(|s| &s.read_frame), || {
+            Error::wrap(unsafe { moonfire_ffmpeg_fctx_read_frame(self.ctx, *pkt, &mut info) })
+        })?;
+        if let Some(s) = s {
+            s.add_packet(info.size());
+        }
+        Ok(Packet { pkt, info })
+    }
+
+    /// Returns the stats set via `OpenOptions::stats`, if any.
+    pub fn stats(&self) -> Option<&Arc<InputStats>> {
+        self.stats.as_ref()
+    }
+
+    /// Like `read_frame`, but fails with `Error::timed_out()` if no packet is available by
+    /// `deadline`. Depending on the demuxer, the context may be unusable after a timeout
+    /// (eg, an RTSP session in an unknown state); it's safest to drop it.
+    pub fn read_frame_until(&self, deadline: Instant) -> Result<Packet<'_>, Error> {
+        self.interrupt
+            .with_deadline(Some(deadline), || self.read_frame())
+    }
+
+    /// Reads up to `max` packets (limited by the batch's capacity) into `batch` in a single call
+    /// into the wrapper, replacing its previous contents. Returns the number read.
+    ///
+    /// If an error occurs after some packets have been read, those are returned; the error
+    /// (such as end of file or `EAGAIN`) will be returned by the following `read_frames` call,
+    /// unless `seek` is called first.
+    pub fn read_frames(&mut self, batch: &mut PacketBatch, max: usize) -> Result<usize, Error> {
+        batch.clear();
+        if let Some(e) = self.deferred_error.take() {
+            return Err(e);
+        }
+        let max = std::cmp::min(max, batch.capacity());
+        let (pkts, infos) = batch.raw_parts();
+        let mut n = 0;
+        let s = self.stats.as_deref();
+        let ret = crate::stats::time(s.map(|s| &s.read_frame), || unsafe {
+            moonfire_ffmpeg_fctx_read_frames(self.ctx, pkts, infos, max, &mut n)
+        });
+        unsafe { batch.set_len(n) };
+        if let Some(s) = s {
+            for i in batch.infos() {
+                s.add_packet(i.size());
+            }
+        }
+        if let Err(e) = Error::wrap(ret) {
+            if n == 0 {
+                return Err(e);
+            }
+            self.deferred_error = Some(e);
+        }
+        Ok(n)
+    }
+
+    /// Seeks so that the next packet read from `stream` is the keyframe at or before `ts`.
+    ///
+    /// `ts` is in the stream's time base, or in `AV_TIME_BASE` (microseconds) units if `stream`
+    /// is `None`, in which case ffmpeg picks a default stream. This uses the demuxer's index
+    /// (for mp4, the `moov` atom), so it's cheap regardless of file size.
+    ///
+    /// Decoders of this input must be flushed (via `DecodeContext::flush`) afterward, or they'll
+    /// return frames buffered before the seek.
+    pub fn seek(&mut self, stream: Option<usize>, ts: i64, flags: SeekFlags) -> Result<(), Error> {
+        let stream_index = match stream {
+            None => -1,
+            Some(s) => {
+                if s >= self.streams().len() {
+                    return Err(Error::invalid_data());
+                }
+                s as libc::c_int
+            }
+        };
+        Error::wrap(unsafe {
+            avformat_seek_file(self.ctx, stream_index, i64::MIN, ts, ts, flags.0)
+        })?;
+        self.deferred_error = None;
+        Ok(())
     }
 
     pub fn streams(&self) -> Streams {
@@ -423,7 +1205,7 @@ unsafe impl<'a> Send for InputFormatContext<'a> {}
 impl<'a> Drop for InputFormatContext<'a> {
     fn drop(&mut self) {
         unsafe {
-            moonfire_ffmpeg_packet_free(*self.pkt.borrow());
+            av_packet_free(self.pkt.get_mut());
             avformat_close_input(&mut self.ctx);
         }
     }
@@ -464,6 +1246,340 @@ impl<'o> InputStream<'o> {
     pub fn duration(&self) -> i64 {
         unsafe { moonfire_ffmpeg_stream_duration(self.0) }
     }
+
+    /// Returns a copy of the demuxer's index of this stream, without reading any packets.
+    ///
+    /// For demuxers with a full sample table (such as mp4's `moov` atom), this has an entry
+    /// for every packet after `InputFormatContext::open`. Others may build it incrementally
+    /// as packets are read, or not at all.
+    pub fn index(&self) -> StreamIndex {
+        let n = unsafe { moonfire_ffmpeg_stream_index_len(self.0) };
+        let len = usize::try_from(n).unwrap_or(0);
+        let mut index = StreamIndex {
+            time_base: self.time_base(),
+            pos: vec![0; len],
+            timestamp: vec![0; len],
+            size: vec![0; len],
+            is_key: vec![false; len],
+        };
+        unsafe {
+            moonfire_ffmpeg_stream_index(
+                self.0,
+                n,
+                index.pos.as_mut_ptr(),
+                index.timestamp.as_mut_ptr(),
+                index.size.as_mut_ptr(),
+                index.is_key.as_mut_ptr(),
+            )
+        };
+        index
+    }
+}
+
+/// A copy of a stream's index, as returned by `InputStream::index`. Entry `i` is described by
+/// element `i` of each of the parallel `Vec`s.
+#[derive(Clone, Debug)]
+pub struct StreamIndex {
+    /// The time base of `timestamp`.
+    pub time_base: crate::avutil::Rational,
+
+    /// The byte offset of the packet within the file.
+    pub pos: Vec<i64>,
+
+    /// The packet's timestamp, in `time_base` units. Typically the dts.
+    pub timestamp: Vec<i64>,
+
+    /// The packet's size in bytes.
+    pub size: Vec<libc::c_int>,
+
+    pub is_key: Vec<bool>,
+}
+
+impl StreamIndex {
+    pub fn len(&self) -> usize {
+        self.pos.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Returns the index of the last keyframe with a timestamp at or before `ts`, if any.
+    pub fn keyframe_before(&self, ts: i64) -> Option<usize> {
+        let end = match self.timestamp.binary_search(&ts) {
+            Ok(i) => i + 1,
+            Err(i) => i,
+        };
+        self.is_key[..end].iter().rposition(|&k| k)
+    }
+
+    /// Returns entry `i`'s timestamp in microseconds.
+    pub fn micros(&self, i: usize) -> i64 {
+        let tb = self.time_base;
+        (i128::from(self.timestamp[i]) * 1_000_000 * i128::from(tb.num) / i128::from(tb.den)) as i64
+    }
+}
+
+/// A muxer, writing to a file/URL or to an `IoContext`.
+///
+/// Typical use is `new_stream` for each stream, `write_header`, `write_packet` for each packet,
+/// and `write_trailer`. Muxer options go in `write_header`'s dictionary; eg for fragmented mp4
+/// suitable for browsers' Media Source Extensions, set `movflags` to
+/// `frag_keyframe+empty_moov+default_base_moof`.
+pub struct OutputFormatContext<'a> {
+    /// When writing to an `IoContext`, `ctx`'s `pb` is owned by `_io_ctx`; otherwise it's opened
+    /// by `moonfire_ffmpeg_fctx_open_write`.
+    _io_ctx: Option<IoContextWrapper<'a>>,
+
+    /// The `IoContext` owned by `_io_ctx`, if any, for `io_ctx_mut`. It's freed along with
+    /// `_io_ctx`.
+    owned_io_ctx: Option<ptr::NonNull<dyn Any + Send>>,
+    ctx: ptr::NonNull<AVFormatContext>,
+
+    /// Scratch packet for `write_packet`; the muxer takes each reference it's given.
+    pkt: ptr::NonNull<AVPacket>,
+}
+
+impl<'a> OutputFormatContext<'a> {
+    fn alloc(format: Option<&CStr>, url: &CStr) -> Result<Self, Error> {
+        let mut ctx = ptr::null_mut();
+        Error::wrap(unsafe {
+            avformat_alloc_output_context2(
+                &mut ctx,
+                ptr::null(),
+                format.map(CStr::as_ptr).unwrap_or(ptr::null()),
+                url.as_ptr(),
+            )
+        })?;
+        let ctx = ptr::NonNull::new(ctx).ok_or_else(Error::enomem)?;
+        let pkt = match ptr::NonNull::new(unsafe { av_packet_alloc() }) {
+            Some(p) => p,
+            None => {
+                unsafe { avformat_free_context(ctx.as_ptr()) };
+                return Err(Error::enomem());
+            }
+        };
+        Ok(OutputFormatContext {
+            _io_ctx: None,
+            owned_io_ctx: None,
+            ctx,
+            pkt,
+        })
+    }
+
+    /// Opens `url` for writing, choosing the format by `format` (eg `mp4`) if supplied or by
+    /// the url's extension otherwise.
+    pub fn open(format: Option<&CStr>, url: &CStr) -> Result<Self, Error> {
+        let c = Self::alloc(format, url)?;
+        Error::wrap(unsafe { moonfire_ffmpeg_fctx_open_write(c.ctx.as_ptr(), url.as_ptr()) })?;
+        Ok(c)
+    }
+
+    /// Writes the given format (eg `mp4`) to `io_ctx`, which must be writable.
+    pub fn with_io_context(format: &CStr, io_ctx: &'a mut dyn IoContext) -> Result<Self, Error> {
+        if !io_ctx.writable() {
+            return Err(Error::enosys());
+        }
+        Self::with_wrapper(format, IoContextWrapper::new(io_ctx, None)?)
+    }
+
+    /// Writes the given format to `io_ctx`, which must be writable, taking ownership of it.
+    /// Unlike with `with_io_context`, the `IoContext` is reachable mid-mux via `io_ctx_mut`, eg
+    /// to send each fragment as it's completed with `flush` and `VecIoContext::take`.
+    pub fn with_owned_io_context<C: IoContext + Send + 'static>(
+        format: &CStr,
+        io_ctx: C,
+    ) -> Result<Self, Error> {
+        if !io_ctx.writable() {
+            return Err(Error::enosys());
+        }
+        let wrapper = IoContextWrapper::new_owned(Box::new(io_ctx))?;
+        let owned = wrapper.owned.expect("new_owned sets owned").as_ptr() as *mut C;
+        let mut c = Self::with_wrapper(format, wrapper)?;
+        c.owned_io_ctx = ptr::NonNull::new(owned as *mut (dyn Any + Send));
+        Ok(c)
+    }
+
+    fn with_wrapper(format: &CStr, wrapper: IoContextWrapper<'a>) -> Result<Self, Error> {
+        let mut c = Self::alloc(Some(format), CStr::from_bytes_with_nul(b"\0").unwrap())?;
+        unsafe { moonfire_ffmpeg_fctx_set_pb(c.ctx.as_ptr(), wrapper.avio_ctx.as_ptr()) };
+        c._io_ctx = Some(wrapper);
+        Ok(c)
+    }
+
+    /// Returns the `IoContext` passed to `with_owned_io_context`, if it's a `C`.
+    pub fn io_ctx_mut<C: IoContext + 'static>(&mut self) -> Option<&mut C> {
+        let p = self.owned_io_ctx?;
+
+        // The muxer only uses the `IoContext` within calls that borrow `self` mutably.
+        unsafe { &mut *p.as_ptr() }.downcast_mut()
+    }
+
+    /// Writes out any bytes buffered in the `AVIOContext`, so that the `IoContext` (or file)
+    /// has all output the muxer has produced so far.
+    pub fn flush(&mut self) {
+        unsafe { moonfire_ffmpeg_fctx_flush(self.ctx.as_ptr()) };
+    }
+
+    /// Adds a stream with a copy of the given parameters, returning its index.
+    /// `time_base` is a hint; the muxer may choose another in `write_header`.
+    pub fn new_stream(
+        &mut self,
+        par: &AVCodecParameters,
+        time_base: crate::avutil::Rational,
+    ) -> Result<usize, Error> {
+        let i = Error::wrap(unsafe {
+            moonfire_ffmpeg_fctx_new_stream(self.ctx.as_ptr(), par, time_base)
+        })?;
+        Ok(i as usize)
+    }
+
+    pub fn streams(&self) -> Streams {
+        Streams(unsafe {
+            let s = moonfire_ffmpeg_fctx_streams(self.ctx.as_ptr());
+            std::slice::from_raw_parts(s.streams, s.len as usize)
+        })
+    }
+
+    /// Writes the header, consuming recognized options from `dict`.
+    pub fn write_header(&mut self, dict: &mut Dictionary) -> Result<(), Error> {
+        Error::wrap(unsafe { avformat_write_header(self.ctx.as_ptr(), dict) })?;
+        Ok(())
+    }
+
+    /// Writes a packet to the given stream, first rescaling its timestamps from `time_base`
+    /// (typically the input stream's) to the output stream's. The packet itself is unmodified;
+    /// the muxer gets a new reference to its data.
+    pub fn write_packet<P: AsPacket>(
+        &mut self,
+        stream: usize,
+        pkt: &P,
+        time_base: crate::avutil::Rational,
+    ) -> Result<(), Error> {
+        assert!(stream < self.streams().len());
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_fctx_write_packet(
+                self.ctx.as_ptr(),
+                self.pkt.as_ptr(),
+                pkt.av_packet(),
+                stream as libc::c_int,
+                time_base,
+            )
+        })?;
+        Ok(())
+    }
+
+    /// Flushes buffered packets and writes the trailer (for mp4, the `moov` if not fragmented).
+    pub fn write_trailer(&mut self) -> Result<(), Error> {
+        Error::wrap(unsafe { av_write_trailer(self.ctx.as_ptr()) })?;
+        Ok(())
+    }
+}
+
+unsafe impl<'a> Send for OutputFormatContext<'a> {}
+
+impl<'a> Drop for OutputFormatContext<'a> {
+    fn drop(&mut self) {
+        unsafe {
+            let mut p = self.pkt.as_ptr();
+            av_packet_free(&mut p);
+            if self._io_ctx.is_none() {
+                moonfire_ffmpeg_fctx_close_write(self.ctx.as_ptr());
+            }
+            avformat_free_context(self.ctx.as_ptr());
+        }
+    }
+}
+
+/// A stream of an `InitSegment`.
+pub struct InitStream {
+    pub codecpar: CodecParameters,
+    pub time_base: crate::avutil::Rational,
+}
+
+/// A parsed fragmented mp4 initialization segment, which can be shared (eg in an `Arc`) to
+/// quickly open many media fragments.
+///
+/// libavformat's mp4 demuxer needs the init segment's `moov` to demux each fragment, so it's
+/// still parsed per fragment, but probing and `find_stream_info` are skipped. Decoders should
+/// be created from `streams()` rather than the fragment context's streams.
+pub struct InitSegment {
+    data: Arc<[u8]>,
+    streams: Vec<InitStream>,
+}
+
+/// A segment of the chain passed to `ChainIoContext` by `InitSegment::open_fragment`.
+enum InitOrFragment<F> {
+    Init(Arc<[u8]>),
+    Fragment(F),
+}
+
+impl<F: AsRef<[u8]>> AsRef<[u8]> for InitOrFragment<F> {
+    fn as_ref(&self) -> &[u8] {
+        match self {
+            InitOrFragment::Init(i) => i,
+            InitOrFragment::Fragment(f) => f.as_ref(),
+        }
+    }
+}
+
+impl InitSegment {
+    pub fn new(data: Arc<[u8]>) -> Result<Self, Error> {
+        let mut io_ctx = SliceIoContext::new(&data);
+        let ctx = InputFormatContext::with_io_context_and_options(
+            cstr_mp4(),
+            &mut io_ctx,
+            &OpenOptions::new().format(cstr_mp4()),
+            &mut Dictionary::new(),
+        )?;
+        let streams = ctx.streams();
+        let mut init_streams = Vec::with_capacity(streams.len());
+        for i in 0..streams.len() {
+            let s = streams.get(i);
+            init_streams.push(InitStream {
+                codecpar: CodecParameters::copy_from(&s.codecpar())?,
+                time_base: s.time_base(),
+            });
+        }
+        drop(ctx);
+        Ok(InitSegment {
+            data,
+            streams: init_streams,
+        })
+    }
+
+    pub fn data(&self) -> &[u8] {
+        &self.data
+    }
+
+    pub fn streams(&self) -> &[InitStream] {
+        &self.streams
+    }
+
+    /// Opens a media fragment (one or more `moof`/`mdat` pairs) which follows this init
+    /// segment, without probing or copying either. `fragment` must be `Send` because the
+    /// returned context is.
+    pub fn open_fragment<'f, F: AsRef<[u8]> + Send + 'f>(
+        &self,
+        fragment: F,
+        dict: &mut Dictionary,
+    ) -> Result<InputFormatContext<'f>, Error> {
+        let io_ctx = ChainIoContext::new(vec![
+            InitOrFragment::Init(self.data.clone()),
+            InitOrFragment::Fragment(fragment),
+        ]);
+        let wrapper = IoContextWrapper::new_owned(Box::new(io_ctx))?;
+        InputFormatContext::open_internal(
+            cstr_mp4(),
+            Some(wrapper),
+            &OpenOptions::new().format(cstr_mp4()),
+            dict,
+        )
+    }
+}
+
+fn cstr_mp4() -> &'static CStr {
+    CStr::from_bytes_with_nul(b"mp4\0").unwrap()
 }
 
 #[cfg(test)]
@@ -507,4 +1623,395 @@ mod test {
         with_packets(&mut ctx, |pkt| pts.push(pkt.pts().unwrap()));
         assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
     }
+
+    #[test]
+    fn slice_seek() {
+        use super::{IoContext, Whence};
+        let mut io_ctx = super::SliceIoContext::new(b"0123456789");
+        assert_eq!(io_ctx.seek(0, Whence::Size, false).unwrap(), 10);
+        assert_eq!(io_ctx.seek(4, Whence::Set, false).unwrap(), 4);
+        assert_eq!(io_ctx.seek(-2, Whence::End, false).unwrap(), 8);
+        assert_eq!(io_ctx.seek(-3, Whence::Cur, false).unwrap(), 5);
+        let mut buf = [0u8; 2];
+        assert_eq!(io_ctx.read(&mut buf).unwrap(), 2);
+        assert_eq!(&buf, b"56");
+        assert!(io_ctx.seek(1, Whence::End, false).is_err());
+        assert!(io_ctx.seek(-8, Whence::Cur, false).is_err());
+        assert_eq!(io_ctx.seek(0, Whence::Cur, false).unwrap(), 7);
+    }
+
+    #[test]
+    fn mmap() {
+        crate::Ffmpeg::new();
+        let f = std::fs::File::open("src/testdata/clip.mp4").unwrap();
+        let mut io_ctx = super::MmapIoContext::new(&f)
+            .unwrap()
+            .buf_len(1 << 16)
+            .prefetch(1 << 20);
+        assert_eq!(io_ctx.data(), &include_bytes!("testdata/clip.mp4")[..]);
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::with_io_context(cstr!(""), &mut io_ctx, &mut dict).unwrap();
+        let mut pts = Vec::new();
+        with_packets(&mut ctx, |pkt| pts.push(pkt.pts().unwrap()));
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+    }
+
+    #[test]
+    fn stats() {
+        crate::Ffmpeg::new();
+        let data = &include_bytes!("testdata/clip.mp4")[..];
+        let mut io_ctx = super::SliceIoContext::new(data);
+        let stats = std::sync::Arc::new(crate::stats::InputStats::new());
+        let opts = super::OpenOptions::new().stats(&stats);
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx = super::InputFormatContext::with_io_context_and_options(
+            cstr!(""),
+            &mut io_ctx,
+            &opts,
+            &mut dict,
+        )
+        .unwrap();
+        let mut bytes = 0;
+        with_packets(&mut ctx, |pkt| bytes += pkt.data().unwrap().len() as u64);
+        let s = stats.snapshot();
+        assert_eq!(s.packets, 6);
+        assert_eq!(s.packet_bytes, bytes);
+        assert!(s.io_reads > 0);
+        assert!(s.io_bytes >= s.packet_bytes);
+        assert_eq!(s.read_frame.count(), 7); // including the final EOF.
+    }
+
+    #[test]
+    fn chain() {
+        use super::{IoContext, Whence};
+        let mut c =
+            super::ChainIoContext::new(vec![&b"012"[..], &b""[..], &b"3456"[..], &b"789"[..]]);
+        assert_eq!(c.len(), 10);
+        let mut buf = [0u8; 6];
+        assert_eq!(c.read(&mut buf).unwrap(), 6);
+        assert_eq!(&buf, b"012345");
+        assert_eq!(c.seek(-2, Whence::End, false).unwrap(), 8);
+        assert_eq!(c.read(&mut buf).unwrap(), 2);
+        assert_eq!(&buf[..2], b"89");
+        assert_eq!(c.read(&mut buf).unwrap(), 0);
+        assert_eq!(c.seek(3, Whence::Set, false).unwrap(), 3);
+        assert_eq!(c.read(&mut buf[..1]).unwrap(), 1);
+        assert_eq!(&buf[..1], b"3");
+    }
+
+    /// A fragmented mp4's init segment and fragment should demux as if concatenated.
+    #[test]
+    fn chain_fragments() {
+        crate::Ffmpeg::new();
+        let init = include_bytes!("testdata/init.m4s");
+        let fragment = include_bytes!("testdata/fragment.m4s");
+        let concat: Vec<u8> = init.iter().chain(fragment.iter()).copied().collect();
+
+        let mut pts_concat = Vec::new();
+        let mut io_ctx = super::SliceIoContext::new(&concat);
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::with_io_context(cstr!(""), &mut io_ctx, &mut dict).unwrap();
+        with_packets(&mut ctx, |pkt| pts_concat.push(pkt.pts().unwrap()));
+        drop(ctx);
+        assert!(!pts_concat.is_empty());
+
+        let segments: Vec<std::sync::Arc<[u8]>> = vec![init[..].into(), fragment[..].into()];
+        let mut pts_chain = Vec::new();
+        let mut io_ctx = super::ChainIoContext::new(segments);
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::with_io_context(cstr!(""), &mut io_ctx, &mut dict).unwrap();
+        with_packets(&mut ctx, |pkt| pts_chain.push(pkt.pts().unwrap()));
+        assert_eq!(pts_chain, pts_concat);
+    }
+
+    #[test]
+    fn read_frames() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let mut batch = crate::avcodec::PacketBatch::new(4).unwrap();
+        let mut pts = Vec::new();
+        let mut sizes = Vec::new();
+        loop {
+            match ctx.read_frames(&mut batch, 8) {
+                Err(e) if e.is_eof() => break,
+                Err(e) => panic!("{}", e),
+                Ok(n) => sizes.push(n),
+            }
+            for info in batch.infos() {
+                assert!(!info.data().unwrap().is_empty());
+                pts.push(info.pts().unwrap());
+            }
+        }
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+
+        // End of file during the second batch is returned by the third call.
+        assert_eq!(sizes, &[4, 2]);
+    }
+
+    /// Detached packets should outlive later reads and be usable from another thread.
+    #[test]
+    fn detach() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let mut pkts = Vec::new();
+        with_packets(&mut ctx, |pkt| pkts.push(pkt.detach().unwrap()));
+        drop(ctx);
+        let pts = std::thread::spawn(move || {
+            pkts.iter()
+                .map(|p| {
+                    assert!(!p.data().unwrap().is_empty());
+                    p.pts().unwrap()
+                })
+                .collect::<Vec<_>>()
+        })
+        .join()
+        .unwrap();
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+    }
+
+    #[test]
+    fn seek() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        ctx.find_stream_info().unwrap();
+        let dec = ctx
+            .streams()
+            .get(0)
+            .codecpar()
+            .new_decoder(&mut crate::avutil::Dictionary::new())
+            .unwrap();
+        let mut frame = crate::avutil::VideoFrame::empty().unwrap();
+
+        // Decode the first packet, leaving frames buffered in the decoder.
+        dec.send_packet(&ctx.read_frame().unwrap()).unwrap();
+
+        // Seeking between keyframes goes back to the earlier one.
+        for &(ts, want) in &[(119700, 90000), (90000, 90000), (59400, 0), (149400, 90000)] {
+            ctx.seek(Some(0), ts, super::SeekFlags::empty()).unwrap();
+            dec.flush();
+            let pkt = ctx.read_frame().unwrap();
+            assert!(pkt.is_key());
+            assert_eq!(pkt.pts(), Some(want));
+            let mut frames = dec.decode(&pkt, &mut frame).unwrap();
+            while let Some(f) = frames.next().unwrap() {
+                assert_eq!(f.pts(), want);
+            }
+        }
+
+        assert!(ctx.seek(Some(1), 0, super::SeekFlags::empty()).is_err());
+    }
+
+    #[test]
+    fn index() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let ctx =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let index = ctx.streams().get(0).index();
+        assert_eq!(index.timestamp, &[0, 29700, 59400, 90000, 119700, 149400]);
+        assert_eq!(index.is_key, &[true, false, false, true, false, false]);
+        assert!(index.size.iter().all(|&s| s > 0));
+        assert!(index.pos.windows(2).all(|p| p[0] < p[1]));
+        assert_eq!(index.keyframe_before(119700), Some(3));
+        assert_eq!(index.keyframe_before(89999), Some(0));
+        assert_eq!(index.keyframe_before(-1), None);
+        assert_eq!(index.micros(3), 1_000_000);
+    }
+
+    #[test]
+    fn interrupt() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let cancel = super::CancelToken::new();
+        let opts = super::OpenOptions::new()
+            .cancel(&cancel)
+            .timeout(std::time::Duration::from_secs(10));
+        let ctx =
+            super::InputFormatContext::open_with(cstr!("src/testdata/clip.mp4"), &opts, &mut dict)
+                .unwrap();
+        let past = std::time::Instant::now() - std::time::Duration::from_secs(1);
+        let future = std::time::Instant::now() + std::time::Duration::from_secs(3600);
+        assert_eq!(ctx.read_frame_until(future).unwrap().pts(), Some(0));
+
+        // The deadline applies only to that call.
+        assert_eq!(ctx.read_frame().unwrap().pts(), Some(29700));
+
+        // With a past deadline, the first interrupt poll must fail, and the resulting exit is
+        // reported as a timeout. (`read_frame_until` may not poll at all when the packet is
+        // already buffered, so exercise the poll directly.)
+        let e = ctx
+            .interrupt
+            .with_deadline(Some(past), || {
+                let opaque = &*ctx.interrupt as *const super::Interrupt as *mut libc::c_void;
+                assert_eq!(unsafe { super::interrupt_callback(opaque) }, 1);
+                Err::<(), _>(crate::avutil::Error::exit())
+            })
+            .unwrap_err();
+        assert!(e.is_timed_out(), "{}", e);
+        assert!(ctx.interrupt.deadline.get().is_none());
+
+        cancel.cancel();
+        let mut dict = crate::avutil::Dictionary::new();
+        let e =
+            super::InputFormatContext::open_with(cstr!("src/testdata/clip.mp4"), &opts, &mut dict)
+                .err()
+                .unwrap();
+        assert!(e.is_exit(), "{}", e);
+    }
+
+    #[test]
+    fn init_segment() {
+        crate::Ffmpeg::new();
+        let init = super::InitSegment::new(include_bytes!("testdata/init.m4s")[..].into()).unwrap();
+        assert_eq!(init.streams().len(), 1);
+        let s = &init.streams()[0];
+        assert!(s.codecpar.codec_type().is_video());
+        assert!(!s.codecpar.extradata().is_empty());
+        let dec = s
+            .codecpar
+            .as_input()
+            .new_decoder(&mut crate::avutil::Dictionary::new())
+            .unwrap();
+
+        // Open the same fragment several times, as a playback server would.
+        let mut frame = crate::avutil::VideoFrame::empty().unwrap();
+        let mut pts = Vec::new();
+        for _ in 0..3 {
+            let fragment = include_bytes!("testdata/fragment.m4s");
+            let mut dict = crate::avutil::Dictionary::new();
+            let mut ctx = init.open_fragment(&fragment[..], &mut dict).unwrap();
+            let mut n = 0;
+            with_packets(&mut ctx, |pkt| {
+                let mut frames = dec.decode(&pkt, &mut frame).unwrap();
+                while frames.next().unwrap().is_some() {}
+                pts.push(pkt.pts().unwrap());
+                n += 1;
+            });
+            assert!(n > 0);
+            dec.flush();
+        }
+        let n = pts.len() / 3;
+        assert_eq!(pts[..n], pts[n..2 * n]);
+    }
+
+    /// Remuxing into fragmented mp4 in memory should preserve the packets.
+    #[test]
+    fn remux() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut input =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let in_tb = input.streams().get(0).time_base();
+        let mut io_ctx = super::VecIoContext::new();
+        {
+            let mut output =
+                super::OutputFormatContext::with_io_context(cstr!("mp4"), &mut io_ctx).unwrap();
+            let par = input.streams().get(0).codecpar();
+            assert_eq!(output.new_stream(&par, in_tb).unwrap(), 0);
+            let mut dict = crate::avutil::Dictionary::new();
+            dict.set(cstr!("movflags"), cstr!("frag_keyframe+empty_moov"))
+                .unwrap();
+            output.write_header(&mut dict).unwrap();
+            with_packets(&mut input, |pkt| {
+                output.write_packet(0, &pkt, in_tb).unwrap()
+            });
+            output.write_trailer().unwrap();
+        }
+        let out = io_ctx.into_inner();
+        assert_eq!(&out[4..8], b"ftyp");
+        assert!(out.windows(4).any(|w| w == b"moof"));
+
+        let mut io_ctx = super::SliceIoContext::new(&out);
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut ctx =
+            super::InputFormatContext::with_io_context(cstr!(""), &mut io_ctx, &mut dict).unwrap();
+        let out_tb = ctx.streams().get(0).time_base();
+        let mut pts = Vec::new();
+        with_packets(&mut ctx, |pkt| {
+            let p = pkt.pts().unwrap();
+            pts.push(
+                p * i64::from(out_tb.num) * i64::from(in_tb.den)
+                    / (i64::from(out_tb.den) * i64::from(in_tb.num)),
+            );
+        });
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+    }
+
+    /// Each fragment should be available mid-mux via an owned `VecIoContext`, and each should
+    /// be demuxable on its own after the init segment.
+    #[test]
+    fn remux_fragments() {
+        crate::Ffmpeg::new();
+        let mut dict = crate::avutil::Dictionary::new();
+        let mut input =
+            super::InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap();
+        let in_tb = input.streams().get(0).time_base();
+        let mut output = super::OutputFormatContext::with_owned_io_context(
+            cstr!("mp4"),
+            super::VecIoContext::new(),
+        )
+        .unwrap();
+        let par = input.streams().get(0).codecpar();
+        output.new_stream(&par, in_tb).unwrap();
+        let mut dict = crate::avutil::Dictionary::new();
+        dict.set(cstr!("movflags"), cstr!("frag_keyframe+empty_moov"))
+            .unwrap();
+        output.write_header(&mut dict).unwrap();
+        output.flush();
+        let mut segments = vec![output.io_ctx_mut::<super::VecIoContext>().unwrap().take()];
+        with_packets(&mut input, |pkt| {
+            output.write_packet(0, &pkt, in_tb).unwrap();
+            output.flush();
+            let s = output.io_ctx_mut::<super::VecIoContext>().unwrap().take();
+            if !s.is_empty() {
+                segments.push(s);
+            }
+        });
+
+        // The keyframe at entry 3 completes the first fragment before the trailer is written.
+        assert_eq!(segments.len(), 2);
+        output.write_trailer().unwrap();
+        segments.push(output.io_ctx_mut::<super::VecIoContext>().unwrap().take());
+        drop(output);
+
+        assert_eq!(&segments[0][4..8], b"ftyp");
+        assert!(!segments[0].windows(4).any(|w| w == b"moof"));
+        let init = super::InitSegment::new(segments[0].clone().into()).unwrap();
+        let mut n = Vec::new();
+        for s in &segments[1..] {
+            assert_eq!(&s[4..8], b"moof");
+            let mut dict = crate::avutil::Dictionary::new();
+            let mut ctx = init.open_fragment(&s[..], &mut dict).unwrap();
+            let mut packets = 0;
+            with_packets(&mut ctx, |_| packets += 1);
+            n.push(packets);
+        }
+        assert_eq!(n, &[3, 3]);
+    }
+
+    /// Positions should stay absolute after `VecIoContext::take`.
+    #[test]
+    fn vec_take() {
+        use super::{IoContext, Whence};
+        let mut v = super::VecIoContext::new();
+        v.write(b"0123").unwrap();
+        assert_eq!(v.take(), b"0123");
+        v.write(b"45").unwrap();
+        assert_eq!(v.seek(0, Whence::Size, false).unwrap(), 6);
+        assert_eq!(v.seek(0, Whence::Cur, false).unwrap(), 6);
+        assert_eq!(v.seek(5, Whence::Set, false).unwrap(), 5);
+        v.write(b"x").unwrap();
+        assert_eq!(v.get_ref(), b"4x");
+        assert!(v.seek(2, Whence::Set, false).is_err());
+        assert_eq!(v.seek(0, Whence::End, false).unwrap(), 6);
+    }
 }
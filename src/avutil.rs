@@ -1,9 +1,12 @@
 // Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
 // SPDX-License-Identifier: MIT OR Apache-2.0
 
+use parking_lot::Mutex;
+use std::collections::HashMap;
 use std::convert::TryFrom;
 use std::ffi::CStr;
 use std::ptr;
+use std::sync::Arc;
 
 //#[link(name = "avutil")]
 extern "C" {
@@ -36,6 +39,20 @@ extern "C" {
     fn av_dict_free(d: *mut *mut AVDictionary);
     fn av_frame_alloc() -> *mut AVFrame;
     fn av_frame_free(f: *mut *mut AVFrame);
+    fn av_frame_unref(f: *mut AVFrame);
+    fn av_get_bytes_per_sample(fmt: SampleFormat) -> libc::c_int;
+    fn av_get_sample_fmt_name(fmt: SampleFormat) -> *const libc::c_char;
+    fn av_sample_fmt_is_planar(fmt: SampleFormat) -> libc::c_int;
+    fn av_get_packed_sample_fmt(fmt: SampleFormat) -> SampleFormat;
+    fn av_get_planar_sample_fmt(fmt: SampleFormat) -> SampleFormat;
+    fn av_frame_ref(dst: *mut AVFrame, src: *const AVFrame) -> libc::c_int;
+    fn av_frame_make_writable(f: *mut AVFrame) -> libc::c_int;
+    fn av_frame_copy_props(dst: *mut AVFrame, src: *const AVFrame) -> libc::c_int;
+    fn av_hwframe_transfer_data(
+        dst: *mut AVFrame,
+        src: *const AVFrame,
+        flags: libc::c_int,
+    ) -> libc::c_int;
     fn av_get_pix_fmt_name(fmt: libc::c_int) -> *const libc::c_char;
     fn av_malloc(len: usize) -> *mut libc::c_void;
     fn av_free(ptr: *mut libc::c_void);
@@ -61,16 +78,24 @@ impl Drop for Alloc {
     }
 }
 
+/// `AV_NOPTS_VALUE`, as a Rust constant so comparisons against it compile to an immediate.
+/// `Ffmpeg::new` verifies it matches the value ffmpeg was compiled with.
+pub(crate) const AV_NOPTS_VALUE: i64 = i64::MIN;
+
 //#[link(name = "wrapper")]
 extern "C" {
     pub(crate) static moonfire_ffmpeg_compiled_libavutil_version: libc::c_int;
     static moonfire_ffmpeg_av_dict_ignore_suffix: libc::c_int;
     pub(crate) static moonfire_ffmpeg_av_nopts_value: i64;
 
+    static moonfire_ffmpeg_averror_eagain: libc::c_int;
     static moonfire_ffmpeg_averror_eof: libc::c_int;
     static moonfire_ffmpeg_averror_enomem: libc::c_int;
     static moonfire_ffmpeg_averror_enosys: libc::c_int;
+    static moonfire_ffmpeg_averror_etimedout: libc::c_int;
+    static moonfire_ffmpeg_averror_exit: libc::c_int;
     static moonfire_ffmpeg_averror_decoder_not_found: libc::c_int;
+    static moonfire_ffmpeg_averror_demuxer_not_found: libc::c_int;
     static moonfire_ffmpeg_averror_invalid_data: libc::c_int;
     static moonfire_ffmpeg_averror_unknown: libc::c_int;
 
@@ -80,12 +105,46 @@ extern "C" {
 
     static moonfire_ffmpeg_pix_fmt_rgb24: libc::c_int;
     static moonfire_ffmpeg_pix_fmt_bgr24: libc::c_int;
+    static moonfire_ffmpeg_pix_fmt_yuv420p: libc::c_int;
+    static moonfire_ffmpeg_pix_fmt_yuvj420p: libc::c_int;
+
+    static moonfire_ffmpeg_sample_fmt_s16: libc::c_int;
+    static moonfire_ffmpeg_sample_fmt_s16p: libc::c_int;
+    static moonfire_ffmpeg_sample_fmt_flt: libc::c_int;
+    static moonfire_ffmpeg_sample_fmt_fltp: libc::c_int;
+
+    fn moonfire_ffmpeg_frame_audio_stuff(frame: *const AVFrame, stuff: *mut AudioStuff);
+    fn moonfire_ffmpeg_frame_audio_alloc(
+        frame: *mut AVFrame,
+        format: SampleFormat,
+        channels: libc::c_int,
+        sample_rate: libc::c_int,
+        nb_samples: libc::c_int,
+    ) -> libc::c_int;
 
     fn moonfire_ffmpeg_frame_image_alloc(
         f: *mut AVFrame,
         dims: *const ImageDimensions,
     ) -> libc::c_int;
     pub(crate) fn moonfire_ffmpeg_frame_stuff(frame: *const AVFrame, stuff: *mut FrameStuff);
+    fn moonfire_ffmpeg_frame_set_pts(frame: *mut AVFrame, pts: i64);
+
+    fn moonfire_ffmpeg_pix_fmt_info(fmt: libc::c_int, info: *mut PixFmtInfo) -> libc::c_int;
+    fn moonfire_ffmpeg_plane_geometry(
+        fmt: libc::c_int,
+        width: libc::c_int,
+        height: libc::c_int,
+        plane: libc::c_int,
+        g: *mut PlaneGeometry,
+    ) -> libc::c_int;
+
+    fn moonfire_ffmpeg_frame_pool_new(
+        out: *mut *mut RawFramePool,
+        dims: *const ImageDimensions,
+        align: libc::c_int,
+    ) -> libc::c_int;
+    fn moonfire_ffmpeg_frame_pool_get(p: *mut RawFramePool, f: *mut AVFrame) -> libc::c_int;
+    fn moonfire_ffmpeg_frame_pool_free(p: *mut RawFramePool);
 }
 
 // No accessors here; seems reasonable to assume ABI stability of this simple struct.
@@ -120,6 +179,7 @@ pub(crate) struct FrameStuff {
     pub(crate) data: *const *mut u8,
     pub(crate) linesizes: *const libc::c_int,
     pts: i64,
+    hw: bool,
 }
 
 #[derive(Copy, Clone, Debug)]
@@ -155,11 +215,137 @@ pub struct VideoFrame {
     pub(crate) stuff: FrameStuff,
 }
 
+/// A borrowed view of one plane of an image.
+///
+/// `width` and `height` are in pixels of this plane (so halved for 4:2:0 chroma). Row `y` is
+/// `data[y * linesize..][..row_bytes]`; the bytes between rows are padding. `data` ends at the
+/// last row's `row_bytes`.
+#[derive(Copy, Clone)]
 pub struct Plane<'f> {
     pub data: &'f [u8],
     pub linesize: usize,
     pub width: usize,
     pub height: usize,
+    pub row_bytes: usize,
+}
+
+/// A writable view of one plane; see `Plane`.
+pub struct PlaneMut<'f> {
+    pub data: &'f mut [u8],
+    pub linesize: usize,
+    pub width: usize,
+    pub height: usize,
+    pub row_bytes: usize,
+}
+
+// matches moonfire_ffmpeg_plane_geometry
+#[repr(C)]
+struct PlaneGeometry {
+    width: libc::c_int,
+    height: libc::c_int,
+    row_bytes: libc::c_int,
+}
+
+/// Returns the length of a plane's data: all rows but the last with padding, then the last.
+fn plane_len(linesize: usize, height: usize, row_bytes: usize) -> usize {
+    match height {
+        0 => 0,
+        h => (h - 1) * linesize + row_bytes,
+    }
+}
+
+impl<'f> Plane<'f> {
+    /// Returns the rows, top to bottom, each `row_bytes` long.
+    pub fn rows(&self) -> impl Iterator<Item = &'f [u8]> + 'f {
+        let (data, linesize, row_bytes) = (self.data, self.linesize, self.row_bytes);
+        (0..self.height).map(move |y| &data[y * linesize..y * linesize + row_bytes])
+    }
+
+    /// Returns the bytes per pixel of this plane, eg 1 for a `yuv420p` plane or 3 for `rgb24`.
+    pub fn pixel_bytes(&self) -> usize {
+        if self.width == 0 {
+            0
+        } else {
+            self.row_bytes / self.width
+        }
+    }
+
+    /// Returns a view of the `width`x`height` rectangle with top-left corner at (`x`, `y`), in
+    /// this plane's pixels, without copying. Panics if it's out of bounds.
+    pub fn crop(&self, x: usize, y: usize, width: usize, height: usize) -> Plane<'f> {
+        assert!(
+            x + width <= self.width && y + height <= self.height,
+            "crop {}x{}+{}+{} exceeds {}x{} plane",
+            width,
+            height,
+            x,
+            y,
+            self.width,
+            self.height
+        );
+        let px = self.pixel_bytes();
+        let row_bytes = width * px;
+        let start = y * self.linesize + x * px;
+        Plane {
+            data: &self.data[start..start + plane_len(self.linesize, height, row_bytes)],
+            linesize: self.linesize,
+            width,
+            height,
+            row_bytes,
+        }
+    }
+
+    /// Downsamples an 8-bit plane (such as luma, for motion detection) by averaging each
+    /// `factor`x`factor` block, writing `(width / factor) * (height / factor)` bytes to `out`
+    /// (replacing its contents) and returning the output's width and height. Partial blocks
+    /// at the right and bottom edges are dropped.
+    ///
+    /// This works directly on the decoder's buffer, so it's much cheaper than a full `Scaler`
+    /// pass; the inner loops are simple enough for the compiler to vectorize.
+    pub fn downsample_box(&self, factor: usize, out: &mut Vec<u8>) -> (usize, usize) {
+        assert!(factor > 0 && factor <= 16);
+        assert_eq!(
+            self.pixel_bytes(),
+            1,
+            "downsample_box requires an 8-bit plane"
+        );
+        let (out_w, out_h) = (self.width / factor, self.height / factor);
+        out.clear();
+        out.reserve(out_w * out_h);
+        let mut sums = vec![0u16; out_w]; // 16 * 16 * 255 fits.
+        let mut rows = self.rows();
+        let div = (factor * factor) as u32;
+        for _ in 0..out_h {
+            for s in sums.iter_mut() {
+                *s = 0;
+            }
+            for row in rows.by_ref().take(factor) {
+                if factor == 2 {
+                    // Special-cased so the compiler can see the constant block width.
+                    for (s, px) in sums.iter_mut().zip(row.chunks_exact(2)) {
+                        *s += u16::from(px[0]) + u16::from(px[1]);
+                    }
+                } else {
+                    for (s, px) in sums.iter_mut().zip(row.chunks_exact(factor)) {
+                        *s += px.iter().map(|&p| u16::from(p)).sum::<u16>();
+                    }
+                }
+            }
+            out.extend(sums.iter().map(|&s| ((u32::from(s) + div / 2) / div) as u8));
+        }
+        (out_w, out_h)
+    }
+}
+
+impl<'f> PlaneMut<'f> {
+    /// Returns the rows, top to bottom, each `row_bytes` long.
+    pub fn rows_mut(&mut self) -> impl Iterator<Item = &mut [u8]> + '_ {
+        let (linesize, row_bytes, height) = (self.linesize, self.row_bytes, self.height);
+        self.data
+            .chunks_mut(linesize)
+            .take(height)
+            .map(move |r| &mut r[..row_bytes])
+    }
 }
 
 impl VideoFrame {
@@ -178,12 +364,13 @@ impl VideoFrame {
                 data: ptr::null(),
                 linesizes: ptr::null(),
                 pts: 0,
+                hw: false,
             },
         })
     }
 
-    /// Creates a new `VideoFrame` with an owned (not reference-counted) buffer of the specified
-    /// dimensions.
+    /// Creates a new `VideoFrame` with a freshly allocated, reference-counted buffer of the
+    /// specified dimensions. For repeated allocations, prefer `FramePool`.
     pub fn owned(dims: ImageDimensions) -> Result<Self, Error> {
         let mut frame = VideoFrame::empty()?;
         Error::wrap(unsafe { moonfire_ffmpeg_frame_image_alloc(frame.frame.as_mut(), &dims) })?;
@@ -191,22 +378,75 @@ impl VideoFrame {
         Ok(frame)
     }
 
+    /// Returns a view of plane `plane`, panicking if it doesn't exist; see `try_plane`.
     pub fn plane(&self, plane: usize) -> Plane {
-        assert!(plane < 8);
-        let plane_off = isize::try_from(plane).unwrap();
-        let d = unsafe { *self.stuff.data.offset(plane_off) };
-        let l = unsafe { *self.stuff.linesizes.offset(plane_off) };
-        assert!(!d.is_null());
-        assert!(l > 0);
-        let l = l as usize;
-        let width = self.stuff.dims.width as usize;
-        let height = self.stuff.dims.height as usize;
-        Plane {
-            data: unsafe { std::slice::from_raw_parts(d, l * height) },
-            linesize: l,
+        match self.try_plane(plane) {
+            Ok(p) => p,
+            Err(e) => panic!("plane {} of {} frame: {}", plane, self.stuff.dims, e),
+        }
+    }
+
+    /// Returns a view of plane `plane`, with its geometry taken from the pixel format (eg,
+    /// chroma planes of `yuv420p` are half the width and height).
+    ///
+    /// Fails with `Error::invalid_data` if the plane doesn't exist, the frame is empty or in
+    /// hardware memory, or it has a negative (bottom-up) linesize.
+    pub fn try_plane(&self, plane: usize) -> Result<Plane, Error> {
+        if self.stuff.hw || self.stuff.data.is_null() || plane >= 4 {
+            return Err(Error::invalid_data());
+        }
+        let dims = self.stuff.dims;
+        let mut g = std::mem::MaybeUninit::uninit();
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_plane_geometry(
+                dims.pix_fmt.0,
+                dims.width,
+                dims.height,
+                plane as libc::c_int,
+                g.as_mut_ptr(),
+            )
+        })
+        .map_err(|_| Error::invalid_data())?;
+        let g = unsafe { g.assume_init() };
+        let d = unsafe { *self.stuff.data.add(plane) };
+        let l = unsafe { *self.stuff.linesizes.add(plane) };
+        if d.is_null() || l <= 0 || l < g.row_bytes {
+            return Err(Error::invalid_data());
+        }
+        let (linesize, height, row_bytes) = (l as usize, g.height as usize, g.row_bytes as usize);
+        Ok(Plane {
+            data: unsafe { std::slice::from_raw_parts(d, plane_len(linesize, height, row_bytes)) },
+            linesize,
+            width: g.width as usize,
+            height,
+            row_bytes,
+        })
+    }
+
+    /// Copies the frame's buffers if they're shared with another frame (eg a `SharedFrame`), so
+    /// that they can be written in place. Everything which writes into a frame's buffers must
+    /// call this first.
+    pub(crate) fn make_writable(&mut self) -> Result<(), Error> {
+        assert!(!self.stuff.hw, "hardware frames must be transferred first");
+        Error::wrap(unsafe { av_frame_make_writable(self.frame.as_ptr()) })?;
+        unsafe { moonfire_ffmpeg_frame_stuff(self.frame.as_ptr(), &mut self.stuff) };
+        Ok(())
+    }
+
+    /// Returns a writable view of a plane, first copying the buffer if it's shared with another
+    /// frame.
+    pub fn plane_mut(&mut self, plane: usize) -> Result<PlaneMut, Error> {
+        self.make_writable()?;
+        let p = self.try_plane(plane)?;
+        let (data, linesize, width, height, row_bytes) =
+            (p.data, p.linesize, p.width, p.height, p.row_bytes);
+        Ok(PlaneMut {
+            data: unsafe { std::slice::from_raw_parts_mut(data.as_ptr() as *mut u8, data.len()) },
+            linesize,
             width,
             height,
-        }
+            row_bytes,
+        })
     }
 
     pub fn dims(&self) -> ImageDimensions {
@@ -215,6 +455,44 @@ impl VideoFrame {
     pub fn pts(&self) -> i64 {
         self.stuff.pts
     }
+    pub fn set_pts(&mut self, pts: i64) {
+        unsafe { moonfire_ffmpeg_frame_set_pts(self.frame.as_ptr(), pts) };
+        self.stuff.pts = pts;
+    }
+
+    /// Returns a read-only handle to this frame's buffers which can be cloned and sent to other
+    /// threads, without copying the image. The buffers stay alive until the last handle is
+    /// dropped, even if this frame is refilled (eg by the next `decode_video`) in the meantime.
+    /// (If the frame's data isn't reference-counted, it's copied once.)
+    pub fn share(&self) -> Result<SharedFrame, Error> {
+        let mut f = VideoFrame::empty()?;
+        Error::wrap(unsafe { av_frame_ref(f.frame.as_ptr(), self.frame.as_ptr()) })?;
+        unsafe { moonfire_ffmpeg_frame_stuff(f.frame.as_ptr(), &mut f.stuff) };
+        Ok(SharedFrame(Arc::new(SharedInner(f))))
+    }
+
+    /// Returns true iff this frame's data is in GPU memory (from a hardware-accelerated
+    /// decoder). Its planes are then inaccessible until `transfer_to_system`.
+    pub fn is_hw(&self) -> bool {
+        self.stuff.hw
+    }
+
+    /// Downloads a hardware frame into `dst`, replacing its previous contents. The pixel format
+    /// is chosen by the hardware (often `nv12`).
+    pub fn transfer_to_system(&self, dst: &mut VideoFrame) -> Result<(), Error> {
+        assert!(self.stuff.hw);
+        unsafe {
+            av_frame_unref(dst.frame.as_ptr());
+            Error::wrap(av_hwframe_transfer_data(
+                dst.frame.as_ptr(),
+                self.frame.as_ptr(),
+                0,
+            ))?;
+            Error::wrap(av_frame_copy_props(dst.frame.as_ptr(), self.frame.as_ptr()))?;
+            moonfire_ffmpeg_frame_stuff(dst.frame.as_ptr(), &mut dst.stuff);
+        }
+        Ok(())
+    }
 }
 
 impl Drop for VideoFrame {
@@ -227,8 +505,483 @@ impl Drop for VideoFrame {
     }
 }
 
+/// An audio sample format, such as `fltp` (the native output of the AAC decoder).
 #[derive(Copy, Clone, PartialEq, Eq)]
 #[repr(transparent)]
+pub struct SampleFormat(pub(crate) libc::c_int);
+
+impl SampleFormat {
+    pub fn s16() -> Self {
+        SampleFormat(unsafe { moonfire_ffmpeg_sample_fmt_s16 })
+    }
+    pub fn s16p() -> Self {
+        SampleFormat(unsafe { moonfire_ffmpeg_sample_fmt_s16p })
+    }
+    pub fn flt() -> Self {
+        SampleFormat(unsafe { moonfire_ffmpeg_sample_fmt_flt })
+    }
+    pub fn fltp() -> Self {
+        SampleFormat(unsafe { moonfire_ffmpeg_sample_fmt_fltp })
+    }
+
+    /// Returns true iff each channel is stored in its own plane (vs. interleaved).
+    pub fn is_planar(self) -> bool {
+        unsafe { av_sample_fmt_is_planar(self) != 0 }
+    }
+
+    pub fn bytes_per_sample(self) -> usize {
+        unsafe { av_get_bytes_per_sample(self) as usize }
+    }
+
+    /// Returns the interleaved equivalent, eg `flt` for `fltp`.
+    pub fn packed(self) -> Self {
+        unsafe { av_get_packed_sample_fmt(self) }
+    }
+
+    /// Returns the planar equivalent, eg `fltp` for `flt`.
+    pub fn planar(self) -> Self {
+        unsafe { av_get_planar_sample_fmt(self) }
+    }
+}
+
+impl std::fmt::Debug for SampleFormat {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "SampleFormat({} /* {} */)", self.0, self)
+    }
+}
+
+impl std::fmt::Display for SampleFormat {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        let s = unsafe {
+            let n = av_get_sample_fmt_name(*self);
+            if n.is_null() {
+                return write!(f, "SampleFormat({})", self.0);
+            }
+            CStr::from_ptr(n)
+        };
+        f.write_str(&s.to_string_lossy())
+    }
+}
+
+/// A Rust type which holds one sample of an interleaved `SampleFormat`.
+pub trait Sample: Copy + Default + 'static {
+    /// The interleaved format, eg `flt` for `f32`.
+    fn format() -> SampleFormat;
+}
+
+impl Sample for i16 {
+    fn format() -> SampleFormat {
+        SampleFormat::s16()
+    }
+}
+
+impl Sample for f32 {
+    fn format() -> SampleFormat {
+        SampleFormat::flt()
+    }
+}
+
+// matches moonfire_ffmpeg_audio_stuff
+#[repr(C)]
+pub(crate) struct AudioStuff {
+    data: *const *mut u8,
+    nb_samples: libc::c_int,
+    sample_rate: libc::c_int,
+    channels: libc::c_int,
+    format: SampleFormat,
+    channel_layout: u64,
+    pts: i64,
+}
+
+/// A frame of decoded audio, filled by `DecodeContext::receive_audio_frame`.
+pub struct AudioFrame {
+    pub(crate) frame: ptr::NonNull<AVFrame>,
+    pub(crate) stuff: AudioStuff,
+}
+
+impl AudioFrame {
+    /// Creates an empty frame, to be filled by `DecodeContext::receive_audio_frame`. Reusing a
+    /// frame lets the decoder recycle its buffers.
+    pub fn empty() -> Result<Self, Error> {
+        let frame = ptr::NonNull::new(unsafe { av_frame_alloc() }).ok_or_else(Error::enomem)?;
+        Ok(AudioFrame {
+            frame,
+            stuff: AudioStuff {
+                data: ptr::null(),
+                nb_samples: 0,
+                sample_rate: 0,
+                channels: 0,
+                format: SampleFormat(-1),
+                channel_layout: 0,
+                pts: AV_NOPTS_VALUE,
+            },
+        })
+    }
+
+    /// Creates a frame with a freshly allocated buffer of `nb_samples` samples per channel.
+    pub fn owned(
+        format: SampleFormat,
+        channels: usize,
+        sample_rate: i32,
+        nb_samples: usize,
+    ) -> Result<Self, Error> {
+        let mut f = AudioFrame::empty()?;
+        Error::wrap(unsafe {
+            moonfire_ffmpeg_frame_audio_alloc(
+                f.frame.as_ptr(),
+                format,
+                libc::c_int::try_from(channels).map_err(|_| Error::invalid_data())?,
+                sample_rate,
+                libc::c_int::try_from(nb_samples).map_err(|_| Error::invalid_data())?,
+            )
+        })?;
+        f.refresh();
+        Ok(f)
+    }
+
+    pub(crate) fn refresh(&mut self) {
+        unsafe { moonfire_ffmpeg_frame_audio_stuff(self.frame.as_ptr(), &mut self.stuff) };
+    }
+
+    /// Returns the number of samples per channel.
+    pub fn nb_samples(&self) -> usize {
+        self.stuff.nb_samples as usize
+    }
+    pub fn sample_rate(&self) -> i32 {
+        self.stuff.sample_rate
+    }
+    pub fn channels(&self) -> usize {
+        self.stuff.channels as usize
+    }
+    pub fn format(&self) -> SampleFormat {
+        self.stuff.format
+    }
+    pub(crate) fn channel_layout(&self) -> u64 {
+        self.stuff.channel_layout
+    }
+    pub(crate) fn extended_data(&self) -> *const *mut u8 {
+        self.stuff.data
+    }
+    pub fn pts(&self) -> Option<i64> {
+        match self.stuff.pts {
+            AV_NOPTS_VALUE => None,
+            p => Some(p),
+        }
+    }
+
+    /// Returns the number of planes: one per channel if the format is planar, else one.
+    pub fn planes(&self) -> usize {
+        if self.stuff.data.is_null() {
+            0 // eg `AudioFrame::empty()` before decoding.
+        } else if self.stuff.format.is_planar() {
+            self.channels()
+        } else {
+            1
+        }
+    }
+
+    /// Returns the samples of plane `i` (see `planes`) as raw bytes.
+    pub fn plane(&self, i: usize) -> &[u8] {
+        assert!(i < self.planes(), "plane {} of {}", i, self.planes());
+        if self.stuff.nb_samples <= 0 {
+            return &[];
+        }
+        let len = self.nb_samples()
+            * self.stuff.format.bytes_per_sample()
+            * (if self.stuff.format.is_planar() {
+                1
+            } else {
+                self.channels()
+            });
+        unsafe { std::slice::from_raw_parts(*self.stuff.data.add(i), len) }
+    }
+
+    /// Returns the samples of plane `i` as `T`, which must match the format (ignoring
+    /// planarity), or `None`.
+    pub fn plane_as<T: Sample>(&self, i: usize) -> Option<&[T]> {
+        if self.stuff.format.packed() != T::format() {
+            return None;
+        }
+        let p = self.plane(i);
+        if p.is_empty() {
+            return Some(&[]);
+        }
+        assert_eq!(p.as_ptr() as usize % std::mem::align_of::<T>(), 0);
+        Some(unsafe {
+            std::slice::from_raw_parts(p.as_ptr() as *const T, p.len() / std::mem::size_of::<T>())
+        })
+    }
+
+    /// Appends this frame's samples to `ring`, interleaving planar formats. The sample format
+    /// must match `T` (eg `flt` or `fltp` for `f32`) and the channel count must match the ring;
+    /// otherwise this fails with `Error::invalid_data`, and `swresample::Resampler` can
+    /// convert.
+    pub fn copy_into<T: Sample>(&self, ring: &mut SampleRing<T>) -> Result<(), Error> {
+        if self.planes() == 0
+            || self.channels() != ring.channels()
+            || self.stuff.format.packed() != T::format()
+        {
+            return Err(Error::invalid_data());
+        }
+        if self.stuff.format.is_planar() {
+            let mut planes = [&[][..]; MAX_PLANAR_CHANNELS];
+            if self.channels() > MAX_PLANAR_CHANNELS {
+                return Err(Error::invalid_data());
+            }
+            for (i, p) in planes.iter_mut().take(self.channels()).enumerate() {
+                *p = self.plane_as(i).unwrap();
+            }
+            ring.push_planar(&planes[..self.channels()]);
+        } else {
+            ring.push_interleaved(self.plane_as(0).unwrap());
+        }
+        Ok(())
+    }
+}
+
+impl Drop for AudioFrame {
+    fn drop(&mut self) {
+        unsafe {
+            let mut f = self.frame.as_ptr();
+            av_frame_free(&mut f);
+        }
+    }
+}
+
+/// The most channels `AudioFrame::copy_into` interleaves from a planar frame.
+const MAX_PLANAR_CHANNELS: usize = 8;
+
+/// A fixed-capacity ring of interleaved audio samples, allocated once and reused.
+///
+/// When full, pushing overwrites the oldest samples (counted by `overwritten`), so a slow
+/// reader sees the most recent audio rather than blocking the decoder.
+pub struct SampleRing<T> {
+    buf: Box<[T]>,
+    channels: usize,
+
+    /// The index into `buf` of the oldest sample.
+    start: usize,
+
+    /// The number of samples (not frames) stored.
+    len: usize,
+
+    overwritten: u64,
+}
+
+impl<T: Sample> SampleRing<T> {
+    /// Creates a ring which holds `capacity` frames (samples per channel) of `channels`
+    /// channels.
+    pub fn new(capacity: usize, channels: usize) -> Self {
+        assert!(channels > 0);
+        SampleRing {
+            buf: vec![T::default(); capacity * channels].into_boxed_slice(),
+            channels,
+            start: 0,
+            len: 0,
+            overwritten: 0,
+        }
+    }
+
+    pub fn channels(&self) -> usize {
+        self.channels
+    }
+
+    /// Returns the capacity in frames.
+    pub fn capacity(&self) -> usize {
+        self.buf.len() / self.channels
+    }
+
+    /// Returns the number of frames stored.
+    pub fn len(&self) -> usize {
+        self.len / self.channels
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Returns the number of frames overwritten before being read.
+    pub fn overwritten(&self) -> u64 {
+        self.overwritten
+    }
+
+    pub fn clear(&mut self) {
+        self.start = 0;
+        self.len = 0;
+    }
+
+    /// Makes room for `n` more samples, dropping the oldest if necessary.
+    fn reserve(&mut self, n: usize) {
+        let excess = (self.len + n).saturating_sub(self.buf.len());
+        if excess > 0 {
+            self.start = (self.start + excess) % self.buf.len();
+            self.len -= excess;
+            self.overwritten += (excess / self.channels) as u64;
+        }
+    }
+
+    /// Appends interleaved samples; `samples.len()` must be a multiple of `channels`.
+    pub fn push_interleaved(&mut self, mut samples: &[T]) {
+        assert_eq!(samples.len() % self.channels, 0);
+        if self.buf.is_empty() {
+            return;
+        }
+        if samples.len() > self.buf.len() {
+            let skip = samples.len() - self.buf.len();
+            self.overwritten += (skip / self.channels) as u64;
+            samples = &samples[skip..];
+        }
+        self.reserve(samples.len());
+        let end = (self.start + self.len) % self.buf.len();
+        let first = std::cmp::min(samples.len(), self.buf.len() - end);
+        self.buf[end..end + first].copy_from_slice(&samples[..first]);
+        self.buf[..samples.len() - first].copy_from_slice(&samples[first..]);
+        self.len += samples.len();
+    }
+
+    /// Appends planar samples, one slice per channel, interleaving them.
+    pub fn push_planar(&mut self, planes: &[&[T]]) {
+        assert_eq!(planes.len(), self.channels);
+        if self.buf.is_empty() {
+            return;
+        }
+        let frames = planes[0].len();
+        assert!(planes.iter().all(|p| p.len() == frames));
+        let skip = frames.saturating_sub(self.capacity());
+        self.overwritten += skip as u64;
+        self.reserve((frames - skip) * self.channels);
+        let mut i = (self.start + self.len) % self.buf.len();
+        for f in skip..frames {
+            for p in planes {
+                self.buf[i] = p[f];
+                i += 1;
+            }
+            if i == self.buf.len() {
+                i = 0;
+            }
+        }
+        self.len += (frames - skip) * self.channels;
+    }
+
+    /// Returns the stored samples, oldest first, as two slices (the second possibly empty).
+    pub fn as_slices(&self) -> (&[T], &[T]) {
+        let first = std::cmp::min(self.len, self.buf.len() - self.start);
+        (
+            &self.buf[self.start..self.start + first],
+            &self.buf[..self.len - first],
+        )
+    }
+
+    /// Moves the oldest samples into `out`, whose length must be a multiple of `channels`.
+    /// Returns the number of frames read.
+    pub fn read(&mut self, out: &mut [T]) -> usize {
+        assert_eq!(out.len() % self.channels, 0);
+        let n = std::cmp::min(out.len(), self.len);
+        let (a, b) = self.as_slices();
+        let first = std::cmp::min(n, a.len());
+        out[..first].copy_from_slice(&a[..first]);
+        out[first..n].copy_from_slice(&b[..n - first]);
+        self.consume(n / self.channels);
+        n / self.channels
+    }
+
+    /// Discards the oldest `frames` frames, as after processing `as_slices` in place.
+    pub fn consume(&mut self, frames: usize) {
+        if self.buf.is_empty() {
+            return; // zero capacity; nothing is ever stored.
+        }
+        let n = std::cmp::min(frames * self.channels, self.len);
+        self.start = (self.start + n) % self.buf.len();
+        self.len -= n;
+    }
+}
+
+/// A read-only, reference-counted handle to a frame; see `VideoFrame::share`. Cloning is cheap.
+#[derive(Clone)]
+pub struct SharedFrame(Arc<SharedInner>);
+
+struct SharedInner(VideoFrame);
+
+// The frame is never mutated after `share`: `SharedFrame` only exposes `&VideoFrame`, and
+// in-place writers (`VideoFrame::plane_mut`, `Scaler::scale`) go through `make_writable`, which
+// copies buffers shared with another frame.
+unsafe impl Send for SharedInner {}
+unsafe impl Sync for SharedInner {}
+
+impl std::ops::Deref for SharedFrame {
+    type Target = VideoFrame;
+    fn deref(&self) -> &VideoFrame {
+        &(self.0).0
+    }
+}
+
+#[repr(C)]
+struct RawFramePool {
+    _private: [u8; 0],
+}
+
+/// A pool of reference-counted frame buffers, built on `AVBufferPool`, with a sub-pool per
+/// `ImageDimensions`. Buffers return to their pool when the last frame referencing them is
+/// dropped (or refilled), so a steady-state loop such as decode→scale allocates nothing.
+///
+/// Plane pointers and linesizes are aligned to the pool's alignment (eg 64 for AVX-512).
+pub struct FramePool {
+    align: libc::c_int,
+    pools: Mutex<HashMap<ImageDimensions, PoolPtr>>,
+}
+
+struct PoolPtr(ptr::NonNull<RawFramePool>);
+
+// AVBufferPool is thread-safe; the rest of the struct is immutable after creation.
+unsafe impl Send for PoolPtr {}
+
+impl Drop for PoolPtr {
+    fn drop(&mut self) {
+        unsafe { moonfire_ffmpeg_frame_pool_free(self.0.as_ptr()) }
+    }
+}
+
+impl FramePool {
+    /// Creates a pool with the given alignment, which must be a power of two.
+    pub fn new(align: usize) -> Self {
+        assert!(align.is_power_of_two());
+        FramePool {
+            align: libc::c_int::try_from(align).unwrap(),
+            pools: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// Returns a new frame with a pooled buffer of the given dimensions.
+    pub fn get(&self, dims: ImageDimensions) -> Result<VideoFrame, Error> {
+        let mut frame = VideoFrame::empty()?;
+        self.get_into(dims, &mut frame)?;
+        Ok(frame)
+    }
+
+    /// Replaces `frame`'s contents with a pooled buffer of the given dimensions, reusing the
+    /// `AVFrame` itself. Any buffer previously referenced by `frame` is released.
+    pub fn get_into(&self, dims: ImageDimensions, frame: &mut VideoFrame) -> Result<(), Error> {
+        let mut pools = self.pools.lock();
+        let pool = match pools.get(&dims) {
+            Some(p) => p.0.as_ptr(),
+            None => {
+                let mut p = ptr::null_mut();
+                Error::wrap(unsafe { moonfire_ffmpeg_frame_pool_new(&mut p, &dims, self.align) })?;
+                let p = PoolPtr(ptr::NonNull::new(p).unwrap());
+                let raw = p.0.as_ptr();
+                pools.insert(dims, p);
+                raw
+            }
+        };
+        Error::wrap(unsafe { moonfire_ffmpeg_frame_pool_get(pool, frame.frame.as_ptr()) })?;
+        drop(pools);
+        unsafe { moonfire_ffmpeg_frame_stuff(frame.frame.as_ptr(), &mut frame.stuff) };
+        Ok(())
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Hash)]
+#[repr(transparent)]
 pub struct PixelFormat(libc::c_int);
 
 impl PixelFormat {
@@ -238,6 +991,43 @@ impl PixelFormat {
     pub fn bgr24() -> Self {
         PixelFormat(unsafe { moonfire_ffmpeg_pix_fmt_bgr24 })
     }
+    pub fn yuv420p() -> Self {
+        PixelFormat(unsafe { moonfire_ffmpeg_pix_fmt_yuv420p })
+    }
+
+    /// Full-range ("JPEG") `yuv420p`, as preferred by the MJPEG encoder.
+    pub fn yuvj420p() -> Self {
+        PixelFormat(unsafe { moonfire_ffmpeg_pix_fmt_yuvj420p })
+    }
+}
+
+/// Layout information from a pixel format's `AVPixFmtDescriptor`.
+/// Must match `moonfire_ffmpeg_pix_fmt_info`.
+#[derive(Copy, Clone, Debug)]
+#[repr(C)]
+pub(crate) struct PixFmtInfo {
+    pub(crate) nb_planes: libc::c_int,
+    pub(crate) log2_chroma_w: libc::c_int,
+    pub(crate) log2_chroma_h: libc::c_int,
+}
+
+impl PixFmtInfo {
+    /// Returns the log2 of the vertical subsampling of plane `i`.
+    pub(crate) fn log2_h(&self, i: usize) -> libc::c_int {
+        if i == 1 || i == 2 {
+            self.log2_chroma_h
+        } else {
+            0
+        }
+    }
+}
+
+impl PixelFormat {
+    pub(crate) fn info(self) -> Result<PixFmtInfo, Error> {
+        let mut info = std::mem::MaybeUninit::uninit();
+        Error::wrap(unsafe { moonfire_ffmpeg_pix_fmt_info(self.0, info.as_mut_ptr()) })?;
+        Ok(unsafe { info.assume_init() })
+    }
 }
 
 impl std::fmt::Debug for PixelFormat {
@@ -263,6 +1053,9 @@ impl std::fmt::Display for PixelFormat {
 pub struct Error(libc::c_int);
 
 impl Error {
+    pub fn eagain() -> Self {
+        Error(unsafe { moonfire_ffmpeg_averror_eagain })
+    }
     pub fn eof() -> Self {
         Error(unsafe { moonfire_ffmpeg_averror_eof })
     }
@@ -275,13 +1068,31 @@ impl Error {
     pub fn unknown() -> Self {
         Error(unsafe { moonfire_ffmpeg_averror_unknown })
     }
+
+    /// An operation's deadline passed.
+    pub fn timed_out() -> Self {
+        Error(unsafe { moonfire_ffmpeg_averror_etimedout })
+    }
+
+    /// An operation was interrupted, as by a `CancelToken`.
+    pub fn exit() -> Self {
+        Error(unsafe { moonfire_ffmpeg_averror_exit })
+    }
     pub fn decoder_not_found() -> Self {
         Error(unsafe { moonfire_ffmpeg_averror_decoder_not_found })
     }
+    pub fn demuxer_not_found() -> Self {
+        Error(unsafe { moonfire_ffmpeg_averror_demuxer_not_found })
+    }
     pub fn invalid_data() -> Self {
         Error(unsafe { moonfire_ffmpeg_averror_invalid_data })
     }
 
+    /// Returns the error for an OS `errno` value, as with ffmpeg's `AVERROR(e)`.
+    pub(crate) fn from_errno(e: libc::c_int) -> Self {
+        Error(-e)
+    }
+
     /// Wraps the given return code as a Result: positive values are propagated through; negative
     /// values are turned into an `Error`.
     pub(crate) fn wrap(raw: libc::c_int) -> Result<libc::c_int, Error> {
@@ -299,6 +1110,18 @@ impl Error {
     pub fn is_eof(self) -> bool {
         self.0 == unsafe { moonfire_ffmpeg_averror_eof }
     }
+
+    pub fn is_eagain(self) -> bool {
+        self.0 == unsafe { moonfire_ffmpeg_averror_eagain }
+    }
+
+    pub fn is_timed_out(self) -> bool {
+        self.0 == unsafe { moonfire_ffmpeg_averror_etimedout }
+    }
+
+    pub fn is_exit(self) -> bool {
+        self.0 == unsafe { moonfire_ffmpeg_averror_exit }
+    }
 }
 
 impl std::error::Error for Error {}
@@ -382,7 +1205,7 @@ impl Drop for Dictionary {
 }
 
 // Must match moonfire_ffmpeg_image_dimensions.
-#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+#[derive(Copy, Clone, Debug, Eq, Hash, PartialEq)]
 #[repr(C)]
 pub struct ImageDimensions {
     pub width: libc::c_int,
@@ -424,9 +1247,170 @@ pub(crate) fn convert_level(level: libc::c_int) -> log::Level {
 
 #[cfg(test)]
 mod tests {
-    use super::Error;
+    use super::{
+        AudioFrame, Error, FramePool, ImageDimensions, PixelFormat, SampleFormat, SampleRing,
+    };
     use std::ffi::CString;
 
+    #[test]
+    fn sample_ring() {
+        let mut r = SampleRing::<i16>::new(3, 2);
+        assert!(r.is_empty());
+        r.push_interleaved(&[1, 2, 3, 4]);
+        r.push_planar(&[&[5, 7], &[6, 8]]);
+        assert_eq!(r.len(), 3);
+        assert_eq!(r.overwritten(), 1);
+        assert_eq!(r.as_slices(), (&[3, 4, 5, 6][..], &[7, 8][..]));
+        let mut out = [0; 4];
+        assert_eq!(r.read(&mut out), 2);
+        assert_eq!(out, [3, 4, 5, 6]);
+        assert_eq!(r.len(), 1);
+
+        // Pushing more than the capacity keeps only the newest frames.
+        r.push_interleaved(&[9, 10, 11, 12, 13, 14, 15, 16]);
+        assert_eq!(r.overwritten(), 3);
+        let mut out = [0; 8];
+        assert_eq!(r.read(&mut out), 3);
+        assert_eq!(&out[..6], &[11, 12, 13, 14, 15, 16]);
+        assert!(r.is_empty());
+
+        // A zero-capacity ring discards everything without dividing by zero.
+        let mut r = SampleRing::<i16>::new(0, 2);
+        r.push_interleaved(&[1, 2]);
+        r.push_planar(&[&[3], &[4]]);
+        assert!(r.is_empty());
+        assert_eq!(r.read(&mut out), 0);
+        r.consume(1);
+        assert_eq!(r.as_slices(), (&[][..], &[][..]));
+    }
+
+    #[test]
+    fn audio_copy_into() {
+        crate::Ffmpeg::new();
+        let f = AudioFrame::owned(SampleFormat::fltp(), 2, 8_000, 4).unwrap();
+        assert_eq!(f.planes(), 2);
+        assert_eq!(f.format().to_string(), "fltp");
+        assert_eq!(f.format().packed(), SampleFormat::flt());
+        for c in 0..2 {
+            let p = unsafe { std::slice::from_raw_parts_mut(*f.stuff.data.add(c) as *mut f32, 4) };
+            for (i, s) in p.iter_mut().enumerate() {
+                *s = (10 * c + i) as f32;
+            }
+        }
+        let mut r = SampleRing::<f32>::new(8, 2);
+        f.copy_into(&mut r).unwrap();
+        assert_eq!(r.as_slices().0, &[0., 10., 1., 11., 2., 12., 3., 13.]);
+
+        // An empty frame has no planes and nothing to copy.
+        let e = AudioFrame::empty().unwrap();
+        assert_eq!(e.planes(), 0);
+        assert!(e.copy_into(&mut r).is_err());
+
+        // Mismatched types and channel counts are rejected.
+        assert!(f.copy_into(&mut SampleRing::<i16>::new(8, 2)).is_err());
+        assert!(f.copy_into(&mut SampleRing::<f32>::new(8, 1)).is_err());
+    }
+
+    #[test]
+    fn planes() {
+        crate::Ffmpeg::new();
+        let dims = ImageDimensions {
+            width: 33,
+            height: 17,
+            pix_fmt: PixelFormat::yuv420p(),
+        };
+        let mut f = super::VideoFrame::owned(dims).unwrap();
+        {
+            let mut y = f.plane_mut(0).unwrap();
+            assert_eq!((y.width, y.height, y.row_bytes), (33, 17, 33));
+            for (i, row) in y.rows_mut().enumerate() {
+                for (j, px) in row.iter_mut().enumerate() {
+                    *px = (i * 2 + j % 2) as u8;
+                }
+            }
+        }
+        let u = f.plane(1);
+        assert_eq!((u.width, u.height, u.row_bytes), (17, 9, 17));
+        assert_eq!(u.data.len(), 8 * u.linesize + 17);
+        assert!(f.try_plane(3).is_err());
+
+        let y = f.plane(0);
+        assert_eq!(y.rows().count(), 17);
+        let c = y.crop(3, 2, 4, 5);
+        assert_eq!((c.width, c.height, c.row_bytes), (4, 5, 4));
+        let rows: Vec<&[u8]> = c.rows().collect();
+        assert_eq!(rows[0], &[5, 4, 5, 4]);
+        assert_eq!(rows[4], &[13, 12, 13, 12]);
+
+        // Output row k's 2x2 blocks hold 4k..=4k+3, which average to 4k + 1.5, rounded up.
+        let mut out = Vec::new();
+        assert_eq!(y.downsample_box(2, &mut out), (16, 8));
+        assert_eq!(out.len(), 16 * 8);
+        assert!(out[..16].iter().all(|&p| p == 2));
+        assert!(out[16 * 7..].iter().all(|&p| p == 30));
+        assert_eq!(y.downsample_box(4, &mut out), (8, 4));
+        assert!(out[..8].iter().all(|&p| p == 4)); // 2 * (0 + 1 + ... + 7) / 16 = 3.5
+    }
+
+    #[test]
+    fn share() {
+        crate::Ffmpeg::new();
+        let dims = ImageDimensions {
+            width: 16,
+            height: 16,
+            pix_fmt: PixelFormat::rgb24(),
+        };
+        let mut f = super::VideoFrame::owned(dims).unwrap();
+        for b in f.plane_mut(0).unwrap().data.iter_mut() {
+            *b = 1;
+        }
+        let shared = f.share().unwrap();
+        assert_eq!(shared.plane(0).data.as_ptr(), f.plane(0).data.as_ptr());
+
+        // Writing to the original must copy rather than change what consumers see.
+        for b in f.plane_mut(0).unwrap().data.iter_mut() {
+            *b = 2;
+        }
+        let consumers: Vec<_> = (0..2)
+            .map(|_| {
+                let s = shared.clone();
+                std::thread::spawn(move || {
+                    assert_eq!(s.dims(), dims);
+                    s.plane(0).data.iter().all(|&b| b == 1)
+                })
+            })
+            .collect();
+        drop(shared);
+        drop(f);
+        for c in consumers {
+            assert!(c.join().unwrap());
+        }
+    }
+
+    #[test]
+    fn frame_pool() {
+        crate::Ffmpeg::new();
+        let pool = FramePool::new(64);
+        let dims = ImageDimensions {
+            width: 1001,
+            height: 333,
+            pix_fmt: PixelFormat::rgb24(),
+        };
+        let f = pool.get(dims).unwrap();
+        assert_eq!(f.dims(), dims);
+        let p = f.plane(0);
+        assert_eq!(p.data.as_ptr() as usize % 64, 0);
+        assert_eq!(p.linesize % 64, 0);
+        assert!(p.linesize >= 3 * 1001);
+        let first = p.data.as_ptr();
+        drop(f);
+
+        // The buffer should be recycled, including into an existing frame.
+        let mut f = super::VideoFrame::empty().unwrap();
+        pool.get_into(dims, &mut f).unwrap();
+        assert_eq!(f.plane(0).data.as_ptr(), first);
+    }
+
     #[test]
     fn test_error() {
         let eof_formatted = format!("{}", Error::eof());
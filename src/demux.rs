@@ -0,0 +1,286 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! A demuxing pipeline stage: a thread which owns an `InputFormatContext` and routes its
+//! packets into bounded per-stream queues, so that (eg) a slow video decoder doesn't stall
+//! audio or metadata streams.
+
+use crate::avcodec::OwnedPacket;
+use crate::avformat::InputFormatContext;
+use crate::avutil::Error;
+use crate::spsc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+
+/// What the demuxer does with a packet for a full queue.
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub enum Overflow {
+    /// Waits for the consumer. This stalls all streams, but loses nothing.
+    Block,
+
+    /// Drops the packet. Suits streams whose packets are independent, such as metadata.
+    Drop,
+
+    /// Drops the packet and all following ones until the next keyframe which fits, so that the
+    /// decoder resumes cleanly. Suits video.
+    DropUntilKey,
+}
+
+/// Options for one stream's queue.
+#[derive(Copy, Clone, Debug)]
+pub struct QueueOptions {
+    /// The maximum number of packets queued.
+    pub capacity: usize,
+    pub overflow: Overflow,
+}
+
+impl Default for QueueOptions {
+    fn default() -> Self {
+        QueueOptions {
+            capacity: 64,
+            overflow: Overflow::Block,
+        }
+    }
+}
+
+struct Queue {
+    tx: spsc::Producer<OwnedPacket>,
+    overflow: Overflow,
+    dropped: Arc<AtomicU64>,
+
+    /// For `Overflow::DropUntilKey`, if waiting for a keyframe.
+    skipping: bool,
+}
+
+/// A running demuxer thread; see `Demuxer::spawn`.
+///
+/// Dropping it stops the thread (after its current `read_frame`) and waits for it.
+pub struct Demuxer {
+    handle: Option<std::thread::JoinHandle<Result<(), Error>>>,
+    stop: Arc<AtomicBool>,
+    monitors: Vec<Option<spsc::Monitor<OwnedPacket>>>,
+}
+
+/// Receives the packets of one stream from a `Demuxer`.
+pub struct StreamReceiver {
+    rx: spsc::Consumer<OwnedPacket>,
+    dropped: Arc<AtomicU64>,
+}
+
+impl Demuxer {
+    /// Starts a thread reading packets from `ctx`. Stream `i`'s packets go to a queue if
+    /// `queues[i]` is `Some` and are discarded otherwise. Returns the demuxer and a receiver for
+    /// each queue, with the same indices.
+    ///
+    /// The thread exits on end of file or error (see `join`), or when stopped. A read blocked on
+    /// the network can be interrupted via `OpenOptions::cancel` or `timeout`.
+    pub fn spawn(
+        ctx: InputFormatContext<'static>,
+        queues: Vec<Option<QueueOptions>>,
+    ) -> Result<(Self, Vec<Option<StreamReceiver>>), Error> {
+        let mut senders = Vec::with_capacity(queues.len());
+        let mut receivers = Vec::with_capacity(queues.len());
+        let mut monitors = Vec::with_capacity(queues.len());
+        for q in queues {
+            match q {
+                None => {
+                    senders.push(None);
+                    receivers.push(None);
+                    monitors.push(None);
+                }
+                Some(o) => {
+                    let (tx, rx) = spsc::channel(o.capacity);
+                    let dropped = Arc::new(AtomicU64::new(0));
+                    monitors.push(Some(tx.monitor()));
+                    senders.push(Some(Queue {
+                        tx,
+                        overflow: o.overflow,
+                        dropped: dropped.clone(),
+                        skipping: false,
+                    }));
+                    receivers.push(Some(StreamReceiver { rx, dropped }));
+                }
+            }
+        }
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread_stop = stop.clone();
+        let handle = std::thread::Builder::new()
+            .name("demux".to_owned())
+            .spawn(move || run(ctx, senders, &thread_stop))
+            .map_err(|e| Error::from_errno(e.raw_os_error().unwrap_or(libc::EAGAIN)))?;
+        Ok((
+            Demuxer {
+                handle: Some(handle),
+                stop,
+                monitors,
+            },
+            receivers,
+        ))
+    }
+
+    /// Returns the number of packets in each stream's queue, or `None` for unqueued streams.
+    pub fn queue_depths(&self) -> Vec<Option<usize>> {
+        self.monitors
+            .iter()
+            .map(|m| m.as_ref().map(|m| m.len()))
+            .collect()
+    }
+
+    /// Asks the thread to stop after its current `read_frame`, without waiting for it.
+    pub fn stop(&self) {
+        self.stop.store(true, Ordering::Release);
+        if let Some(ref h) = self.handle {
+            h.thread().unpark(); // in case it's blocked on a full queue.
+        }
+    }
+
+    /// Waits for the thread to exit, returning its error, if any. End of file isn't an error.
+    pub fn join(mut self) -> Result<(), Error> {
+        let h = self.handle.take().unwrap();
+        h.join().expect("demux thread panicked")
+    }
+}
+
+impl Drop for Demuxer {
+    fn drop(&mut self) {
+        if self.handle.is_some() {
+            self.stop();
+            let _ = self.handle.take().unwrap().join();
+        }
+    }
+}
+
+fn run(
+    ctx: InputFormatContext<'static>,
+    mut queues: Vec<Option<Queue>>,
+    stop: &AtomicBool,
+) -> Result<(), Error> {
+    while !stop.load(Ordering::Acquire) {
+        let pkt = match ctx.read_frame() {
+            Ok(p) => p,
+            Err(e) if e.is_eof() => break,
+            Err(e) => return Err(e),
+        };
+        let q = match queues.get_mut(pkt.stream_index()) {
+            Some(Some(q)) => q,
+            _ => continue,
+        };
+        if q.tx.is_consumer_closed() {
+            continue;
+        }
+        if q.skipping && !pkt.is_key() {
+            q.dropped.fetch_add(1, Ordering::Relaxed);
+            continue;
+        }
+        let mut pkt = pkt.detach()?;
+        loop {
+            pkt = match q.tx.try_push(pkt) {
+                Ok(()) => {
+                    q.skipping = false;
+                    break;
+                }
+                Err(p) => p,
+            };
+            match q.overflow {
+                Overflow::Block => {
+                    q.tx.wait_for_room(|| stop.load(Ordering::Acquire));
+                    if q.tx.is_consumer_closed() || stop.load(Ordering::Acquire) {
+                        break;
+                    }
+                }
+                Overflow::Drop | Overflow::DropUntilKey => {
+                    q.dropped.fetch_add(1, Ordering::Relaxed);
+                    q.skipping = q.overflow == Overflow::DropUntilKey;
+                    break;
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
+impl StreamReceiver {
+    /// Returns the next packet, blocking until one is available. Returns `None` once the
+    /// demuxer has stopped and all queued packets have been received.
+    pub fn recv(&mut self) -> Option<OwnedPacket> {
+        self.rx.pop()
+    }
+
+    /// Returns the next packet if one is available now.
+    pub fn try_recv(&mut self) -> Option<OwnedPacket> {
+        self.rx.try_pop()
+    }
+
+    /// Returns the number of packets queued.
+    pub fn depth(&self) -> usize {
+        self.rx.len()
+    }
+
+    /// Returns the number of packets dropped because the queue was full.
+    pub fn dropped(&self) -> u64 {
+        self.dropped.load(Ordering::Relaxed)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Demuxer, Overflow, QueueOptions};
+    use crate::avformat::InputFormatContext;
+    use crate::avutil::Dictionary;
+    use cstr::cstr;
+
+    fn open() -> InputFormatContext<'static> {
+        crate::Ffmpeg::new();
+        let mut dict = Dictionary::new();
+        InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict).unwrap()
+    }
+
+    #[test]
+    fn block() {
+        let opts = QueueOptions {
+            capacity: 2,
+            overflow: Overflow::Block,
+        };
+        let (demuxer, mut rxs) = Demuxer::spawn(open(), vec![Some(opts)]).unwrap();
+        let mut rx = rxs[0].take().unwrap();
+        let mut pts = Vec::new();
+        while let Some(p) = rx.recv() {
+            assert!(demuxer.queue_depths()[0].unwrap() <= 2);
+            pts.push(p.pts().unwrap());
+        }
+        assert_eq!(pts, &[0, 29700, 59400, 90000, 119700, 149400]);
+        assert_eq!(rx.dropped(), 0);
+        demuxer.join().unwrap();
+    }
+
+    #[test]
+    fn drop_when_full() {
+        let opts = QueueOptions {
+            capacity: 1,
+            overflow: Overflow::Drop,
+        };
+        let (demuxer, mut rxs) = Demuxer::spawn(open(), vec![Some(opts)]).unwrap();
+        demuxer.join().unwrap();
+        let mut rx = rxs[0].take().unwrap();
+        assert_eq!(rx.depth(), 1);
+        assert_eq!(rx.recv().unwrap().pts(), Some(0));
+        assert!(rx.recv().is_none());
+        assert_eq!(rx.dropped(), 5);
+    }
+
+    #[test]
+    fn unqueued_and_stop() {
+        let (demuxer, rxs) = Demuxer::spawn(open(), vec![None]).unwrap();
+        assert!(rxs[0].is_none());
+        assert_eq!(demuxer.queue_depths(), &[None]);
+        demuxer.join().unwrap();
+
+        // A blocked demuxer should stop when dropped.
+        let opts = QueueOptions {
+            capacity: 1,
+            overflow: Overflow::Block,
+        };
+        let (demuxer, _rxs) = Demuxer::spawn(open(), vec![Some(opts)]).unwrap();
+        drop(demuxer);
+    }
+}
@@ -0,0 +1,442 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Parallel offline decoding of a recorded file, for exports and bulk re-indexing.
+//!
+//! A single `DecodeContext` walking a file sequentially is limited by the codec's own
+//! threading. Instead, `gop_ranges` splits the stream's keyframe index into independent ranges,
+//! and `run` decodes them concurrently, each worker thread with its own seeked
+//! `InputFormatContext` and `DecodeContext`. Results are handed back in file order.
+//!
+//! This assumes closed GOPs, as produced by typical IP cameras: frames of one range never
+//! reference another range's frames.
+
+use crate::avcodec::DecoderOptions;
+use crate::avformat::{InputFormatContext, SeekFlags, StreamIndex};
+use crate::avutil::{Dictionary, Error, VideoFrame};
+use parking_lot::{Condvar, Mutex};
+use std::collections::BTreeMap;
+use std::sync::mpsc;
+use std::sync::Arc;
+
+/// A run of whole GOPs within a stream's index, decodable independently of the rest.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct GopRange {
+    /// The index entries `start..end` which make up this range; `start` is a keyframe.
+    pub start: usize,
+    pub end: usize,
+
+    /// The timestamp of entry `start`, in the index's time base.
+    pub start_ts: i64,
+
+    /// The timestamp of entry `end`, or `None` if the range extends to the end of the stream.
+    pub end_ts: Option<i64>,
+}
+
+/// Splits `index` into ranges starting at keyframes, merging consecutive GOPs until each range
+/// has at least `min_packets` packets (except perhaps the last). A bigger `min_packets`
+/// amortizes each range's seek and decoder flush over more frames; a smaller one spreads work
+/// more evenly across threads. Packets before the first keyframe can't be decoded and are
+/// omitted.
+pub fn gop_ranges(index: &StreamIndex, min_packets: usize) -> Vec<GopRange> {
+    let mut ranges = Vec::new();
+    let mut start = match index.is_key.iter().position(|&k| k) {
+        None => return ranges,
+        Some(s) => s,
+    };
+    for i in start + 1..index.len() {
+        if index.is_key[i] && i - start >= min_packets {
+            ranges.push(GopRange {
+                start,
+                end: i,
+                start_ts: index.timestamp[start],
+                end_ts: Some(index.timestamp[i]),
+            });
+            start = i;
+        }
+    }
+    ranges.push(GopRange {
+        start,
+        end: index.len(),
+        start_ts: index.timestamp[start],
+        end_ts: None,
+    });
+    ranges
+}
+
+/// Options for `run`.
+#[derive(Clone)]
+pub struct ExportOptions {
+    threads: usize,
+    decoder: DecoderOptions,
+}
+
+impl Default for ExportOptions {
+    fn default() -> Self {
+        ExportOptions {
+            threads: crate::avcodec::cpus(),
+            decoder: DecoderOptions::default(),
+        }
+    }
+}
+
+impl ExportOptions {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Sets the number of worker threads; the default is one per CPU.
+    pub fn threads(mut self, n: usize) -> Self {
+        self.threads = std::cmp::max(n, 1);
+        self
+    }
+
+    /// Sets the options for each worker's decoder. The default decodes on the worker's own
+    /// thread, which is usually best: parallelism comes from the workers.
+    pub fn decoder(mut self, opts: DecoderOptions) -> Self {
+        self.decoder = opts;
+        self
+    }
+}
+
+/// State shared between `run` and its workers.
+struct Shared {
+    state: Mutex<State>,
+    cond: Condvar,
+}
+
+struct State {
+    /// The next range to claim.
+    next: usize,
+
+    /// The number of ranges passed to the sink. Workers stay within `window` ranges of this,
+    /// bounding the results held for reordering.
+    emitted: usize,
+
+    /// True if a worker or the sink failed, so no further ranges should be started.
+    stop: bool,
+}
+
+/// Decodes stream `stream` of the ranges (as returned by `gop_ranges`) in parallel.
+///
+/// Each worker calls `open` once for its own input, then repeatedly claims the next
+/// unprocessed range, seeks to it, and calls `process` on each of its frames, in presentation
+/// order. `process` may scale (eg with a `swscale::ScalerCache` shared by the workers), encode
+/// (eg `EncodeContext::encode_into` with a per-thread encoder), or analyze the frame. `sink` is
+/// called on the calling thread with each range's results, in range order.
+///
+/// Returns the first error from `open`, decoding, `process`, or `sink`; remaining ranges are
+/// then abandoned. A panic in `process` likewise stops the other workers and is resumed on the
+/// calling thread.
+pub fn run<O, P, T, S>(
+    open: O,
+    stream: usize,
+    ranges: Vec<GopRange>,
+    opts: &ExportOptions,
+    process: P,
+    mut sink: S,
+) -> Result<(), Error>
+where
+    O: Fn() -> Result<InputFormatContext<'static>, Error> + Send + Sync + 'static,
+    P: Fn(&GopRange, &VideoFrame) -> Result<T, Error> + Send + Sync + 'static,
+    T: Send + 'static,
+    S: FnMut(&GopRange, Vec<T>) -> Result<(), Error>,
+{
+    let ranges = Arc::new(ranges);
+    let threads = std::cmp::min(opts.threads, ranges.len());
+    let window = 2 * threads;
+    let shared = Arc::new(Shared {
+        state: Mutex::new(State {
+            next: 0,
+            emitted: 0,
+            stop: false,
+        }),
+        cond: Condvar::new(),
+    });
+    let open = Arc::new(open);
+    let process = Arc::new(process);
+    let (tx, rx) = mpsc::channel();
+    let mut handles = Vec::with_capacity(threads);
+    let mut result = Ok(());
+    for i in 0..threads {
+        let w = Worker {
+            stream,
+            ranges: ranges.clone(),
+            shared: shared.clone(),
+            window,
+            decoder: opts.decoder.clone(),
+            tx: tx.clone(),
+        };
+        let open = open.clone();
+        let process = process.clone();
+        match std::thread::Builder::new()
+            .name(format!("export-{}", i))
+            .spawn(move || w.run(&*open, &*process))
+        {
+            Ok(h) => handles.push(h),
+            Err(e) => {
+                result = Err(Error::from_errno(e.raw_os_error().unwrap_or(libc::EAGAIN)));
+                break;
+            }
+        }
+    }
+    drop(tx);
+
+    // Reorder results as they arrive. The channel closes when all workers have exited.
+    let mut pending = BTreeMap::new();
+    let mut next = 0;
+    if result.is_ok() {
+        for (i, r) in rx.iter() {
+            match r {
+                Ok(items) => {
+                    pending.insert(i, items);
+                }
+                Err(e) => {
+                    result = Err(e);
+                    break;
+                }
+            }
+            while let Some(items) = pending.remove(&next) {
+                if let Err(e) = sink(&ranges[next], items) {
+                    result = Err(e);
+                    break;
+                }
+                next += 1;
+                shared.state.lock().emitted = next;
+                shared.cond.notify_all();
+            }
+            if result.is_err() {
+                break;
+            }
+        }
+    }
+    shared.state.lock().stop = true;
+    shared.cond.notify_all();
+    drop(rx);
+    let mut panic = None;
+    for h in handles {
+        if let Err(p) = h.join() {
+            panic = Some(p);
+        }
+    }
+    if let Some(p) = panic {
+        std::panic::resume_unwind(p);
+    }
+    result
+}
+
+struct Worker<T> {
+    stream: usize,
+    ranges: Arc<Vec<GopRange>>,
+    shared: Arc<Shared>,
+    window: usize,
+    decoder: DecoderOptions,
+    tx: mpsc::Sender<(usize, Result<Vec<T>, Error>)>,
+}
+
+impl<T> Worker<T> {
+    /// Claims the next range, waiting if it's too far ahead of the sink, or returns `None` when
+    /// there's nothing left to do.
+    fn claim(&self) -> Option<usize> {
+        let mut l = self.shared.state.lock();
+        loop {
+            if l.stop || l.next >= self.ranges.len() {
+                return None;
+            }
+            if l.next < l.emitted + self.window {
+                l.next += 1;
+                return Some(l.next - 1);
+            }
+            self.shared.cond.wait(&mut l);
+        }
+    }
+
+    fn run(
+        &self,
+        open: &dyn Fn() -> Result<InputFormatContext<'static>, Error>,
+        process: &dyn Fn(&GopRange, &VideoFrame) -> Result<T, Error>,
+    ) {
+        let _guard = PanicGuard(&self.shared);
+        let mut i = match self.claim() {
+            None => return,
+            Some(i) => i,
+        };
+        let (mut ctx, decoder) = match open().and_then(|ctx| {
+            let streams = ctx.streams();
+            if self.stream >= streams.len() {
+                return Err(Error::invalid_data());
+            }
+            let d = streams
+                .get(self.stream)
+                .codecpar()
+                .new_decoder_with(&self.decoder, &mut Dictionary::new())?;
+            Ok((ctx, d))
+        }) {
+            Ok(c) => c,
+            Err(e) => {
+                let _ = self.tx.send((i, Err(e)));
+                return;
+            }
+        };
+        let mut frame = match VideoFrame::empty() {
+            Ok(f) => f,
+            Err(e) => {
+                let _ = self.tx.send((i, Err(e)));
+                return;
+            }
+        };
+        loop {
+            let range = &self.ranges[i];
+            let r = decode_range(&mut ctx, self.stream, &decoder, &mut frame, range, process);
+            let failed = r.is_err();
+            if self.tx.send((i, r)).is_err() || failed {
+                return;
+            }
+            i = match self.claim() {
+                None => return,
+                Some(i) => i,
+            };
+        }
+    }
+}
+
+/// Stops the other workers if this one panics. Otherwise its range would never arrive, so they'd
+/// wait forever in `claim` for the sink to advance, and `run` would wait forever for them.
+struct PanicGuard<'a>(&'a Shared);
+
+impl<'a> Drop for PanicGuard<'a> {
+    fn drop(&mut self) {
+        if std::thread::panicking() {
+            self.0.state.lock().stop = true;
+            self.0.cond.notify_all();
+        }
+    }
+}
+
+fn decode_range<T>(
+    ctx: &mut InputFormatContext<'static>,
+    stream: usize,
+    decoder: &crate::avcodec::DecodeContext,
+    frame: &mut VideoFrame,
+    range: &GopRange,
+    process: &dyn Fn(&GopRange, &VideoFrame) -> Result<T, Error>,
+) -> Result<Vec<T>, Error> {
+    ctx.seek(Some(stream), range.start_ts, SeekFlags::empty())?;
+    decoder.flush();
+    let mut out = Vec::with_capacity(range.end - range.start);
+    loop {
+        let pkt = match ctx.read_frame() {
+            Ok(p) => p,
+            Err(e) if e.is_eof() => break,
+            Err(e) => return Err(e),
+        };
+        if pkt.stream_index() != stream || pkt.dts() < range.start_ts {
+            continue;
+        }
+        if matches!(range.end_ts, Some(end) if pkt.dts() >= end) {
+            break;
+        }
+        let mut frames = decoder.decode(&pkt, frame)?;
+        while let Some(f) = frames.next()? {
+            out.push(process(range, f)?);
+        }
+    }
+    decoder.drain()?;
+    let mut frames = decoder.frames(frame);
+    while let Some(f) = frames.next()? {
+        out.push(process(range, f)?);
+    }
+    decoder.flush();
+    Ok(out)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{gop_ranges, run, ExportOptions, GopRange};
+    use crate::avformat::InputFormatContext;
+    use crate::avutil::{Dictionary, Error};
+    use cstr::cstr;
+
+    fn open() -> Result<InputFormatContext<'static>, Error> {
+        let mut dict = Dictionary::new();
+        InputFormatContext::open(cstr!("src/testdata/clip.mp4"), &mut dict)
+    }
+
+    #[test]
+    fn ranges() {
+        crate::Ffmpeg::new();
+        let index = open().unwrap().streams().get(0).index();
+        assert_eq!(
+            gop_ranges(&index, 1),
+            &[
+                GopRange {
+                    start: 0,
+                    end: 3,
+                    start_ts: 0,
+                    end_ts: Some(90000),
+                },
+                GopRange {
+                    start: 3,
+                    end: 6,
+                    start_ts: 90000,
+                    end_ts: None,
+                },
+            ]
+        );
+        assert_eq!(gop_ranges(&index, 4).len(), 1);
+    }
+
+    #[test]
+    fn parallel_in_order() {
+        crate::Ffmpeg::new();
+        let index = open().unwrap().streams().get(0).index();
+        let ranges = gop_ranges(&index, 1);
+        let mut got = Vec::new();
+        run(
+            open,
+            0,
+            ranges,
+            &ExportOptions::new().threads(2),
+            |_, f| Ok(f.pts()),
+            |r, pts| {
+                got.push((r.start, pts));
+                Ok(())
+            },
+        )
+        .unwrap();
+        assert_eq!(
+            got,
+            &[(0, vec![0, 29700, 59400]), (3, vec![90000, 119700, 149400])]
+        );
+
+        // Errors from `process` are returned.
+        let e = run(
+            open,
+            0,
+            gop_ranges(&index, 1),
+            &ExportOptions::new(),
+            |_, _| Err::<(), _>(Error::invalid_data()),
+            |_, _| Ok(()),
+        )
+        .unwrap_err();
+        assert_eq!(e.to_string(), Error::invalid_data().to_string());
+
+        // A panic in `process` is propagated rather than deadlocking the other workers.
+        let r = std::panic::catch_unwind(|| {
+            run(
+                open,
+                0,
+                gop_ranges(&index, 1),
+                &ExportOptions::new().threads(2),
+                |r, _| {
+                    if r.start == 0 {
+                        panic!("process failed");
+                    }
+                    Ok(())
+                },
+                |_, _| Ok(()),
+            )
+        });
+        assert!(r.is_err());
+    }
+}
@@ -3,16 +3,26 @@
 
 use libc::{c_char, c_int};
 use log::info;
-use parking_lot::Once;
+use parking_lot::{Once, RwLock};
 use std::convert::TryFrom;
 use std::ffi::CStr;
 use std::fmt::{self, Write};
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 
 static START: Once = Once::new();
 
+/// The library versions, as logged by `Ffmpeg::new`.
+static VERSIONS: RwLock<String> = parking_lot::const_rwlock(String::new());
+
 pub mod avcodec;
 pub mod avformat;
 pub mod avutil;
+pub mod demux;
+pub mod export;
+mod spsc;
+pub mod stats;
+#[cfg(feature = "swresample")]
+pub mod swresample;
 #[cfg(feature = "swscale")]
 pub mod swscale;
 
@@ -145,6 +155,166 @@ unsafe fn append_vprintf(buf: &mut Vec<u8>, fmt: *const libc::c_char, vl: *mut l
     buf.set_len(len + ret);
 }
 
+/// The number of `log::Level`s, for per-level arrays indexed by `level as usize - 1`.
+const LEVELS: usize = 5;
+
+/// Per-`AVClass` item name logging state, interned for the life of the process so the log
+/// callback doesn't allocate. There are only as many of these as there are distinct item names
+/// (typically codec, format, and protocol names).
+struct LogClass {
+    /// The `avc_item_name`, eg `h264`.
+    name: &'static str,
+
+    /// The log target: `moonfire_ffmpeg::{name}`.
+    target: &'static str,
+
+    levels: [LevelState; LEVELS],
+}
+
+#[derive(Default)]
+struct LevelState {
+    /// The total number of messages, whether logged or not.
+    count: AtomicU64,
+
+    /// The total number of messages suppressed by rate limiting.
+    suppressed: AtomicU64,
+
+    /// The start (in `now_secs`) of the current rate limiting window.
+    window: AtomicU64,
+
+    /// The number of messages admitted within the current window.
+    in_window: AtomicU32,
+
+    /// The value of `suppressed` as of the last summary message.
+    reported: AtomicU64,
+}
+
+/// The result of `LevelState::admit`.
+#[derive(Debug, PartialEq, Eq)]
+enum Admit {
+    /// Log the message, first noting this many messages were suppressed in earlier windows.
+    Log {
+        newly_suppressed: u64,
+    },
+
+    Suppress,
+}
+
+impl LevelState {
+    /// Decides whether to log a message at time `now` (in seconds) given a limit of `limit`
+    /// messages per second, where 0 means unlimited.
+    fn admit(&self, now: u64, limit: u32) -> Admit {
+        if limit != 0 {
+            let window = self.window.load(Ordering::Relaxed);
+            if window != now
+                && self
+                    .window
+                    .compare_exchange(window, now, Ordering::Relaxed, Ordering::Relaxed)
+                    .is_ok()
+            {
+                self.in_window.store(0, Ordering::Relaxed);
+            }
+            if self.in_window.fetch_add(1, Ordering::Relaxed) >= limit {
+                self.suppressed.fetch_add(1, Ordering::Relaxed);
+                return Admit::Suppress;
+            }
+        }
+        let suppressed = self.suppressed.load(Ordering::Relaxed);
+        let reported = self.reported.swap(suppressed, Ordering::Relaxed);
+        Admit::Log {
+            newly_suppressed: suppressed.saturating_sub(reported),
+        }
+    }
+}
+
+static LOG_CLASSES: RwLock<Vec<&'static LogClass>> = parking_lot::const_rwlock(Vec::new());
+
+/// Messages per second per (class, level) before suppression; see `set_log_rate_limit`.
+static LOG_RATE_LIMIT: AtomicU32 = AtomicU32::new(100);
+
+/// Sets the maximum number of ffmpeg log messages per second from any one (`AVClass` item
+/// name, level) pair, such as h264 errors from a corrupt stream. Extra messages are dropped
+/// and summarized in the next message logged for that pair. 0 means unlimited.
+pub fn set_log_rate_limit(messages_per_sec: u32) {
+    LOG_RATE_LIMIT.store(messages_per_sec, Ordering::Relaxed);
+}
+
+/// Counts of ffmpeg log messages for one (`AVClass` item name, level) pair.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct LogCounter {
+    /// The `AVClass` item name, eg `h264`, or `null` for messages without a context.
+    pub class: &'static str,
+    pub level: log::Level,
+
+    /// The number of messages, including ones not logged because of the log level filter or
+    /// rate limiting. Debug and trace messages are only counted when the logger would log them.
+    pub count: u64,
+
+    /// The number of messages dropped by rate limiting.
+    pub suppressed: u64,
+}
+
+/// Returns a snapshot of log message counts, a cheap signal of (eg) decoder health.
+pub fn log_counters() -> Vec<LogCounter> {
+    let classes = LOG_CLASSES.read();
+    let mut out = Vec::new();
+    for c in classes.iter() {
+        for (i, l) in c.levels.iter().enumerate() {
+            let count = l.count.load(Ordering::Relaxed);
+            if count == 0 {
+                continue;
+            }
+            out.push(LogCounter {
+                class: c.name,
+                level: level_from_index(i),
+                count,
+                suppressed: l.suppressed.load(Ordering::Relaxed),
+            });
+        }
+    }
+    out
+}
+
+fn level_from_index(i: usize) -> log::Level {
+    match i {
+        0 => log::Level::Error,
+        1 => log::Level::Warn,
+        2 => log::Level::Info,
+        3 => log::Level::Debug,
+        _ => log::Level::Trace,
+    }
+}
+
+/// Returns the interned state for the given item name, creating it if necessary.
+fn log_class(name: &str) -> &'static LogClass {
+    if let Some(c) = LOG_CLASSES.read().iter().find(|c| c.name == name) {
+        return c;
+    }
+    let mut classes = LOG_CLASSES.write();
+    if let Some(c) = classes.iter().find(|c| c.name == name) {
+        return c;
+    }
+    let name: &'static str = Box::leak(name.to_owned().into_boxed_str());
+    let target: &'static str = Box::leak(format!("moonfire_ffmpeg::{}", name).into_boxed_str());
+    let c: &'static LogClass = Box::leak(Box::new(LogClass {
+        name,
+        target,
+        levels: Default::default(),
+    }));
+    classes.push(c);
+    c
+}
+
+/// Returns a monotonic time in whole seconds, for rate limiting.
+fn now_secs() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as u64
+}
+
 /// Log callback which sends `av_log_default_callback`-like payloads into the
 /// log crate, turning ffmpeg's `avc_item_name` into a module path and ffmpeg's
 /// levels into log crate levels.
@@ -157,12 +327,12 @@ extern "C" fn log_callback(
 ) {
     let log_level = avutil::convert_level(level);
 
-    // Fast path so trace calls don't allocate when trace isn't enabled anywhere.
-    if log::max_level()
+    // Fast path so trace calls don't do any work when trace isn't enabled anywhere.
+    let max_level_ok = log::max_level()
         .to_level()
-        .map(|l| l < log_level)
-        .unwrap_or(true)
-    {
+        .map(|l| l >= log_level)
+        .unwrap_or(false);
+    if !max_level_ok && log_level > log::Level::Info {
         return;
     }
     let avc_item_name = if avc_item_name.is_null() {
@@ -172,15 +342,51 @@ extern "C" fn log_callback(
             .to_str()
             .unwrap_or("bad_utf8")
     };
-    let target = format!("moonfire_ffmpeg::{}", avc_item_name);
+    let class = log_class(avc_item_name);
+    let level_state = &class.levels[log_level as usize - 1];
+
+    // A call whose format ends in a newline completes a message; see LOG_BUF.
+    let completes = unsafe { CStr::from_ptr(fmt) }
+        .to_bytes()
+        .last()
+        .map(|&b| b == b'\n' || b == b'\r')
+        .unwrap_or(false);
+    if completes {
+        level_state.count.fetch_add(1, Ordering::Relaxed);
+    }
+
     let metadata = log::Metadata::builder()
-        .level(avutil::convert_level(level))
-        .target(&target)
+        .level(log_level)
+        .target(class.target)
         .build();
     let logger = log::logger();
-    if !logger.enabled(&metadata) {
+    if !max_level_ok || !logger.enabled(&metadata) {
         return;
     }
+    let newly_suppressed = if completes {
+        match level_state.admit(now_secs(), LOG_RATE_LIMIT.load(Ordering::Relaxed)) {
+            Admit::Suppress => {
+                // Discard any earlier partial pieces of this message, too.
+                LOG_BUF.with(|b| b.borrow_mut().clear());
+                return;
+            }
+            Admit::Log { newly_suppressed } => newly_suppressed,
+        }
+    } else {
+        0
+    };
+    if newly_suppressed > 0 {
+        logger.log(
+            &log::RecordBuilder::new()
+                .args(format_args!(
+                    "suppressed {} similar messages (rate limit)",
+                    newly_suppressed
+                ))
+                .metadata(metadata.clone())
+                .module_path(Some(class.target))
+                .build(),
+        );
+    }
 
     LOG_BUF.with(move |b| {
         unsafe { log_callback_inner(&mut *b.borrow_mut(), logger, metadata, avc, fmt, vl) };
@@ -214,6 +420,7 @@ unsafe fn log_callback_inner(
         }
     }
 
+    // This borrows rather than allocates unless the message is invalid UTF-8.
     let s = String::from_utf8_lossy(&buf[0..buf.len() - 1]);
     let target = metadata.target();
     logger.log(
@@ -252,6 +459,13 @@ impl Ffmpeg {
                     avformat::avformat_version(),
                     CStr::from_ptr(avformat::avformat_configuration()),
                 ),
+                #[cfg(feature = "swresample")]
+                Library::new(
+                    "swresample",
+                    swresample::moonfire_ffmpeg_compiled_libswresample_version,
+                    swresample::swresample_version(),
+                    CStr::from_ptr(swresample::swresample_configuration()),
+                ),
                 #[cfg(feature = "swscale")]
                 Library::new(
                     "swscale",
@@ -276,14 +490,28 @@ impl Ffmpeg {
             if !compatible {
                 panic!("Incompatible ffmpeg versions:{}", msg);
             }
+            if avutil::moonfire_ffmpeg_av_nopts_value != avutil::AV_NOPTS_VALUE {
+                panic!(
+                    "AV_NOPTS_VALUE is {}; expected {}",
+                    avutil::moonfire_ffmpeg_av_nopts_value,
+                    avutil::AV_NOPTS_VALUE
+                );
+            }
             avformat::av_register_all();
             if avformat::avformat_network_init() < 0 {
                 panic!("avformat_network_init failed");
             }
             info!("Initialized ffmpeg. Versions:{}", msg);
+            *VERSIONS.write() = msg;
         });
         Ffmpeg {}
     }
+
+    /// Returns the compiled and running library versions (and configurations), as logged by
+    /// `new`. Useful to label benchmark results and bug reports.
+    pub fn versions(&self) -> String {
+        VERSIONS.read().clone()
+    }
 }
 
 #[cfg(test)]
@@ -380,4 +608,63 @@ mod tests {
         assert_eq!(&l[1][..], "INFO: moonfire_ffmpeg::null: 0x0: partial log");
         assert_eq!(&l[2][..], "INFO: moonfire_ffmpeg::null: 0x0: bar");
     }
+
+    #[test]
+    fn test_rate_limit() {
+        use super::Admit;
+        let l = super::LevelState::default();
+        for _ in 0..3 {
+            assert_eq!(
+                l.admit(10, 3),
+                Admit::Log {
+                    newly_suppressed: 0
+                }
+            );
+        }
+        assert_eq!(l.admit(10, 3), Admit::Suppress);
+        assert_eq!(l.admit(10, 3), Admit::Suppress);
+        assert_eq!(
+            l.admit(11, 3),
+            Admit::Log {
+                newly_suppressed: 2
+            }
+        );
+        assert_eq!(
+            l.admit(11, 3),
+            Admit::Log {
+                newly_suppressed: 0
+            }
+        );
+        assert_eq!(
+            l.admit(11, 0),
+            Admit::Log {
+                newly_suppressed: 0
+            }
+        );
+        assert_eq!(l.suppressed.load(std::sync::atomic::Ordering::Relaxed), 2);
+    }
+
+    #[test]
+    fn test_log_counters() {
+        super::Ffmpeg::new();
+        let errors = || {
+            super::log_counters()
+                .iter()
+                .find(|c| c.class == "null" && c.level == log::Level::Error)
+                .map(|c| c.count)
+                .unwrap_or(0)
+        };
+        let before = errors();
+        for _ in 0..10 {
+            unsafe {
+                avutil::av_log(
+                    std::ptr::null(),
+                    avutil::AV_LOG_ERROR,
+                    cstr!("error %d\n").as_ptr(),
+                    1 as i32,
+                )
+            };
+        }
+        assert!(errors() >= before + 10);
+    }
 }
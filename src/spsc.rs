@@ -0,0 +1,257 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! A bounded, lock-free single-producer single-consumer queue, used by `demux`.
+//!
+//! Pushing and popping are a couple of atomic operations. Either side can block when the queue
+//! is full or empty; blocking parks the thread, and the other side unparks it only if it's
+//! actually parked, so the uncontended path never takes a lock.
+
+use parking_lot::Mutex;
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{fence, AtomicBool, AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::thread::Thread;
+
+/// A side (producer or consumer) which may park waiting on the other.
+#[derive(Default)]
+struct Waiter {
+    parked: AtomicBool,
+    thread: Mutex<Option<Thread>>,
+}
+
+impl Waiter {
+    /// Parks the current thread until `ready` returns true.
+    fn wait_until(&self, mut ready: impl FnMut() -> bool) {
+        loop {
+            if ready() {
+                return;
+            }
+            *self.thread.lock() = Some(std::thread::current());
+            self.parked.store(true, Ordering::Relaxed);
+
+            // Pairs with the fence in `wake`: either this thread sees the other side's update
+            // in `ready`, or the other side sees `parked` and unparks this thread.
+            fence(Ordering::SeqCst);
+            if ready() {
+                self.parked.store(false, Ordering::Relaxed);
+                return;
+            }
+            std::thread::park();
+            self.parked.store(false, Ordering::Relaxed);
+        }
+    }
+
+    fn wake(&self) {
+        fence(Ordering::SeqCst);
+        if self.parked.load(Ordering::Relaxed) {
+            if let Some(ref t) = *self.thread.lock() {
+                t.unpark();
+            }
+        }
+    }
+}
+
+struct Ring<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+
+    /// The index of the next slot to pop, modulo `slots.len()`. Written only by the consumer.
+    head: AtomicUsize,
+
+    /// The index of the next slot to push, modulo `slots.len()`. Written only by the producer.
+    tail: AtomicUsize,
+
+    producer_closed: AtomicBool,
+    consumer_closed: AtomicBool,
+    producer: Waiter,
+    consumer: Waiter,
+}
+
+// Each slot is accessed by only one side at a time, as handed off via `head` and `tail`.
+unsafe impl<T: Send> Send for Ring<T> {}
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Ring<T> {
+    fn len(&self) -> usize {
+        // Load `head` first: both only increase, so a `tail` loaded afterward is at least as
+        // new, and the difference can't underflow. A third thread (eg `Monitor`) may still see
+        // a stale pair, so clamp to the capacity.
+        let head = self.head.load(Ordering::Acquire);
+        let tail = self.tail.load(Ordering::Acquire);
+        std::cmp::min(tail.wrapping_sub(head), self.slots.len())
+    }
+}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        let (head, tail) = (*self.head.get_mut(), *self.tail.get_mut());
+        let mut i = head;
+        while i != tail {
+            unsafe {
+                std::ptr::drop_in_place((*self.slots[i % self.slots.len()].get()).as_mut_ptr())
+            };
+            i = i.wrapping_add(1);
+        }
+    }
+}
+
+/// Creates a queue which holds up to `capacity` items.
+pub(crate) fn channel<T>(capacity: usize) -> (Producer<T>, Consumer<T>) {
+    assert!(capacity > 0);
+    let ring = Arc::new(Ring {
+        slots: (0..capacity)
+            .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+            .collect(),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        producer_closed: AtomicBool::new(false),
+        consumer_closed: AtomicBool::new(false),
+        producer: Waiter::default(),
+        consumer: Waiter::default(),
+    });
+    (Producer(ring.clone()), Consumer(ring))
+}
+
+pub(crate) struct Producer<T>(Arc<Ring<T>>);
+
+impl<T> Producer<T> {
+    /// Pushes `v`, or returns it if the queue is full.
+    pub(crate) fn try_push(&mut self, v: T) -> Result<(), T> {
+        let r = &*self.0;
+        let tail = r.tail.load(Ordering::Relaxed);
+        if tail.wrapping_sub(r.head.load(Ordering::Acquire)) == r.slots.len() {
+            return Err(v);
+        }
+        unsafe { (*r.slots[tail % r.slots.len()].get()).as_mut_ptr().write(v) };
+        r.tail.store(tail.wrapping_add(1), Ordering::Release);
+        r.consumer.wake();
+        Ok(())
+    }
+
+    /// Blocks until the queue has room, the consumer is dropped, or `stop` returns true.
+    /// `stop` is rechecked whenever the thread is unparked.
+    pub(crate) fn wait_for_room(&self, mut stop: impl FnMut() -> bool) {
+        let r = &*self.0;
+        r.producer
+            .wait_until(|| r.len() < r.slots.len() || self.is_consumer_closed() || stop());
+    }
+
+    pub(crate) fn is_consumer_closed(&self) -> bool {
+        self.0.consumer_closed.load(Ordering::Acquire)
+    }
+
+    pub(crate) fn monitor(&self) -> Monitor<T> {
+        Monitor(self.0.clone())
+    }
+}
+
+impl<T> Drop for Producer<T> {
+    fn drop(&mut self) {
+        self.0.producer_closed.store(true, Ordering::Release);
+        self.0.consumer.wake();
+    }
+}
+
+pub(crate) struct Consumer<T>(Arc<Ring<T>>);
+
+impl<T> Consumer<T> {
+    pub(crate) fn try_pop(&mut self) -> Option<T> {
+        let r = &*self.0;
+        let head = r.head.load(Ordering::Relaxed);
+        if head == r.tail.load(Ordering::Acquire) {
+            return None;
+        }
+        let v = unsafe { (*r.slots[head % r.slots.len()].get()).as_ptr().read() };
+        r.head.store(head.wrapping_add(1), Ordering::Release);
+        r.producer.wake();
+        Some(v)
+    }
+
+    /// Pops the next item, blocking until one is available. Returns `None` once the producer
+    /// has been dropped and the queue is empty.
+    pub(crate) fn pop(&mut self) -> Option<T> {
+        loop {
+            if let Some(v) = self.try_pop() {
+                return Some(v);
+            }
+            if self.0.producer_closed.load(Ordering::Acquire) {
+                // Items pushed before closing are visible now.
+                return self.try_pop();
+            }
+            let r = &*self.0;
+            r.consumer
+                .wait_until(|| r.len() > 0 || r.producer_closed.load(Ordering::Acquire));
+        }
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.0.len()
+    }
+}
+
+impl<T> Drop for Consumer<T> {
+    fn drop(&mut self) {
+        self.0.consumer_closed.store(true, Ordering::Release);
+        self.0.producer.wake();
+    }
+}
+
+/// A read-only handle for reporting a queue's depth.
+pub(crate) struct Monitor<T>(Arc<Ring<T>>);
+
+impl<T> Monitor<T> {
+    pub(crate) fn len(&self) -> usize {
+        self.0.len()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    #[test]
+    fn full_and_empty() {
+        let (mut tx, mut rx) = super::channel(2);
+        assert_eq!(rx.try_pop(), None);
+        tx.try_push(1).unwrap();
+        tx.try_push(2).unwrap();
+        assert_eq!(tx.try_push(3), Err(3));
+        assert_eq!(tx.monitor().len(), 2);
+        assert_eq!(rx.try_pop(), Some(1));
+        tx.try_push(3).unwrap();
+        drop(tx);
+        assert_eq!(rx.pop(), Some(2));
+        assert_eq!(rx.pop(), Some(3));
+        assert_eq!(rx.pop(), None);
+    }
+
+    #[test]
+    fn threads() {
+        const N: usize = 100_000;
+        let (mut tx, mut rx) = super::channel(16);
+        let producer = std::thread::spawn(move || {
+            for mut i in 0..N {
+                while let Err(v) = tx.try_push(i) {
+                    i = v;
+                    tx.wait_for_room(|| false);
+                }
+            }
+        });
+        for i in 0..N {
+            assert_eq!(rx.pop(), Some(i));
+        }
+        assert_eq!(rx.pop(), None);
+        producer.join().unwrap();
+    }
+
+    #[test]
+    fn drops_unpopped() {
+        let v = std::sync::Arc::new(());
+        let (mut tx, rx) = super::channel(4);
+        tx.try_push(v.clone()).unwrap();
+        tx.try_push(v.clone()).unwrap();
+        assert_eq!(std::sync::Arc::strong_count(&v), 3);
+        drop(tx);
+        drop(rx);
+        assert_eq!(std::sync::Arc::strong_count(&v), 1);
+    }
+}
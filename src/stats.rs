@@ -0,0 +1,289 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Opt-in performance counters for `InputFormatContext`, `DecodeContext`, and `Scaler`.
+//!
+//! Each stats struct is a set of relaxed atomics, cheap enough to leave on in production. A
+//! single `Arc` can be shared among several contexts (eg, all the contexts a camera's stream has
+//! used across reconnects) to aggregate them. `snapshot` returns plain values for export.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+/// The number of histogram buckets. Bucket `i` holds durations of less than `2^i` nanoseconds
+/// (and at least `2^(i-1)`); the last bucket, starting at about one second, also holds anything
+/// longer.
+pub const HISTOGRAM_BUCKETS: usize = 32;
+
+/// A lock-free latency histogram with power-of-two nanosecond buckets.
+#[derive(Default)]
+pub struct Histogram {
+    buckets: [AtomicU64; HISTOGRAM_BUCKETS],
+    sum_nanos: AtomicU64,
+}
+
+impl Histogram {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn record(&self, d: Duration) {
+        let nanos = std::cmp::min(d.as_nanos(), u128::from(u64::MAX)) as u64;
+        let i = std::cmp::min((64 - nanos.leading_zeros()) as usize, HISTOGRAM_BUCKETS - 1);
+        self.buckets[i].fetch_add(1, Ordering::Relaxed);
+        self.sum_nanos.fetch_add(nanos, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        let mut buckets = [0; HISTOGRAM_BUCKETS];
+        for (s, b) in buckets.iter_mut().zip(self.buckets.iter()) {
+            *s = b.load(Ordering::Relaxed);
+        }
+        HistogramSnapshot {
+            buckets,
+            sum: Duration::from_nanos(self.sum_nanos.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct HistogramSnapshot {
+    /// Counts per bucket; see `HISTOGRAM_BUCKETS`.
+    pub buckets: [u64; HISTOGRAM_BUCKETS],
+
+    /// The total of all recorded durations.
+    pub sum: Duration,
+}
+
+impl HistogramSnapshot {
+    pub fn count(&self) -> u64 {
+        self.buckets.iter().sum()
+    }
+
+    pub fn mean(&self) -> Option<Duration> {
+        match self.count() {
+            0 => None,
+            n => Some(Duration::from_nanos(
+                (self.sum.as_nanos() / u128::from(n)) as u64,
+            )),
+        }
+    }
+
+    /// Returns an upper bound on the `q`th quantile (`0.0..=1.0`), eg `0.99` for p99. This is
+    /// the exclusive upper edge of the bucket, so it may be up to twice the actual value.
+    pub fn quantile(&self, q: f64) -> Option<Duration> {
+        let n = self.count();
+        if n == 0 {
+            return None;
+        }
+        let target = std::cmp::max(1, (q * n as f64).ceil() as u64);
+        let mut seen = 0;
+        for (i, &b) in self.buckets.iter().enumerate() {
+            seen += b;
+            if seen >= target {
+                return Some(Duration::from_nanos(1u64 << i));
+            }
+        }
+        Some(Duration::from_nanos(1u64 << (HISTOGRAM_BUCKETS - 1)))
+    }
+}
+
+/// Runs `f`, recording its latency into `h` if stats are enabled.
+pub(crate) fn time<T>(h: Option<&Histogram>, f: impl FnOnce() -> T) -> T {
+    match h {
+        None => f(),
+        Some(h) => {
+            let start = Instant::now();
+            let r = f();
+            h.record(start.elapsed());
+            r
+        }
+    }
+}
+
+fn add(c: &AtomicU64, n: u64) {
+    c.fetch_add(n, Ordering::Relaxed);
+}
+
+fn get(c: &AtomicU64) -> u64 {
+    c.load(Ordering::Relaxed)
+}
+
+/// Stats for an `InputFormatContext`; see `OpenOptions::stats`.
+#[derive(Default)]
+pub struct InputStats {
+    pub(crate) packets: AtomicU64,
+    pub(crate) packet_bytes: AtomicU64,
+    pub(crate) io_reads: AtomicU64,
+    pub(crate) io_bytes: AtomicU64,
+    pub(crate) read_frame: Histogram,
+}
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct InputStatsSnapshot {
+    /// Packets returned by `read_frame`, `read_frame_until`, and `read_frames`.
+    pub packets: u64,
+    pub packet_bytes: u64,
+
+    /// Calls to a custom `IoContext`'s `read`, and the bytes they returned. These stay zero for
+    /// ffmpeg's own protocols (file, rtsp, ...).
+    pub io_reads: u64,
+    pub io_bytes: u64,
+
+    /// Latency of each `read_frame`/`read_frame_until`/`read_frames` call, including failures.
+    pub read_frame: HistogramSnapshot,
+}
+
+impl std::fmt::Debug for InputStats {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        self.snapshot().fmt(f)
+    }
+}
+
+impl InputStats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub(crate) fn add_packet(&self, bytes: usize) {
+        add(&self.packets, 1);
+        add(&self.packet_bytes, bytes as u64);
+    }
+
+    pub(crate) fn add_io_read(&self, bytes: usize) {
+        add(&self.io_reads, 1);
+        add(&self.io_bytes, bytes as u64);
+    }
+
+    pub fn snapshot(&self) -> InputStatsSnapshot {
+        InputStatsSnapshot {
+            packets: get(&self.packets),
+            packet_bytes: get(&self.packet_bytes),
+            io_reads: get(&self.io_reads),
+            io_bytes: get(&self.io_bytes),
+            read_frame: self.read_frame.snapshot(),
+        }
+    }
+}
+
+/// Stats for a `DecodeContext`; see `DecodeContext::set_stats`.
+#[derive(Default)]
+pub struct DecodeStats {
+    pub(crate) packets: AtomicU64,
+    pub(crate) errors: AtomicU64,
+    pub(crate) frames: AtomicU64,
+    pub(crate) dropped: AtomicU64,
+    pub(crate) decode: Histogram,
+}
+
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct DecodeStatsSnapshot {
+    /// Packets accepted by `decode_video` or `send_packet`.
+    pub packets: u64,
+
+    /// Failed `decode_video`, `send_packet`, or `receive_frame` calls, excluding `EAGAIN` and
+    /// end of stream.
+    pub errors: u64,
+
+    /// Frames returned by `decode_video` or `receive_frame`.
+    pub frames: u64,
+
+    /// Packets which `decode_video` accepted without returning a frame, such as ones skipped by
+    /// the `DiscardPolicy` or consumed by frame threading's delay.
+    pub dropped: u64,
+
+    /// Latency of each `decode_video`, `send_packet`, and `receive_frame` call.
+    pub decode: HistogramSnapshot,
+}
+
+impl std::fmt::Debug for DecodeStats {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        self.snapshot().fmt(f)
+    }
+}
+
+impl DecodeStats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn snapshot(&self) -> DecodeStatsSnapshot {
+        DecodeStatsSnapshot {
+            packets: get(&self.packets),
+            errors: get(&self.errors),
+            frames: get(&self.frames),
+            dropped: get(&self.dropped),
+            decode: self.decode.snapshot(),
+        }
+    }
+}
+
+/// Stats for a `Scaler`; see `Scaler::set_stats`.
+#[cfg(feature = "swscale")]
+#[derive(Default)]
+pub struct ScaleStats {
+    pub(crate) frames: AtomicU64,
+    pub(crate) scale: Histogram,
+}
+
+#[cfg(feature = "swscale")]
+#[derive(Copy, Clone, Debug, PartialEq, Eq)]
+pub struct ScaleStatsSnapshot {
+    pub frames: u64,
+
+    /// Latency of each `Scaler::scale` call, including waiting for all bands.
+    pub scale: HistogramSnapshot,
+}
+
+#[cfg(feature = "swscale")]
+impl std::fmt::Debug for ScaleStats {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        self.snapshot().fmt(f)
+    }
+}
+
+#[cfg(feature = "swscale")]
+impl ScaleStats {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub(crate) fn add_frame(&self) {
+        add(&self.frames, 1);
+    }
+
+    pub fn snapshot(&self) -> ScaleStatsSnapshot {
+        ScaleStatsSnapshot {
+            frames: get(&self.frames),
+            scale: self.scale.snapshot(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn histogram() {
+        let h = Histogram::new();
+        assert_eq!(h.snapshot().quantile(0.5), None);
+        h.record(Duration::from_nanos(0));
+        h.record(Duration::from_nanos(3));
+        h.record(Duration::from_nanos(1000));
+        h.record(Duration::from_secs(100_000));
+        let s = h.snapshot();
+        assert_eq!(s.count(), 4);
+        assert_eq!(s.buckets[0], 1);
+        assert_eq!(s.buckets[2], 1);
+        assert_eq!(s.buckets[10], 1);
+        assert_eq!(s.buckets[HISTOGRAM_BUCKETS - 1], 1);
+        assert_eq!(s.quantile(0.0), Some(Duration::from_nanos(1)));
+        assert_eq!(s.quantile(0.5), Some(Duration::from_nanos(4)));
+        assert_eq!(s.quantile(0.75), Some(Duration::from_nanos(1024)));
+        assert_eq!(
+            s.quantile(1.0),
+            Some(Duration::from_nanos(1 << (HISTOGRAM_BUCKETS - 1)))
+        );
+    }
+}
@@ -0,0 +1,224 @@
+// Copyright (C) 2021 Scott Lamb <slamb@slamb.org>
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+use crate::avutil::{AudioFrame, Error, Sample, SampleFormat, SampleRing};
+use std::convert::TryFrom;
+use std::ptr;
+
+//#[link(name = "swresample")]
+extern "C" {
+    pub(crate) fn swresample_version() -> libc::c_int;
+    pub(crate) fn swresample_configuration() -> *mut libc::c_char;
+
+    fn swr_alloc_set_opts(
+        s: *mut SwrContext,
+        out_ch_layout: i64,
+        out_sample_fmt: SampleFormat,
+        out_sample_rate: libc::c_int,
+        in_ch_layout: i64,
+        in_sample_fmt: SampleFormat,
+        in_sample_rate: libc::c_int,
+        log_offset: libc::c_int,
+        log_ctx: *mut libc::c_void,
+    ) -> *mut SwrContext;
+    fn swr_init(s: *mut SwrContext) -> libc::c_int;
+    fn swr_free(s: *mut *mut SwrContext);
+    fn swr_convert(
+        s: *mut SwrContext,
+        out: *const *mut u8,
+        out_count: libc::c_int,
+        in_: *const *mut u8,
+        in_count: libc::c_int,
+    ) -> libc::c_int;
+    fn swr_get_out_samples(s: *mut SwrContext, in_samples: libc::c_int) -> libc::c_int;
+
+    fn av_get_default_channel_layout(nb_channels: libc::c_int) -> i64;
+}
+
+//#[link(name = "wrapper")]
+extern "C" {
+    pub(crate) static moonfire_ffmpeg_compiled_libswresample_version: libc::c_int;
+}
+
+#[repr(C)]
+struct SwrContext {
+    _private: [u8; 0],
+}
+
+/// The input parameters a `SwrContext` was configured for.
+#[derive(Copy, Clone, PartialEq, Eq)]
+struct Input {
+    format: SampleFormat,
+    sample_rate: i32,
+    channels: usize,
+    channel_layout: u64,
+}
+
+impl Input {
+    fn of(f: &AudioFrame) -> Self {
+        Input {
+            format: f.format(),
+            sample_rate: f.sample_rate(),
+            channels: f.channels(),
+            channel_layout: f.channel_layout(),
+        }
+    }
+}
+
+/// Converts decoded audio to interleaved `T` samples at a fixed rate and channel count.
+///
+/// The input format is taken from the first frame; if a later frame differs (eg, the stream
+/// changed on reconnect), the resampler flushes and reconfigures itself. Output goes via a
+/// scratch buffer which is reused across calls, so steady-state conversion doesn't allocate.
+pub struct Resampler<T: Sample> {
+    ctx: *mut SwrContext,
+    input: Option<Input>,
+    out_rate: i32,
+    out_channels: usize,
+    scratch: Vec<T>,
+}
+
+// The SwrContext is used only through `&mut self`.
+unsafe impl<T: Sample> Send for Resampler<T> {}
+
+impl<T: Sample> Resampler<T> {
+    pub fn new(out_rate: i32, out_channels: usize) -> Self {
+        assert!(out_rate > 0 && out_channels > 0);
+        Resampler {
+            ctx: ptr::null_mut(),
+            input: None,
+            out_rate,
+            out_channels,
+            scratch: Vec::new(),
+        }
+    }
+
+    fn configure(&mut self, input: Input) -> Result<(), Error> {
+        unsafe { swr_free(&mut self.ctx) };
+        self.input = None;
+        let in_channels =
+            libc::c_int::try_from(input.channels).map_err(|_| Error::invalid_data())?;
+        let out_channels =
+            libc::c_int::try_from(self.out_channels).map_err(|_| Error::invalid_data())?;
+        let in_layout = match input.channel_layout {
+            0 => unsafe { av_get_default_channel_layout(in_channels) },
+            l => l as i64,
+        };
+        unsafe {
+            self.ctx = swr_alloc_set_opts(
+                ptr::null_mut(),
+                av_get_default_channel_layout(out_channels),
+                T::format(),
+                self.out_rate,
+                in_layout,
+                input.format,
+                input.sample_rate,
+                0,
+                ptr::null_mut(),
+            );
+            if self.ctx.is_null() {
+                return Err(Error::enomem());
+            }
+            if let Err(e) = Error::wrap(swr_init(self.ctx)) {
+                swr_free(&mut self.ctx);
+                return Err(e);
+            }
+        }
+        self.input = Some(input);
+        Ok(())
+    }
+
+    /// Runs `swr_convert` with the given input, appending the output to `ring`.
+    fn run(
+        &mut self,
+        in_: *const *mut u8,
+        in_count: libc::c_int,
+        ring: &mut SampleRing<T>,
+    ) -> Result<usize, Error> {
+        let max = Error::wrap(unsafe { swr_get_out_samples(self.ctx, in_count) })? as usize;
+        let needed = max * self.out_channels;
+        if self.scratch.len() < needed {
+            self.scratch.resize(needed, T::default());
+        }
+        let out = [self.scratch.as_mut_ptr() as *mut u8];
+        let n = Error::wrap(unsafe {
+            swr_convert(self.ctx, out.as_ptr(), max as libc::c_int, in_, in_count)
+        })? as usize;
+        ring.push_interleaved(&self.scratch[..n * self.out_channels]);
+        Ok(n)
+    }
+
+    /// Converts `frame`, appending the output to `ring`, which must have `out_channels`
+    /// channels. Returns the number of frames (samples per channel) appended. The resampler may
+    /// buffer some input; see `flush`.
+    pub fn convert(
+        &mut self,
+        frame: &AudioFrame,
+        ring: &mut SampleRing<T>,
+    ) -> Result<usize, Error> {
+        assert_eq!(ring.channels(), self.out_channels);
+        if frame.planes() == 0 {
+            // A null input would mean flush to swr_convert.
+            return Err(Error::invalid_data());
+        }
+        let input = Input::of(frame);
+        let mut n = 0;
+        if self.input != Some(input) {
+            n += self.flush(ring)?;
+            self.configure(input)?;
+        }
+        let in_count =
+            libc::c_int::try_from(frame.nb_samples()).map_err(|_| Error::invalid_data())?;
+        n += self.run(frame.extended_data(), in_count, ring)?;
+        Ok(n)
+    }
+
+    /// Appends any buffered output to `ring`, as at end of stream. Returns the number of frames
+    /// appended.
+    pub fn flush(&mut self, ring: &mut SampleRing<T>) -> Result<usize, Error> {
+        if self.ctx.is_null() {
+            return Ok(0);
+        }
+        let mut total = 0;
+        loop {
+            match self.run(ptr::null(), 0, ring)? {
+                0 => return Ok(total),
+                n => total += n,
+            }
+        }
+    }
+}
+
+impl<T: Sample> Drop for Resampler<T> {
+    fn drop(&mut self) {
+        unsafe { swr_free(&mut self.ctx) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Resampler;
+    use crate::avutil::{AudioFrame, SampleFormat, SampleRing};
+
+    #[test]
+    fn downmix_and_downsample() {
+        crate::Ffmpeg::new();
+        let f = AudioFrame::owned(SampleFormat::fltp(), 2, 48_000, 480).unwrap();
+        let mut r = Resampler::<i16>::new(8_000, 1);
+        let mut ring = SampleRing::new(1024, 1);
+        let mut n = r.convert(&f, &mut ring).unwrap();
+        n += r.convert(&f, &mut ring).unwrap();
+        n += r.flush(&mut ring).unwrap();
+
+        // 960 input samples at 48 kHz are 20 ms, or 160 output samples at 8 kHz. Allow for the
+        // filter's delay.
+        assert_eq!(ring.len(), n);
+        assert!(n > 140 && n <= 170, "n={}", n);
+
+        // A different input rate reconfigures the resampler.
+        let f = AudioFrame::owned(SampleFormat::fltp(), 2, 16_000, 160).unwrap();
+        r.convert(&f, &mut ring).unwrap();
+        r.flush(&mut ring).unwrap();
+        assert!(ring.len() > n + 60, "len={} n={}", ring.len(), n);
+    }
+}
@@ -2,7 +2,13 @@
 // SPDX-License-Identifier: MIT OR Apache-2.0
 
 use crate::avutil::{Error, ImageDimensions, PixelFormat, VideoFrame};
+use crate::stats::ScaleStats;
+use parking_lot::Mutex;
+use std::convert::TryFrom;
+use std::ops::{Deref, DerefMut};
 use std::ptr;
+use std::sync::mpsc;
+use std::sync::Arc;
 
 //#[link(name = "swscale")]
 extern "C" {
@@ -37,7 +43,11 @@ extern "C" {
 extern "C" {
     pub(crate) static moonfire_ffmpeg_compiled_libswscale_version: libc::c_int;
 
+    static moonfire_ffmpeg_sws_area: libc::c_int;
+    static moonfire_ffmpeg_sws_bicubic: libc::c_int;
     static moonfire_ffmpeg_sws_bilinear: libc::c_int;
+    static moonfire_ffmpeg_sws_fast_bilinear: libc::c_int;
+    static moonfire_ffmpeg_sws_point: libc::c_int;
 }
 
 #[repr(C)]
@@ -49,54 +59,716 @@ struct SwsFilter {
     _private: [u8; 0],
 }
 
-pub struct Scaler {
+/// A scaling algorithm, as passed in `sws_getContext`'s flags.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, Hash)]
+pub enum Algorithm {
+    /// Nearest neighbor: fastest, lowest quality.
+    Point,
+
+    /// A cheaper approximation of bilinear; fine for previews.
+    FastBilinear,
+
+    Bilinear,
+
+    Bicubic,
+
+    /// Averages source pixels; well-suited to large downscales such as thumbnails.
+    Area,
+}
+
+impl Algorithm {
+    fn flags(self) -> libc::c_int {
+        unsafe {
+            match self {
+                Algorithm::Point => moonfire_ffmpeg_sws_point,
+                Algorithm::FastBilinear => moonfire_ffmpeg_sws_fast_bilinear,
+                Algorithm::Bilinear => moonfire_ffmpeg_sws_bilinear,
+                Algorithm::Bicubic => moonfire_ffmpeg_sws_bicubic,
+                Algorithm::Area => moonfire_ffmpeg_sws_area,
+            }
+        }
+    }
+}
+
+/// A speed/quality tradeoff, which picks an `Algorithm` for a given conversion.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, Hash)]
+pub enum Preset {
+    Speed,
+    Balanced,
+    Quality,
+}
+
+impl Preset {
+    pub fn algorithm(self, src: ImageDimensions, dst: ImageDimensions) -> Algorithm {
+        let big_downscale = dst.width * 2 <= src.width && dst.height * 2 <= src.height;
+        match self {
+            Preset::Speed => Algorithm::FastBilinear,
+            Preset::Balanced if big_downscale => Algorithm::Area,
+            Preset::Balanced => Algorithm::Bilinear,
+            Preset::Quality => Algorithm::Bicubic,
+        }
+    }
+}
+
+/// Options for `Scaler::with_options`.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, Hash)]
+pub struct ScalerOptions {
+    pub algorithm: Algorithm,
+
+    /// The number of threads (including the caller's) to scale with. With more than one, the
+    /// image is split into horizontal bands, each scaled by its own `SwsContext`. Bands are cut
+    /// only where the source and destination rows line up exactly, and each is scaled from a
+    /// window of rows overlapping its neighbors', so its filter has the same scale ratio and
+    /// phase and sees the same source rows as in single-threaded scaling. The output still may
+    /// differ by a step or two due to rounding in swscale's fixed-point arithmetic. If there's
+    /// no such cut point close enough together (eg from 1080 to 1079 rows), fewer threads are
+    /// used; see `Scaler::threads`.
+    pub threads: usize,
+}
+
+impl Default for ScalerOptions {
+    fn default() -> Self {
+        ScalerOptions {
+            algorithm: Algorithm::Bilinear,
+            threads: 1,
+        }
+    }
+}
+
+/// Don't split images into bands shorter than this many destination rows.
+const MIN_BAND_HEIGHT: libc::c_int = 16;
+
+/// Returns the greatest common divisor of two positive numbers.
+fn gcd(mut a: libc::c_int, mut b: libc::c_int) -> libc::c_int {
+    while b != 0 {
+        let t = a % b;
+        a = b;
+        b = t;
+    }
+    a
+}
+
+/// A horizontal band of the destination image with its own context.
+///
+/// The context scales a window of rows which extends past the band by a margin on each side
+/// (except at the image's edges), into `scratch`; the band's own rows are then copied into the
+/// destination. Without the margins, the filter would clamp at the band's edges, leaving seams.
+struct Band {
     ctx: ptr::NonNull<SwsContext>,
+
+    /// The window of source rows fed to `ctx`.
+    src_y: libc::c_int,
+    src_h: libc::c_int,
+
+    /// The first destination row of the window `ctx` produces.
+    dst_y: libc::c_int,
+
+    /// The destination rows this band is responsible for.
+    keep_y: libc::c_int,
+    keep_h: libc::c_int,
+
+    /// Where `ctx` writes if the window has margins; otherwise it writes into the destination.
+    scratch: Option<VideoFrame>,
+
+    /// The bytes per row of each of `scratch`'s planes.
+    row_bytes: [usize; 4],
+}
+
+impl Drop for Band {
+    fn drop(&mut self) {
+        unsafe { sws_freeContext(self.ctx.as_ptr()) }
+    }
+}
+
+/// Rows for a `Job` to copy from its scratch frame into the destination image.
+struct RowCopy {
+    to: [*mut u8; 4],
+    to_stride: [libc::c_int; 4],
+
+    /// The number of margin rows to skip at the top of each scratch plane.
+    skip: [libc::c_int; 4],
+    rows: [libc::c_int; 4],
+    row_bytes: [usize; 4],
+}
+
+/// The arguments to one `sws_scale` call, sent to a worker thread.
+struct Job {
+    ctx: *mut SwsContext,
+    src: [*const u8; 4],
+    src_stride: [libc::c_int; 4],
+    src_h: libc::c_int,
+    dst: [*mut u8; 4],
+    dst_stride: [libc::c_int; 4],
+    copy: Option<RowCopy>,
+}
+
+// The frames outlive the job: `Scaler::scale` waits for all jobs before returning.
+unsafe impl Send for Job {}
+
+impl Job {
+    unsafe fn run(&self) {
+        sws_scale(
+            self.ctx,
+            self.src.as_ptr(),
+            self.src_stride.as_ptr(),
+            0,
+            self.src_h,
+            self.dst.as_ptr(),
+            self.dst_stride.as_ptr(),
+        );
+        let c = match self.copy {
+            None => return,
+            Some(ref c) => c,
+        };
+        for i in 0..4 {
+            if c.to[i].is_null() {
+                continue;
+            }
+            for r in 0..c.rows[i] {
+                ptr::copy_nonoverlapping(
+                    self.dst[i].offset((c.skip[i] + r) as isize * self.dst_stride[i] as isize),
+                    c.to[i].offset(r as isize * c.to_stride[i] as isize),
+                    c.row_bytes[i],
+                );
+            }
+        }
+    }
+}
+
+struct Worker {
+    jobs: mpsc::Sender<Job>,
+    handle: std::thread::JoinHandle<()>,
+}
+
+pub struct Scaler {
+    /// The bands, top to bottom. `bands[0]` runs on the calling thread; `bands[i]` on
+    /// `workers[i - 1]`.
+    bands: Vec<Band>,
+    workers: Vec<Worker>,
+    done: Option<mpsc::Receiver<()>>,
     src: ImageDimensions,
     dst: ImageDimensions,
+    src_info: crate::avutil::PixFmtInfo,
+    dst_info: crate::avutil::PixFmtInfo,
+    stats: Option<Arc<ScaleStats>>,
 }
 
 impl Scaler {
     pub fn new(src: ImageDimensions, dst: ImageDimensions) -> Result<Self, Error> {
-        // TODO: yuvj420p causes an annoying warning "deprecated pixel format used, make sure you
-        // did set range correctly" here. Looks like we need to change to yuv420p and call
-        // sws_setColorspaceDetails to get the same effect while suppressing this warning.
-        let ctx = ptr::NonNull::new(unsafe {
-            sws_getContext(
-                src.width,
-                src.height,
-                src.pix_fmt,
-                dst.width,
-                dst.height,
-                dst.pix_fmt,
-                moonfire_ffmpeg_sws_bilinear,
-                ptr::null_mut(),
-                ptr::null_mut(),
-                ptr::null(),
-            )
-        })
-        .ok_or_else(Error::unknown)?;
-        Ok(Scaler { ctx, src, dst })
+        Self::with_options(src, dst, &ScalerOptions::default())
     }
 
-    pub fn scale(&mut self, src: &VideoFrame, dst: &mut VideoFrame) {
+    pub fn with_options(
+        src: ImageDimensions,
+        dst: ImageDimensions,
+        opts: &ScalerOptions,
+    ) -> Result<Self, Error> {
+        let src_info = src.pix_fmt.info()?;
+        let dst_info = dst.pix_fmt.info()?;
+        if src.height <= 0 || dst.height <= 0 {
+            return Err(Error::invalid_data());
+        }
+
+        // Band boundaries fall on multiples of `unit` (source rows, destination rows), so that
+        // each band's context has exactly the full image's scale ratio and so the same filter
+        // phase. They also must fall on whole chroma rows in both images and on swscale's 8-row
+        // dither pattern in the destination.
+        let g = gcd(src.height, dst.height);
+        let mut unit = (src.height / g, dst.height / g);
+        let dst_align = std::cmp::max(8, 1 << dst_info.log2_chroma_h);
+        let k = dst_align / gcd(dst_align, unit.1);
+        unit = (unit.0 * k, unit.1 * k);
+        let src_align = 1 << src_info.log2_chroma_h;
+        let k = src_align / gcd(src_align, unit.0);
+        unit = (unit.0 * k, unit.1 * k);
+
+        let units = dst.height / unit.1;
+        let max_bands = std::cmp::max(1, std::cmp::min(units, dst.height / MIN_BAND_HEIGHT));
+        let n = std::cmp::min(
+            libc::c_int::try_from(std::cmp::max(1, opts.threads)).unwrap_or(max_bands),
+            max_bands,
+        );
+
+        // Each band's window extends past it by `margin` units, enough to cover the filter's
+        // reach in source rows: generously, bicubic's two rows either side of center, times the
+        // downscale ratio, doubled per level of chroma subsampling.
+        let ratio = (src.height + dst.height - 1) / dst.height;
+        let log2_chroma_h = std::cmp::max(src_info.log2_chroma_h, dst_info.log2_chroma_h);
+        let reach = (2 * std::cmp::max(1, ratio) + 1) << log2_chroma_h;
+        let margin = if n > 1 {
+            (reach + unit.0 - 1) / unit.0
+        } else {
+            0
+        };
+
+        let mut bands = Vec::with_capacity(n as usize);
+        for i in 0..n {
+            let (start, end) = (units * i / n, units * (i + 1) / n);
+            let keep_y = start * unit.1;
+            let keep_end = if i + 1 == n { dst.height } else { end * unit.1 };
+            let win_start = std::cmp::max(0, start - margin);
+            let (src_y, dst_y) = (win_start * unit.0, win_start * unit.1);
+            let (src_end, dst_end) = if i + 1 == n || end + margin >= units {
+                (src.height, dst.height)
+            } else {
+                ((end + margin) * unit.0, (end + margin) * unit.1)
+            };
+            let mut row_bytes = [0; 4];
+            let scratch = if dst_y == keep_y && dst_end == keep_end {
+                None
+            } else {
+                let s = VideoFrame::owned(ImageDimensions {
+                    width: dst.width,
+                    height: dst_end - dst_y,
+                    pix_fmt: dst.pix_fmt,
+                })?;
+                for p in 0..dst_info.nb_planes as usize {
+                    row_bytes[p] = s.try_plane(p)?.row_bytes;
+                }
+                Some(s)
+            };
+            // TODO: yuvj420p causes an annoying warning "deprecated pixel format used, make
+            // sure you did set range correctly" here. Looks like we need to change to yuv420p
+            // and call sws_setColorspaceDetails to get the same effect while suppressing this
+            // warning.
+            let ctx = ptr::NonNull::new(unsafe {
+                sws_getContext(
+                    src.width,
+                    src_end - src_y,
+                    src.pix_fmt,
+                    dst.width,
+                    dst_end - dst_y,
+                    dst.pix_fmt,
+                    opts.algorithm.flags(),
+                    ptr::null_mut(),
+                    ptr::null_mut(),
+                    ptr::null(),
+                )
+            })
+            .ok_or_else(Error::unknown)?;
+            bands.push(Band {
+                ctx,
+                src_y,
+                src_h: src_end - src_y,
+                dst_y,
+                keep_y,
+                keep_h: keep_end - keep_y,
+                scratch,
+                row_bytes,
+            });
+        }
+        let mut scaler = Scaler {
+            bands,
+            workers: Vec::new(),
+            done: None,
+            src,
+            dst,
+            src_info,
+            dst_info,
+            stats: None,
+        };
+        if scaler.bands.len() > 1 {
+            let (done_tx, done_rx) = mpsc::channel();
+            for _ in 1..scaler.bands.len() {
+                let (jobs_tx, jobs_rx) = mpsc::channel::<Job>();
+                let done_tx = done_tx.clone();
+                let handle = std::thread::Builder::new()
+                    .name("scaler".to_owned())
+                    .spawn(move || {
+                        for job in jobs_rx {
+                            unsafe { job.run() };
+                            if done_tx.send(()).is_err() {
+                                break;
+                            }
+                        }
+                    })
+                    .map_err(|_| Error::enomem())?;
+                scaler.workers.push(Worker {
+                    jobs: jobs_tx,
+                    handle,
+                });
+            }
+            scaler.done = Some(done_rx);
+        }
+        Ok(scaler)
+    }
+
+    /// Returns the number of bands (and thus threads) actually used.
+    pub fn threads(&self) -> usize {
+        self.bands.len()
+    }
+
+    fn job(&self, band: &Band, src: &VideoFrame, dst: &mut VideoFrame) -> Job {
+        let mut job = Job {
+            ctx: band.ctx.as_ptr(),
+            src: [ptr::null(); 4],
+            src_stride: [0; 4],
+            src_h: band.src_h,
+            dst: [ptr::null_mut(); 4],
+            dst_stride: [0; 4],
+            copy: None,
+        };
+        let mut copy = RowCopy {
+            to: [ptr::null_mut(); 4],
+            to_stride: [0; 4],
+            skip: [0; 4],
+            rows: [0; 4],
+            row_bytes: band.row_bytes,
+        };
+        for i in 0..4 {
+            unsafe {
+                let s = *src.stuff.data.add(i);
+                let ss = *src.stuff.linesizes.add(i);
+                if !s.is_null() {
+                    let rows = band.src_y >> self.src_info.log2_h(i);
+                    job.src[i] = s.offset(rows as isize * ss as isize);
+                    job.src_stride[i] = ss;
+                }
+                let d = *dst.stuff.data.add(i);
+                let ds = *dst.stuff.linesizes.add(i);
+                if d.is_null() {
+                    continue;
+                }
+                let l = self.dst_info.log2_h(i);
+                match band.scratch {
+                    None => {
+                        job.dst[i] = d.offset((band.dst_y >> l) as isize * ds as isize);
+                        job.dst_stride[i] = ds;
+                    }
+                    Some(ref scratch) => {
+                        job.dst[i] = *scratch.stuff.data.add(i);
+                        job.dst_stride[i] = *scratch.stuff.linesizes.add(i);
+                        let keep_end = band.keep_y + band.keep_h;
+                        copy.to[i] = d.offset((band.keep_y >> l) as isize * ds as isize);
+                        copy.to_stride[i] = ds;
+                        copy.skip[i] = (band.keep_y - band.dst_y) >> l;
+                        copy.rows[i] = ((keep_end + (1 << l) - 1) >> l) - (band.keep_y >> l);
+                    }
+                }
+            }
+        }
+        if band.scratch.is_some() {
+            job.copy = Some(copy);
+        }
+        job
+    }
+
+    /// Records frame counts and `scale` latency into `stats`, which may be shared with other
+    /// scalers. A `ScalerCache` clears this when the scaler is returned.
+    pub fn set_stats(&mut self, stats: Option<Arc<ScaleStats>>) {
+        self.stats = stats;
+    }
+
+    pub fn stats(&self) -> Option<&Arc<ScaleStats>> {
+        self.stats.as_ref()
+    }
+
+    /// Scales `src` into `dst`, first copying `dst`'s buffers if they're shared with another
+    /// frame (see `VideoFrame::share`).
+    pub fn scale(&mut self, src: &VideoFrame, dst: &mut VideoFrame) -> Result<(), Error> {
         assert_eq!(src.dims(), self.src);
         assert_eq!(dst.dims(), self.dst);
-        unsafe {
-            sws_scale(
-                self.ctx.as_ptr(),
-                src.stuff.data.cast(),
-                src.stuff.linesizes,
-                0,
-                self.src.height,
-                dst.stuff.data,
-                dst.stuff.linesizes,
-            )
-        };
+        dst.make_writable()?;
+        let stats = self.stats.as_deref();
+        crate::stats::time(stats.map(|s| &s.scale), || self.scale_bands(src, dst));
+        if let Some(s) = stats {
+            s.add_frame();
+        }
+        Ok(())
+    }
+
+    fn scale_bands(&self, src: &VideoFrame, dst: &mut VideoFrame) {
+        for (band, worker) in self.bands[1..].iter().zip(&self.workers) {
+            let job = self.job(band, src, dst);
+            worker
+                .jobs
+                .send(job)
+                .expect("scaler worker should be alive");
+        }
+        let job = self.job(&self.bands[0], src, dst);
+        unsafe { job.run() };
+        if let Some(ref done) = self.done {
+            for _ in 0..self.workers.len() {
+                done.recv().expect("scaler worker should be alive");
+            }
+        }
     }
 }
 
+// The contexts are only used by one thread at a time: the owner's, or a worker's while the owner
+// waits within `scale`.
+unsafe impl Send for Scaler {}
+
 impl Drop for Scaler {
     fn drop(&mut self) {
-        unsafe { sws_freeContext(self.ctx.as_ptr()) }
+        for w in self.workers.drain(..) {
+            drop(w.jobs);
+            let _ = w.handle.join();
+        }
+        // The bands (and their contexts) are freed afterward.
+    }
+}
+
+type ScalerKey = (ImageDimensions, ImageDimensions, ScalerOptions);
+
+/// A cache of idle `Scaler`s, to avoid the expensive `sws_getContext` setup when a stream
+/// restarts or changes resolution back and forth.
+///
+/// It's `Sync`, so a single cache (in an `Arc`) can be shared by a pool of worker threads.
+/// Each checked-out `Scaler` is used exclusively by one thread; when the `CachedScaler` is
+/// dropped, it's returned to the cache. The least recently returned scalers are evicted
+/// beyond `capacity`.
+pub struct ScalerCache {
+    capacity: usize,
+
+    /// Idle scalers, least recently used first.
+    idle: Mutex<Vec<(ScalerKey, Scaler)>>,
+}
+
+impl ScalerCache {
+    pub fn new(capacity: usize) -> Self {
+        ScalerCache {
+            capacity,
+            idle: Mutex::new(Vec::with_capacity(capacity)),
+        }
+    }
+
+    /// Checks out a scaler for the given conversion, creating one if there's no idle match.
+    pub fn get(
+        &self,
+        src: ImageDimensions,
+        dst: ImageDimensions,
+        opts: &ScalerOptions,
+    ) -> Result<CachedScaler, Error> {
+        let key = (src, dst, *opts);
+        let cached = {
+            let mut l = self.idle.lock();
+            let i = l.iter().rposition(|(k, _)| *k == key);
+            i.map(|i| l.remove(i).1)
+        };
+        let scaler = match cached {
+            Some(s) => s,
+            None => Scaler::with_options(src, dst, opts)?,
+        };
+        Ok(CachedScaler {
+            cache: self,
+            key,
+            scaler: Some(scaler),
+        })
+    }
+
+    /// Returns the number of idle scalers.
+    pub fn len(&self) -> usize {
+        self.idle.lock().len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Drops all idle scalers.
+    pub fn clear(&self) {
+        let idle = std::mem::replace(&mut *self.idle.lock(), Vec::new());
+        drop(idle); // outside the lock: dropping joins worker threads.
+    }
+}
+
+/// A `Scaler` checked out of a `ScalerCache`.
+pub struct CachedScaler<'c> {
+    cache: &'c ScalerCache,
+    key: ScalerKey,
+    scaler: Option<Scaler>,
+}
+
+impl<'c> Deref for CachedScaler<'c> {
+    type Target = Scaler;
+    fn deref(&self) -> &Scaler {
+        self.scaler.as_ref().unwrap()
+    }
+}
+
+impl<'c> DerefMut for CachedScaler<'c> {
+    fn deref_mut(&mut self) -> &mut Scaler {
+        self.scaler.as_mut().unwrap()
+    }
+}
+
+impl<'c> Drop for CachedScaler<'c> {
+    fn drop(&mut self) {
+        let mut scaler = self.scaler.take().unwrap();
+        scaler.set_stats(None);
+        let evicted = {
+            let mut l = self.cache.idle.lock();
+            l.push((self.key, scaler));
+            if l.len() > self.cache.capacity {
+                Some(l.remove(0))
+            } else {
+                None
+            }
+        };
+        drop(evicted);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Algorithm, Scaler, ScalerCache, ScalerOptions};
+    use crate::avutil::{ImageDimensions, PixelFormat, VideoFrame};
+
+    /// Returns a triangle wave from 0 to 127 and back with the given period.
+    fn triangle(v: usize, period: usize) -> u8 {
+        let half = period / 2;
+        let d = (v % period) as isize - half as isize;
+        (d.abs() as usize * 127 / half) as u8
+    }
+
+    /// Banded scaling should match single-threaded scaling on an image which varies both
+    /// vertically and horizontally, including across band edges. Each sample may differ by at
+    /// most 2 due to fixed-point rounding in the bands' contexts.
+    #[test]
+    fn banded() {
+        crate::Ffmpeg::new();
+        let cases = [
+            (
+                ImageDimensions {
+                    width: 1920,
+                    height: 1080,
+                    pix_fmt: PixelFormat::rgb24(),
+                },
+                ImageDimensions {
+                    width: 640,
+                    height: 360,
+                    pix_fmt: PixelFormat::bgr24(),
+                },
+                Algorithm::Area,
+            ),
+            (
+                ImageDimensions {
+                    width: 1280,
+                    height: 720,
+                    pix_fmt: PixelFormat::yuv420p(),
+                },
+                ImageDimensions {
+                    width: 854,
+                    height: 480,
+                    pix_fmt: PixelFormat::yuv420p(),
+                },
+                Algorithm::Bicubic,
+            ),
+        ];
+        for &(src_dims, dst_dims, algorithm) in &cases {
+            let mut src = VideoFrame::owned(src_dims).unwrap();
+            for i in 0.. {
+                let p = match src.plane_mut(i) {
+                    Ok(p) => p,
+                    Err(_) => break,
+                };
+                for y in 0..p.height {
+                    for x in 0..p.row_bytes {
+                        p.data[y * p.linesize + x] = triangle(y + 17 * i, 54) + triangle(x, 40);
+                    }
+                }
+            }
+            let mut out = Vec::new();
+            for &threads in &[1, 4] {
+                let opts = ScalerOptions { algorithm, threads };
+                let mut s = Scaler::with_options(src_dims, dst_dims, &opts).unwrap();
+                assert_eq!(s.threads(), threads);
+                let mut dst = VideoFrame::owned(dst_dims).unwrap();
+                s.scale(&src, &mut dst).unwrap();
+                let mut samples = Vec::new();
+                for i in 0.. {
+                    match dst.try_plane(i) {
+                        Ok(p) => p.rows().for_each(|r| samples.extend_from_slice(r)),
+                        Err(_) => break,
+                    }
+                }
+                out.push(samples);
+            }
+            assert_eq!(out[0].len(), out[1].len());
+            let max_diff = out[0]
+                .iter()
+                .zip(&out[1])
+                .map(|(&a, &b)| (i16::from(a) - i16::from(b)).abs())
+                .max()
+                .unwrap();
+            assert!(
+                max_diff <= 2,
+                "{} -> {}: max_diff={}",
+                src_dims,
+                dst_dims,
+                max_diff
+            );
+        }
+    }
+
+    #[test]
+    fn scale_into_shared() {
+        crate::Ffmpeg::new();
+        let dims = ImageDimensions {
+            width: 32,
+            height: 16,
+            pix_fmt: PixelFormat::rgb24(),
+        };
+        let fill = |v| {
+            let mut f = VideoFrame::owned(dims).unwrap();
+            for row in f.plane_mut(0).unwrap().rows_mut() {
+                for b in row.iter_mut() {
+                    *b = v;
+                }
+            }
+            f
+        };
+        let (a, b) = (fill(10), fill(200));
+        let mut s = Scaler::new(dims, dims).unwrap();
+        let mut dst = VideoFrame::owned(dims).unwrap();
+        s.scale(&a, &mut dst).unwrap();
+        let shared = dst.share().unwrap();
+
+        // Scaling into `dst` again must leave the shared frame's buffer alone.
+        s.scale(&b, &mut dst).unwrap();
+        assert!(shared.plane(0).rows().all(|r| r.iter().all(|&v| v == 10)));
+        assert!(dst.plane(0).rows().all(|r| r.iter().all(|&v| v == 200)));
+    }
+
+    #[test]
+    fn cache() {
+        crate::Ffmpeg::new();
+        let a = ImageDimensions {
+            width: 64,
+            height: 48,
+            pix_fmt: PixelFormat::rgb24(),
+        };
+        let b = ImageDimensions {
+            width: 32,
+            height: 24,
+            pix_fmt: PixelFormat::bgr24(),
+        };
+        let opts = ScalerOptions::default();
+        let cache = std::sync::Arc::new(ScalerCache::new(2));
+        {
+            let _s1 = cache.get(a, b, &opts).unwrap();
+            let _s2 = cache.get(a, b, &opts).unwrap(); // concurrent checkout creates another.
+            assert_eq!(cache.len(), 0);
+        }
+        assert_eq!(cache.len(), 2);
+
+        // Reuse from another thread.
+        let c = cache.clone();
+        std::thread::spawn(move || {
+            let mut s = c.get(a, b, &opts).unwrap();
+            let src = VideoFrame::owned(a).unwrap();
+            let mut dst = VideoFrame::owned(b).unwrap();
+            s.scale(&src, &mut dst).unwrap();
+        })
+        .join()
+        .unwrap();
+        assert_eq!(cache.len(), 2);
+
+        // A new key evicts the least recently used entry.
+        drop(cache.get(b, a, &opts).unwrap());
+        assert_eq!(cache.len(), 2);
+        cache.clear();
+        assert!(cache.is_empty());
     }
 }
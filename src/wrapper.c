@@ -7,21 +7,32 @@
 #include <libavformat/avformat.h>
 #include <libavformat/version.h>
 #include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/dict.h>
 #include <libavutil/ffversion.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/log.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
 #include <libavutil/version.h>
+#ifdef MOONFIRE_USE_SWRESAMPLE
+#include <libswresample/swresample.h>
+#include <libswresample/version.h>
+#endif
+
 #ifdef MOONFIRE_USE_SWSCALE
 #include <libswscale/swscale.h>
 #include <libswscale/version.h>
 #endif
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 const char *moonfire_ffmpeg_version = FFMPEG_VERSION;
 
@@ -29,9 +40,17 @@ const int moonfire_ffmpeg_compiled_libavcodec_version = LIBAVCODEC_VERSION_INT;
 const int moonfire_ffmpeg_compiled_libavformat_version = LIBAVFORMAT_VERSION_INT;
 const int moonfire_ffmpeg_compiled_libavutil_version = LIBAVUTIL_VERSION_INT;
 
+#ifdef MOONFIRE_USE_SWRESAMPLE
+const int moonfire_ffmpeg_compiled_libswresample_version = LIBSWRESAMPLE_VERSION_INT;
+#endif
+
 #ifdef MOONFIRE_USE_SWSCALE
 const int moonfire_ffmpeg_compiled_libswscale_version = LIBSWSCALE_VERSION_INT;
+const int moonfire_ffmpeg_sws_area = SWS_AREA;
+const int moonfire_ffmpeg_sws_bicubic = SWS_BICUBIC;
 const int moonfire_ffmpeg_sws_bilinear = SWS_BILINEAR;
+const int moonfire_ffmpeg_sws_fast_bilinear = SWS_FAST_BILINEAR;
+const int moonfire_ffmpeg_sws_point = SWS_POINT;
 #endif
 
 const int moonfire_ffmpeg_av_dict_ignore_suffix = AV_DICT_IGNORE_SUFFIX;
@@ -44,19 +63,45 @@ const int moonfire_ffmpeg_avmedia_type_video = AVMEDIA_TYPE_VIDEO;
 
 const int moonfire_ffmpeg_av_codec_id_aac = AV_CODEC_ID_AAC;
 const int moonfire_ffmpeg_av_codec_id_h264 = AV_CODEC_ID_H264;
+const int moonfire_ffmpeg_av_codec_id_mjpeg = AV_CODEC_ID_MJPEG;
+
+const int moonfire_ffmpeg_ff_thread_frame = FF_THREAD_FRAME;
+const int moonfire_ffmpeg_ff_thread_slice = FF_THREAD_SLICE;
+
+const int moonfire_ffmpeg_avdiscard_none = AVDISCARD_NONE;
+const int moonfire_ffmpeg_avdiscard_default = AVDISCARD_DEFAULT;
+const int moonfire_ffmpeg_avdiscard_nonref = AVDISCARD_NONREF;
+const int moonfire_ffmpeg_avdiscard_bidir = AVDISCARD_BIDIR;
+const int moonfire_ffmpeg_avdiscard_nonintra = AVDISCARD_NONINTRA;
+const int moonfire_ffmpeg_avdiscard_nonkey = AVDISCARD_NONKEY;
+const int moonfire_ffmpeg_avdiscard_all = AVDISCARD_ALL;
 
 const int moonfire_ffmpeg_averror_decoder_not_found = AVERROR_DECODER_NOT_FOUND;
+const int moonfire_ffmpeg_averror_demuxer_not_found = AVERROR_DEMUXER_NOT_FOUND;
 const int moonfire_ffmpeg_averror_invalid_data = AVERROR_INVALIDDATA;
+const int moonfire_ffmpeg_averror_eagain = AVERROR(EAGAIN);
 const int moonfire_ffmpeg_averror_eof = AVERROR_EOF;
 const int moonfire_ffmpeg_averror_enomem = AVERROR(ENOMEM);
 const int moonfire_ffmpeg_averror_enosys = AVERROR(ENOSYS);
+const int moonfire_ffmpeg_averror_etimedout = AVERROR(ETIMEDOUT);
+const int moonfire_ffmpeg_averror_exit = AVERROR_EXIT;
 const int moonfire_ffmpeg_averror_unknown = AVERROR_UNKNOWN;
 
 const int moonfire_ffmpeg_pix_fmt_rgb24 = AV_PIX_FMT_RGB24;
 const int moonfire_ffmpeg_pix_fmt_bgr24 = AV_PIX_FMT_BGR24;
+const int moonfire_ffmpeg_pix_fmt_yuv420p = AV_PIX_FMT_YUV420P;
+const int moonfire_ffmpeg_pix_fmt_yuvj420p = AV_PIX_FMT_YUVJ420P;
+const int moonfire_ffmpeg_sample_fmt_s16 = AV_SAMPLE_FMT_S16;
+const int moonfire_ffmpeg_sample_fmt_s16p = AV_SAMPLE_FMT_S16P;
+const int moonfire_ffmpeg_sample_fmt_flt = AV_SAMPLE_FMT_FLT;
+const int moonfire_ffmpeg_sample_fmt_fltp = AV_SAMPLE_FMT_FLTP;
 
 const int moonfire_ffmpeg_avseek_force = AVSEEK_FORCE;
 const int moonfire_ffmpeg_avseek_size = AVSEEK_SIZE;
+
+const int moonfire_ffmpeg_avseek_flag_any = AVSEEK_FLAG_ANY;
+const int moonfire_ffmpeg_avseek_flag_byte = AVSEEK_FLAG_BYTE;
+const int moonfire_ffmpeg_avseek_flag_frame = AVSEEK_FLAG_FRAME;
 const int moonfire_ffmpeg_seek_set = SEEK_SET;
 const int moonfire_ffmpeg_seek_cur = SEEK_CUR;
 const int moonfire_ffmpeg_seek_end = SEEK_END;
@@ -192,17 +237,133 @@ struct moonfire_ffmpeg_frame_stuff {
     uint8_t **data;
     int *linesizes;
     int64_t pts;
+    bool hw;
+};
+
+struct moonfire_ffmpeg_packet_info {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    uint8_t *data;
+    size_t size;
+    int stream_index;
+    bool is_key;
 };
 
+void moonfire_ffmpeg_packet_info(const AVPacket *pkt,
+                                 struct moonfire_ffmpeg_packet_info *info) {
+    info->pts = pkt->pts;
+    info->dts = pkt->dts;
+    info->duration = pkt->duration;
+    info->data = pkt->data;
+    info->size = pkt->size;
+    info->stream_index = pkt->stream_index;
+    info->is_key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+}
+
 struct moonfire_ffmpeg_streams moonfire_ffmpeg_fctx_streams(AVFormatContext *ctx) {
     struct moonfire_ffmpeg_streams s = {ctx->streams, ctx->nb_streams};
     return s;
 }
 
+int moonfire_ffmpeg_fctx_read_frame(AVFormatContext *ctx, AVPacket *pkt,
+                                    struct moonfire_ffmpeg_packet_info *info) {
+    int ret = av_read_frame(ctx, pkt);
+    if (ret >= 0) {
+        moonfire_ffmpeg_packet_info(pkt, info);
+    }
+    return ret;
+}
+
+// Reads up to `max` packets into `pkts` (which must be blank), filling the
+// corresponding `infos` and setting `*n` to the number read. Stops at the
+// first error, returning it.
+int moonfire_ffmpeg_fctx_read_frames(AVFormatContext *ctx, AVPacket **pkts,
+                                     struct moonfire_ffmpeg_packet_info *infos,
+                                     size_t max, size_t *n) {
+    size_t i;
+    int ret = 0;
+    for (i = 0; i < max; ++i) {
+        ret = av_read_frame(ctx, pkts[i]);
+        if (ret < 0) {
+            break;
+        }
+        moonfire_ffmpeg_packet_info(pkts[i], &infos[i]);
+    }
+    *n = i;
+    return ret;
+}
+
 int moonfire_ffmpeg_fctx_open_write(AVFormatContext *ctx, const char *url) {
+    if (ctx->oformat->flags & AVFMT_NOFILE) {
+        return 0;
+    }
     return avio_open(&ctx->pb, url, AVIO_FLAG_WRITE);
 }
 
+// Closes a pb opened by moonfire_ffmpeg_fctx_open_write, if any.
+void moonfire_ffmpeg_fctx_close_write(AVFormatContext *ctx) {
+    if (!(ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&ctx->pb);
+    }
+}
+
+// Writes out any bytes buffered in an output context's pb, if it has one.
+void moonfire_ffmpeg_fctx_flush(AVFormatContext *ctx) {
+    if (ctx->pb != NULL) {
+        avio_flush(ctx->pb);
+    }
+}
+
+// Adds a stream to an output context, returning its index.
+int moonfire_ffmpeg_fctx_new_stream(AVFormatContext *ctx, const AVCodecParameters *par,
+                                    AVRational time_base) {
+    AVStream *st = avformat_new_stream(ctx, NULL);
+    if (st == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = avcodec_parameters_copy(st->codecpar, par);
+    if (ret < 0) {
+        return ret;
+    }
+    st->codecpar->codec_tag = 0;  // let the muxer choose a tag valid for its container.
+    st->time_base = time_base;
+    return st->index;
+}
+
+// Writes a new reference to pkt via scratch, in the stream's (possibly muxer-chosen) time base.
+int moonfire_ffmpeg_fctx_write_packet(AVFormatContext *ctx, AVPacket *scratch,
+                                      const AVPacket *pkt, int stream_index,
+                                      AVRational time_base) {
+    int ret = av_packet_ref(scratch, pkt);
+    if (ret < 0) {
+        return ret;
+    }
+    scratch->stream_index = stream_index;
+    scratch->pos = -1;
+    av_packet_rescale_ts(scratch, time_base, ctx->streams[stream_index]->time_base);
+    return av_interleaved_write_frame(ctx, scratch);  // takes ownership of scratch's ref.
+}
+
+void moonfire_ffmpeg_fctx_set_interrupt_callback(AVFormatContext *ctx, int (*cb)(void *),
+                                                void *opaque) {
+    ctx->interrupt_callback.callback = cb;
+    ctx->interrupt_callback.opaque = opaque;
+}
+
+// Matches moonfire_ffmpeg::avformat::RawProbe. Negative fields keep libavformat's defaults.
+struct moonfire_ffmpeg_probe {
+    int64_t probesize;
+    int64_t max_analyze_duration;
+    int fps_probe_size;
+};
+
+void moonfire_ffmpeg_fctx_set_probe(AVFormatContext *ctx, const struct moonfire_ffmpeg_probe *p) {
+    if (p->probesize >= 0) ctx->probesize = p->probesize;
+    if (p->max_analyze_duration >= 0) ctx->max_analyze_duration = p->max_analyze_duration;
+    if (p->fps_probe_size >= 0) ctx->fps_probe_size = p->fps_probe_size;
+}
+
 void moonfire_ffmpeg_fctx_set_pb(AVFormatContext *ctx, AVIOContext *pb) {
     assert(ctx->pb == NULL);
     ctx->pb = pb;
@@ -212,6 +373,12 @@ void moonfire_ffmpeg_ioctx_set_direct(AVIOContext *pb) {
     pb->direct = 1;
 }
 
+// Frees a custom AVIOContext and its buffer (which libavformat may have reallocated).
+void moonfire_ffmpeg_ioctx_free(AVIOContext **pb) {
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
 void moonfire_ffmpeg_cctx_params(const AVCodecContext *ctx, struct VideoParameters *p) {
     p->width = ctx->width;
     p->height = ctx->height;
@@ -228,43 +395,395 @@ void moonfire_ffmpeg_cctx_set_params(AVCodecContext *ctx, const struct VideoPara
     ctx->time_base = p->time_base;
 }
 
-AVPacket *moonfire_ffmpeg_packet_alloc(void) { return malloc(sizeof(AVPacket)); }
-void moonfire_ffmpeg_packet_free(AVPacket *pkt) { free(pkt); }
-bool moonfire_ffmpeg_packet_is_key(AVPacket *pkt) { return (pkt->flags & AV_PKT_FLAG_KEY) != 0; }
-int64_t moonfire_ffmpeg_packet_pts(AVPacket *pkt) { return pkt->pts; }
+struct moonfire_ffmpeg_threading {
+    int count;
+    int type;
+};
+
+void moonfire_ffmpeg_cctx_set_threading(AVCodecContext *ctx,
+                                        const struct moonfire_ffmpeg_threading *t) {
+    ctx->thread_count = t->count;
+    ctx->thread_type = t->type;
+}
+
+// Before avcodec_open2, returns the requested number of threads and allowed types.
+struct moonfire_ffmpeg_threading moonfire_ffmpeg_cctx_configured_threading(
+        const AVCodecContext *ctx) {
+    struct moonfire_ffmpeg_threading t = {ctx->thread_count, ctx->thread_type};
+    return t;
+}
+
+// After avcodec_open2, returns the number of threads and the type actually in use.
+struct moonfire_ffmpeg_threading moonfire_ffmpeg_cctx_threading(const AVCodecContext *ctx) {
+    struct moonfire_ffmpeg_threading t = {ctx->thread_count, ctx->active_thread_type};
+    return t;
+}
+
+struct moonfire_ffmpeg_discard {
+    int skip_frame;
+    int skip_loop_filter;
+    int skip_idct;
+};
+
+void moonfire_ffmpeg_cctx_set_discard(AVCodecContext *ctx,
+                                      const struct moonfire_ffmpeg_discard *d) {
+    ctx->skip_frame = d->skip_frame;
+    ctx->skip_loop_filter = d->skip_loop_filter;
+    ctx->skip_idct = d->skip_idct;
+}
+
+struct moonfire_ffmpeg_discard moonfire_ffmpeg_cctx_discard(const AVCodecContext *ctx) {
+    struct moonfire_ffmpeg_discard d = {ctx->skip_frame, ctx->skip_loop_filter, ctx->skip_idct};
+    return d;
+}
+
+// avcodec_get_hw_config and av_hwdevice_find_type_by_name were added in
+// ffmpeg 4.0.
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+static enum AVPixelFormat hw_get_format(AVCodecContext *ctx,
+                                        const enum AVPixelFormat *fmts) {
+    enum AVPixelFormat hw_fmt = (enum AVPixelFormat)(intptr_t)ctx->opaque;
+    for (const enum AVPixelFormat *p = fmts; *p != AV_PIX_FMT_NONE; p++) {
+        if (*p == hw_fmt) {
+            return hw_fmt;
+        }
+    }
+
+    // The hardware can't handle this stream (eg an unsupported profile).
+    // Fall back to software decoding.
+    return avcodec_default_get_format(ctx, fmts);
+}
+#endif
+
+// Sets up hardware decoding on `ctx`, before avcodec_open2. `type_name` is
+// an ffmpeg device type name such as "vaapi", "cuda", or "qsv"; `device` may
+// be NULL for the default device. Returns AVERROR(ENOSYS) if this ffmpeg or
+// codec doesn't support that type.
+int moonfire_ffmpeg_cctx_set_hwaccel(AVCodecContext *ctx, const char *type_name,
+                                     const char *device) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(type_name);
+    if (type == AV_HWDEVICE_TYPE_NONE) {
+        return AVERROR(ENOSYS);
+    }
+    enum AVPixelFormat hw_fmt = AV_PIX_FMT_NONE;
+    for (int i = 0;; i++) {
+        const AVCodecHWConfig *c = avcodec_get_hw_config(ctx->codec, i);
+        if (c == NULL) {
+            break;
+        }
+        if ((c->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) != 0 &&
+            c->device_type == type) {
+            hw_fmt = c->pix_fmt;
+            break;
+        }
+    }
+    if (hw_fmt == AV_PIX_FMT_NONE) {
+        return AVERROR(ENOSYS);
+    }
+    AVBufferRef *dev = NULL;
+    int ret = av_hwdevice_ctx_create(&dev, type, device, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    ctx->hw_device_ctx = dev;  // freed by avcodec_free_context.
+    ctx->opaque = (void *)(intptr_t)hw_fmt;
+    ctx->get_format = hw_get_format;
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+bool moonfire_ffmpeg_cctx_is_hw(const AVCodecContext *ctx) {
+    return ctx->hw_device_ctx != NULL;
+}
+
+// Parses the next chunk of data into pkt, which refers to either the input or the parser's
+// buffer (not reference-counted). Returns the number of bytes consumed or an error.
+int moonfire_ffmpeg_parser_parse(AVCodecParserContext *p, AVCodecContext *c, AVPacket *pkt,
+                                 const uint8_t *data, int size, int64_t pts, int64_t dts,
+                                 struct moonfire_ffmpeg_packet_info *info) {
+    uint8_t *out;
+    int out_size;
+    int ret = av_parser_parse2(p, c, &out, &out_size, data, size, pts, dts, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    av_packet_unref(pkt);
+    pkt->data = out;
+    pkt->size = out_size;
+    if (out_size > 0) {
+        pkt->pts = p->pts;
+        pkt->dts = p->dts;
+        pkt->duration = p->duration;
+        if (p->key_frame == 1) {
+            pkt->flags |= AV_PKT_FLAG_KEY;
+        }
+    }
+    moonfire_ffmpeg_packet_info(pkt, info);
+    return ret;
+}
+
+// Creates and initializes a bitstream filter chain such as "h264_mp4toannexb,dump_extra".
+int moonfire_ffmpeg_bsf_new(const char *filters, const AVCodecParameters *par,
+                            AVRational time_base, AVBSFContext **out) {
+    AVBSFContext *ctx;
+    int ret = av_bsf_list_parse_str(filters, &ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((ret = avcodec_parameters_copy(ctx->par_in, par)) < 0) {
+        goto fail;
+    }
+    ctx->time_base_in = time_base;
+    if ((ret = av_bsf_init(ctx)) < 0) {
+        goto fail;
+    }
+    *out = ctx;
+    return 0;
+fail:
+    av_bsf_free(&ctx);
+    return ret;
+}
+
+// Sends a new reference to pkt via scratch (which av_bsf_send_packet takes ownership of).
+int moonfire_ffmpeg_bsf_send_packet(AVBSFContext *ctx, AVPacket *scratch, const AVPacket *pkt) {
+    int ret = av_packet_ref(scratch, pkt);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = av_bsf_send_packet(ctx, scratch);
+    if (ret < 0) {
+        av_packet_unref(scratch);
+    }
+    return ret;
+}
+
+const AVCodecParameters *moonfire_ffmpeg_bsf_par_out(const AVBSFContext *ctx) {
+    return ctx->par_out;
+}
+
+AVRational moonfire_ffmpeg_bsf_time_base_out(const AVBSFContext *ctx) {
+    return ctx->time_base_out;
+}
+
+int moonfire_ffmpeg_packet_detach(AVPacket *dst, AVPacket *src,
+                                  struct moonfire_ffmpeg_packet_info *dst_info) {
+    if (src->buf == NULL) {
+        // The demuxer returned a packet which is only valid until the next
+        // av_read_frame call; av_packet_ref makes a reference-counted copy.
+        int ret = av_packet_ref(dst, src);
+        av_packet_unref(src);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        av_packet_move_ref(dst, src);
+    }
+    moonfire_ffmpeg_packet_info(dst, dst_info);
+    return 0;
+}
 void moonfire_ffmpeg_packet_set_dts(AVPacket *pkt, int64_t dts) { pkt->dts = dts; }
 void moonfire_ffmpeg_packet_set_pts(AVPacket *pkt, int64_t pts) { pkt->pts = pts; }
 void moonfire_ffmpeg_packet_set_duration(AVPacket *pkt, int dur) { pkt->duration = dur; }
-int64_t moonfire_ffmpeg_packet_dts(AVPacket *pkt) { return pkt->dts; }
-int moonfire_ffmpeg_packet_duration(AVPacket *pkt) { return pkt->duration; }
-int moonfire_ffmpeg_packet_stream_index(AVPacket *pkt) { return pkt->stream_index; }
-struct moonfire_ffmpeg_data moonfire_ffmpeg_packet_data(AVPacket *pkt) {
-    struct moonfire_ffmpeg_data d = {pkt->data, pkt->size};
-    return d;
-}
 
 AVCodecParameters *moonfire_ffmpeg_stream_codecpar(AVStream *stream) { return stream->codecpar; }
 int64_t moonfire_ffmpeg_stream_duration(AVStream *stream) { return stream->duration; }
 AVRational moonfire_ffmpeg_stream_time_base(AVStream *stream) { return stream->time_base; }
 
+// Accessors for the demuxer's index; the AVStream fields were made private in ffmpeg 4.4.
+int moonfire_ffmpeg_stream_index_len(AVStream *stream) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 65, 100)
+    return avformat_index_get_entries_count(stream);
+#else
+    return stream->nb_index_entries;
+#endif
+}
+
+// Copies the first n index entries into the given arrays.
+void moonfire_ffmpeg_stream_index(AVStream *stream, int n, int64_t *pos, int64_t *timestamp,
+                                  int *size, bool *is_key) {
+    for (int i = 0; i < n; i++) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 65, 100)
+        const AVIndexEntry *e = avformat_index_get_entry(stream, i);
+#else
+        const AVIndexEntry *e = &stream->index_entries[i];
+#endif
+        pos[i] = e->pos;
+        timestamp[i] = e->timestamp;
+        size[i] = e->size;
+        is_key[i] = (e->flags & AVINDEX_KEYFRAME) != 0;
+    }
+}
+
 int moonfire_ffmpeg_cctx_codec_id(AVCodecContext *cctx) { return cctx->codec_id; }
 int moonfire_ffmpeg_cctx_codec_type(AVCodecContext *cctx) { return cctx->codec_type; }
 int moonfire_ffmpeg_cctx_height(AVCodecContext *cctx) { return cctx->height; }
 int moonfire_ffmpeg_cctx_width(AVCodecContext *cctx) { return cctx->width; }
 int moonfire_ffmpeg_cctx_pix_fmt(AVCodecContext *cctx) { return cctx->pix_fmt; }
+struct moonfire_ffmpeg_data moonfire_ffmpeg_cctx_extradata(AVCodecContext *cctx) {
+    struct moonfire_ffmpeg_data d = {cctx->extradata, cctx->extradata_size};
+    return d;
+}
 
 int moonfire_ffmpeg_frame_image_alloc(
     AVFrame* frame, struct moonfire_ffmpeg_image_dimensions* dims) {
-    // TODO: any reason to support an alignment other than 32?
-    int r = av_image_alloc(frame->data, frame->linesize, dims->width, dims->height, dims->pix_fmt,
-                           32);
-    if (r < 0) {
-        return r;
-    }
     frame->width = dims->width;
     frame->height = dims->height;
     frame->format = dims->pix_fmt;
-    return r;
+    return av_frame_get_buffer(frame, 32);
+}
+
+// A pool of reference-counted image buffers of a single size. Unlike
+// av_frame_get_buffer, both the plane pointers and linesizes are aligned to
+// `align`, which must be a power of two.
+struct moonfire_ffmpeg_frame_pool {
+    AVBufferPool *pool;
+    struct moonfire_ffmpeg_image_dimensions dims;
+    int align;
+    int linesizes[4];
+};
+
+int moonfire_ffmpeg_frame_pool_new(struct moonfire_ffmpeg_frame_pool **out,
+                                   const struct moonfire_ffmpeg_image_dimensions *dims,
+                                   int align) {
+    struct moonfire_ffmpeg_frame_pool *p = av_mallocz(sizeof(*p));
+    if (p == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    p->dims = *dims;
+    p->align = align;
+    int ret = av_image_fill_linesizes(p->linesizes, dims->pix_fmt, dims->width);
+    if (ret < 0) {
+        av_free(p);
+        return ret;
+    }
+    for (int i = 0; i < 4; i++) {
+        p->linesizes[i] = FFALIGN(p->linesizes[i], align);
+    }
+    uint8_t *data[4];
+    int size = av_image_fill_pointers(data, dims->pix_fmt, dims->height, NULL, p->linesizes);
+    if (size < 0) {
+        av_free(p);
+        return size;
+    }
+
+    // Over-allocate so the first plane can be aligned within the buffer.
+    p->pool = av_buffer_pool_init(size + align - 1, NULL);
+    if (p->pool == NULL) {
+        av_free(p);
+        return AVERROR(ENOMEM);
+    }
+    *out = p;
+    return 0;
+}
+
+int moonfire_ffmpeg_frame_pool_get(struct moonfire_ffmpeg_frame_pool *p, AVFrame *frame) {
+    AVBufferRef *buf = av_buffer_pool_get(p->pool);
+    if (buf == NULL) {
+        return AVERROR(ENOMEM);
+    }
+    uint8_t *base = (uint8_t *)FFALIGN((uintptr_t)buf->data, (uintptr_t)p->align);
+    av_frame_unref(frame);
+    frame->buf[0] = buf;
+    frame->width = p->dims.width;
+    frame->height = p->dims.height;
+    frame->format = p->dims.pix_fmt;
+    for (int i = 0; i < 4; i++) {
+        frame->linesize[i] = p->linesizes[i];
+    }
+    int ret = av_image_fill_pointers(frame->data, p->dims.pix_fmt, p->dims.height, base,
+                                     frame->linesize);
+    if (ret < 0) {
+        av_frame_unref(frame);
+        return ret;
+    }
+    return 0;
+}
+
+// Frees the pool. The underlying buffers are freed as outstanding frames
+// release them.
+void moonfire_ffmpeg_frame_pool_free(struct moonfire_ffmpeg_frame_pool *p) {
+    av_buffer_pool_uninit(&p->pool);
+    av_free(p);
+}
+
+struct moonfire_ffmpeg_pix_fmt_info {
+    int nb_planes;
+    int log2_chroma_w;
+    int log2_chroma_h;
+};
+
+int moonfire_ffmpeg_pix_fmt_info(int pix_fmt, struct moonfire_ffmpeg_pix_fmt_info *info) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    if (desc == NULL) {
+        return AVERROR(EINVAL);
+    }
+    info->nb_planes = av_pix_fmt_count_planes(pix_fmt);
+    info->log2_chroma_w = desc->log2_chroma_w;
+    info->log2_chroma_h = desc->log2_chroma_h;
+    return 0;
+}
+
+struct moonfire_ffmpeg_plane_geometry {
+    int width;
+    int height;
+    int row_bytes;
+};
+
+// Returns the dimensions of a plane of an image, accounting for chroma subsampling, and the
+// number of meaningful bytes in each of its rows.
+int moonfire_ffmpeg_plane_geometry(int pix_fmt, int width, int height, int plane,
+                                   struct moonfire_ffmpeg_plane_geometry *g) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    int linesizes[4];
+    int ret;
+    if (desc == NULL || plane < 0 || plane >= av_pix_fmt_count_planes(pix_fmt) ||
+        (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) != 0) {
+        return AVERROR(EINVAL);
+    }
+    if ((ret = av_image_fill_linesizes(linesizes, pix_fmt, width)) < 0) {
+        return ret;
+    }
+    bool chroma = plane == 1 || plane == 2;
+    g->width = chroma ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w) : width;
+    g->height = chroma ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+    g->row_bytes = linesizes[plane];
+    return 0;
+}
+
+void moonfire_ffmpeg_frame_set_pts(AVFrame *frame, int64_t pts) { frame->pts = pts; }
+
+// Matches moonfire_ffmpeg::avutil::AudioStuff.
+struct moonfire_ffmpeg_audio_stuff {
+    uint8_t **data;
+    int nb_samples;
+    int sample_rate;
+    int channels;
+    int format;
+    uint64_t channel_layout;
+    int64_t pts;
+};
+
+void moonfire_ffmpeg_frame_audio_stuff(AVFrame *frame, struct moonfire_ffmpeg_audio_stuff *s) {
+    s->data = frame->extended_data;
+    s->nb_samples = frame->nb_samples;
+    s->sample_rate = frame->sample_rate;
+    s->channels = frame->channels;
+    s->format = frame->format;
+    s->channel_layout = frame->channel_layout;
+    s->pts = frame->pts;
+}
+
+int moonfire_ffmpeg_frame_audio_alloc(AVFrame *frame, int format, int channels, int sample_rate,
+                                      int nb_samples) {
+    frame->format = format;
+    frame->channels = channels;
+    frame->channel_layout = av_get_default_channel_layout(channels);
+    frame->sample_rate = sample_rate;
+    frame->nb_samples = nb_samples;
+    return av_frame_get_buffer(frame, 0);
 }
 
 void moonfire_ffmpeg_frame_stuff(AVFrame *frame,
@@ -275,6 +794,7 @@ void moonfire_ffmpeg_frame_stuff(AVFrame *frame,
     s->data = frame->data;
     s->linesizes = frame->linesize;
     s->pts = frame->pts;
+    s->hw = frame->hw_frames_ctx != NULL;
 }
 
 int moonfire_ffmpeg_codecpar_codec_id(AVCodecParameters *codecpar) { return codecpar->codec_id; }
@@ -293,3 +813,29 @@ struct moonfire_ffmpeg_data moonfire_ffmpeg_codecpar_extradata(AVCodecParameters
     struct moonfire_ffmpeg_data d = {codecpar->extradata, codecpar->extradata_size};
     return d;
 }
+
+// Fills in video parameters as a demuxer would, copying the extradata into a padded buffer as
+// decoders require.
+int moonfire_ffmpeg_codecpar_set_video(AVCodecParameters *par, int codec_id,
+                                       const struct moonfire_ffmpeg_image_dimensions *dims,
+                                       const uint8_t *extradata, size_t extradata_size) {
+    if (extradata_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+        return AVERROR(EINVAL);
+    }
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+    if (extradata_size > 0) {
+        par->extradata = av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (par->extradata == NULL) {
+            return AVERROR(ENOMEM);
+        }
+        memcpy(par->extradata, extradata, extradata_size);
+        par->extradata_size = (int)extradata_size;
+    }
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = codec_id;
+    par->width = dims->width;
+    par->height = dims->height;
+    par->format = dims->pix_fmt;
+    return 0;
+}